@@ -130,9 +130,27 @@ typedef struct __kstat        kstat_t;
 #define PROT_GROWSDOWN 0X01000000
 #define PROT_GROWSUP   0X02000000
 
-#define MAP_FILE    0
-#define MAP_SHARED  0x01
-#define MAP_PRIVATE 0X02
-#define MAP_FAILED  ((void *)-1)
+#define MAP_FILE      0
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0X02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_FAILED    ((void *)-1)
+
+// for clone, low byte is the signal sent to parent on exit
+#define CLONE_VM             0x00000100
+#define CLONE_FS             0x00000200
+#define CLONE_FILES          0x00000400
+#define CLONE_SIGHAND        0x00000800
+#define CLONE_THREAD         0x00010000
+#define CLONE_SETTLS         0x00080000
+#define CLONE_PARENT_SETTID  0x00100000
+#define CLONE_CHILD_CLEARTID 0x00200000
+#define CLONE_CHILD_SETTID   0x01000000
+
+// for futex
+#define FUTEX_WAIT         0
+#define FUTEX_WAKE         1
+#define FUTEX_PRIVATE_FLAG 128
 
 #endif // __STDDEF_H__
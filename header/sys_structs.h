@@ -33,4 +33,52 @@ struct timespec {
     long     tv_nsec; /* 纳秒, 范围在0~999999999 */
 };
 
+struct timeval {
+    uint64_t tv_sec;  /* 秒 */
+    long     tv_usec; /* 微秒 */
+};
+
+#define PRIO_PROCESS 0
+#define PRIO_PGRP    1
+#define PRIO_USER    2
+
+#define RUSAGE_SELF     0
+#define RUSAGE_CHILDREN (-1)
+
+struct rusage {
+    struct timeval ru_utime;    /* user CPU time used */
+    struct timeval ru_stime;    /* system CPU time used */
+    long           ru_maxrss;   /* resident set size in KB, current not peak */
+    long           ru_ixrss;    /* integral shared memory size */
+    long           ru_idrss;    /* integral unshared data size */
+    long           ru_isrss;    /* integral unshared stack size */
+    long           ru_minflt;   /* page reclaims (soft page faults) */
+    long           ru_majflt;   /* page faults (hard page faults) */
+    long           ru_nswap;    /* swaps */
+    long           ru_inblock;  /* block input operations */
+    long           ru_oublock;  /* block output operations */
+    long           ru_msgsnd;   /* IPC messages sent */
+    long           ru_msgrcv;   /* IPC messages received */
+    long           ru_nsignals; /* signals received */
+    long           ru_nvcsw;    /* voluntary context switches */
+    long           ru_nivcsw;   /* involuntary context switches */
+};
+
+// for spawn, file actions are applied in order on the child's file table
+#define SPAWN_FA_CLOSE    1 // close fd
+#define SPAWN_FA_DUP2     2 // dup fd to newfd
+#define SPAWN_MAX_ACTIONS 8
+
+struct spawn_file_action {
+    int action;
+    int fd;
+    int newfd;
+};
+
+typedef struct {
+    const char              *cwd; // NULL to inherit parent's
+    int                      nactions;
+    struct spawn_file_action actions[SPAWN_MAX_ACTIONS];
+} spawn_attr_t;
+
 #endif // __SYS_STRUCTS_H__
\ No newline at end of file
@@ -12,6 +12,7 @@
 #define SYS_ticks 1
 #define SYS_print 2
 #define SYS_sleep 3
+#define SYS_spawn 4
 #define SYS_test  2333
 #endif
 
@@ -44,10 +45,14 @@
 #define SYS_munmap       215
 #define SYS_mmap         222
 #define SYS_times        153
+#define SYS_getrusage    165
 #define SYS_uname        160
 #define SYS_sched_yield  124
+#define SYS_setpriority  140
+#define SYS_getpriority  141
 #define SYS_gettimeofday 169
 #define SYS_nanosleep    101
+#define SYS_futex        98
 #endif
 
 #endif // __SYSCALL_NUMS_H__
\ No newline at end of file
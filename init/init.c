@@ -139,25 +139,16 @@ void test_execve(const char *name) {
             return;
     }
 
-    int ret = fork();
-    if (ret == 0) {
-        // child
-        /*
-        const char *argv[] = {name, NULL};
-        const char *env[]  = {NULL};
-        printf("Try execve %s.\n", name);
-        int r = execve(name, (char *const *)argv, (char *const *)env);
-        printf("Execve failed: %d.\n", r);
-        exit(r); */
-        printf("%s\n", name);
-        exit(10);
-    } else if (ret > 0) {
-        // parent
+    const char *argv[] = {name, NULL};
+    const char *env[]  = {NULL};
+    // no fork, the test is loaded into a fresh process
+    int ret = spawn(name, (char *const *)argv, (char *const *)env, NULL);
+    if (ret > 0) {
         int status;
-        int pid = wait4(WAIT_ANY, &status, 0);
+        int pid = wait4(ret, &status, 0);
         printf("PID %d exited with status %d.\n", pid, status);
     } else {
-        printf("!!!!Error while fork.\n");
+        printf("!!!!Error while spawn %s: %d.\n", name, ret);
     }
 }
 
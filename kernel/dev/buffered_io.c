@@ -20,6 +20,8 @@ static struct {
     block_rw_t  dev_rw[MAX_DEV_ID];
 } bio_cache;
 
+static KMEM_CACHE_DEFINE(bio_buffer_cache, "buffered_io", buffered_io_t);
+
 buffered_io_t *bio_cache_get(uint16_t dev, uint64_t addr) {
     spinlock_acquire(&bio_cache.lock);
     int i = 0;
@@ -52,14 +54,15 @@ buffered_io_t *bio_cache_get(uint16_t dev, uint64_t addr) {
             if (todelete->dirty)
                 bio_cache_flush(todelete);
             list_del(&todelete->list);
-            kfree((char *)todelete);
+            kmem_cache_free(&bio_buffer_cache, todelete);
         } else {
             kprintf(
                 "[BIO] Cached too many buffers, currently hold %d (max %d).\n",
                 i + 1, MAX_BIO_CACHE);
         }
     }
-    buffered_io_t *buffer = (buffered_io_t *)kmalloc(sizeof(buffered_io_t));
+    buffered_io_t *buffer =
+        (buffered_io_t *)kmem_cache_alloc(&bio_buffer_cache);
     assert(buffer, "No memory while alloc buffered io.");
     memset(buffer, 0, sizeof(buffered_io_t));
     buffer->dev[0] = dev;
@@ -109,8 +112,18 @@ void bio_cache_release(buffered_io_t *buf) {
     spinlock_release(&bio_cache.lock);
 }
 
-void bio_cache_pin(buffered_io_t *buf) { buf->reference++; }
-void bio_cache_unpin(buffered_io_t *buf) { buf->reference--; }
+// keep buf cached without holding its lock, data may change under us
+void bio_cache_pin(buffered_io_t *buf) {
+    spinlock_acquire(&bio_cache.lock);
+    buf->reference++;
+    spinlock_release(&bio_cache.lock);
+}
+
+void bio_cache_unpin(buffered_io_t *buf) {
+    spinlock_acquire(&bio_cache.lock);
+    buf->reference--;
+    spinlock_release(&bio_cache.lock);
+}
 
 // vfs pack for bio, fs not using this.
 static int bio_read(file_t *file, char *buffer, size_t offset, size_t len) {
@@ -16,6 +16,8 @@ static int pipe_write(file_t *file, const char *buffer, size_t offset,
                       size_t len);
 static int pipe_close(file_t *file);
 
+static KMEM_CACHE_DEFINE(pipe_cache, "pipe", pipe_t);
+
 static file_ops_t pipe_ops = {
     .open   = NULL,
     .close  = pipe_close,
@@ -37,12 +39,14 @@ int pipe_create(file_t *reader, file_t *writer) {
     writer->f_mode = O_WRONLY;
     reader->f_mode = O_RDONLY;
 
-    pipe_t *pipe = (pipe_t *)kmalloc(sizeof(pipe_t));
+    pipe_t *pipe = (pipe_t *)kmem_cache_alloc(&pipe_cache);
     if (!pipe)
         return -1;
     memset(pipe, 0, sizeof(pipe_t));
 
     spinlock_init(&pipe->lock);
+    wait_queue_init(&pipe->read_wait);
+    wait_queue_init(&pipe->write_wait);
     spinlock_acquire(&pipe->lock);
     pipe->read_open = pipe->write_open = true;
     pipe->nread = pipe->nwrite = 0;
@@ -59,7 +63,7 @@ static int pipe_read(file_t *file, char *buffer, size_t offset, size_t len) {
     spinlock_acquire(&pipe->lock);
     while (pipe->nread == pipe->nwrite && pipe->write_open) {
         // write open, and no more write, wait
-        sleep(&pipe->nread, &pipe->lock);
+        sleep_on(&pipe->read_wait, &pipe->lock);
     }
     int i;
     for (i = 0; i < len; i++) {
@@ -69,7 +73,7 @@ static int pipe_read(file_t *file, char *buffer, size_t offset, size_t len) {
         char c    = pipe->data[pipe->nread++ % PIPE_SIZE]; // circular buffer
         buffer[i] = c;
     }
-    wakeup(&pipe->nwrite); // if write wait us
+    wake_up(&pipe->write_wait); // if write wait us
     spinlock_release(&pipe->lock);
     return i;
 }
@@ -89,14 +93,14 @@ static int pipe_write(file_t *file, const char *buffer, size_t offset,
                 spinlock_release(&pipe->lock);
                 return -1;
             }
-            wakeup(&pipe->nread);              // wakeup read
-            sleep(&pipe->nwrite, &pipe->lock); // wait could write
+            wake_up(&pipe->read_wait);                // wakeup read
+            sleep_on(&pipe->write_wait, &pipe->lock); // wait could write
         }
         // write
         pipe->data[pipe->nwrite++ % PIPE_SIZE] = buffer[i];
     }
     // complete, wakeup read
-    wakeup(&pipe->nread);
+    wake_up(&pipe->read_wait);
     spinlock_release(&pipe->lock);
     return i;
 }
@@ -106,15 +110,15 @@ static int pipe_close(file_t *file) {
     spinlock_acquire(&pipe->lock);
     if (file->f_mode == O_WRONLY) {
         pipe->write_open = false;
-        wakeup(&pipe->nread);
+        wake_up(&pipe->read_wait);
     } else {
         pipe->read_open = false;
-        wakeup(&pipe->nwrite);
+        wake_up(&pipe->write_wait);
     }
     if (pipe->read_open == false && pipe->write_open == false) {
         // all close, turn off
         spinlock_release(&pipe->lock);
-        kfree(pipe);
+        kmem_cache_free(&pipe_cache, pipe);
     } else {
         spinlock_release(&pipe->lock);
     }
@@ -2,14 +2,16 @@
 // Created by shiroko on 22-5-16.
 //
 #include <dev/dev.h>
+#include <lib/stdlib.h>
 #include <lib/sys/SBI.h>
 #include <lib/sys/sleeplock.h>
 #include <proc.h>
 #include <vfs.h>
 
 struct {
-    sleeplock_t w_lock; // Write to console
-    spinlock_t  r_lock; // Read from console
+    sleeplock_t  w_lock; // Write to console
+    spinlock_t   r_lock; // Read from console
+    wait_queue_t r_wait; // wait for input
     // circular buffer
 #define BUFFER_SIZE 256
     char   buffer[BUFFER_SIZE];
@@ -23,7 +25,7 @@ static inline char read_buffer() {
     char data;
     while (cons.count == 0) {
         // IMPORTANT: we assume that only proc context need to read buffer.
-        sleep(&cons.count, &cons.r_lock);
+        sleep_on(&cons.r_wait, &cons.r_lock);
     }
     data = *(cons.tail);
     cons.tail++;
@@ -39,7 +41,7 @@ static inline char peek_buffer(size_t offset) {
     char data;
     while (cons.count == 0) {
         // IMPORTANT: we assume that only proc context need to read buffer.
-        sleep(&cons.count, &cons.r_lock);
+        sleep_on(&cons.r_wait, &cons.r_lock);
     }
     if (cons.tail + offset >= cons.buffer + BUFFER_SIZE)
         data = *(cons.buffer +
@@ -65,15 +67,23 @@ static inline void write_buffer(char data) {
         cons.head = cons.buffer;
     cons.count++;
     spinlock_release(&cons.r_lock);
-    wakeup(&cons.count);
+    wake_up(&cons.r_wait);
 }
 
 int console_write(file_t *file, const char *buffer, size_t offset, size_t len) {
+    char   kbuf[64]; // buffer may be a user address
+    size_t i = 0;
     sleeplock_acquire(&cons.w_lock);
-    for (int i = 0; i < len; i++) {
-        SBI_putchar(buffer[i]);
+    while (i < len) {
+        size_t n = MIN(len - i, sizeof(kbuf));
+        if (copy_from_buffer(kbuf, buffer + i, n) != 0)
+            break;
+        for (size_t j = 0; j < n; j++)
+            SBI_putchar(kbuf[j]);
+        i += n;
     }
     sleeplock_release(&cons.w_lock);
+    return i == 0 && len ? -1 : (int)i;
 }
 
 int console_read(file_t *file, char *buffer, size_t offset, size_t len) {}
@@ -82,20 +92,22 @@ static inode_ops_t inode_ops = {
     .link = NULL, .lookup = NULL, .mkdir = NULL, .rmdir = NULL, .unlink = NULL};
 
 static file_ops_t file_ops = {
-    .flush  = NULL,
-    .mmap   = NULL,
-    .munmap = NULL,
-    .write  = console_write,
-    .read   = console_read,
-    .open   = NULL,
-    .close  = NULL,
-    .seek   = NULL,
+    .flush       = NULL,
+    .mmap        = NULL,
+    .munmap      = NULL,
+    .write       = console_write,
+    .read        = console_read,
+    .open        = NULL,
+    .close       = NULL,
+    .seek        = NULL,
+    .user_buffer = true,
 };
 
 int init_console(dev_driver_t *drv) {
     cons.tail = cons.head = cons.buffer;
     cons.count            = 0;
     spinlock_init(&cons.r_lock);
+    wait_queue_init(&cons.r_wait);
     sleeplock_init(&cons.w_lock);
 
     // setup vfs
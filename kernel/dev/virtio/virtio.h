@@ -7,6 +7,7 @@
 
 #include <types.h>
 #include <lib/bitset.h>
+#include <lib/sys/waitqueue.h>
 
 #define VIRTIO_MMIO_MAX_BUS     32
 #define VIRTIO_MMIO_MAGIC       0x74726976
@@ -102,6 +103,7 @@ typedef struct {
     bitset_t desc_used_map[BITSET_ARRAY_SIZE_FOR(VIRTIO_MMIO_QUEUE_NUM_VALUE)];
     uint32_t used_idx; // what we looked
     virtio_mmio_ring_t *io_ring;
+    wait_queue_t        desc_wait; // wait for free descriptors
 } virtio_mmio_queue_t;
 
 // Functions for register virtio device
@@ -33,11 +33,18 @@ static struct {
     bool                initialized;
     virtio_mmio_queue_t queue;
     struct {
+        // request header, device reads it by physical address
+        struct {
+            uint32_t type;
+            uint32_t rsvd;
+            uint64_t sector;
+        } hdr;
         // TODO: link to buffered io
-        char   *addr;
-        size_t  size;
-        uint8_t status;
-        uint8_t ok;
+        char        *addr;
+        size_t       size;
+        uint8_t      status;
+        uint8_t      ok;
+        wait_queue_t done; // wait for completion
     } trace[VIRTIO_MMIO_QUEUE_NUM_VALUE];
     spinlock_t lock;
 } virtio_disk = {.initialized = false};
@@ -74,6 +81,9 @@ void virtio_disk_setup(char *ioaddr, int interrupt, int interrupt_parent) {
     memset(&virtio_disk, 0, sizeof(virtio_disk));
     virtio_disk.initialized = true;
     spinlock_init(&virtio_disk.lock);
+    wait_queue_init(&virtio_disk.queue.desc_wait);
+    for (int i = 0; i < VIRTIO_MMIO_QUEUE_NUM_VALUE; i++)
+        wait_queue_init(&virtio_disk.trace[i].done);
     spinlock_acquire(&virtio_disk.lock);
     virtio_disk.io_addr = ioaddr;
     // Setup MMIO
@@ -166,20 +176,17 @@ int virtio_disk_rw(uint64_t sector, char *buf, size_t count, int func) {
     for (;;) {
         if (virtio_queue_desc_alloc_some(&virtio_disk.queue, 3, idx) == 0)
             break;
-        sleep(&virtio_disk.queue.desc_used_map, &virtio_disk.lock);
+        sleep_on(&virtio_disk.queue.desc_wait, &virtio_disk.lock);
     }
     // setup descs
-    struct {
-        uint32_t type;
-        uint32_t rsvd;
-        uint64_t sector;
-    } buf0 = {.type   = func == 0 ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT,
-              .rsvd   = 0,
-              .sector = sector};
-    // buf0 in kstack is directly mapped
+    // header can not live in kstack, kstack is not directly mapped
+    typeof(virtio_disk.trace[0].hdr) *buf0 = &virtio_disk.trace[idx[0]].hdr;
+    buf0->type   = func == 0 ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+    buf0->rsvd   = 0;
+    buf0->sector = sector;
     virtio_mmio_queue_desc_t *desc_table = virtio_disk.queue.io_ring->desc;
-    desc_table[idx[0]].addr              = (uintptr_t)&buf0;
-    desc_table[idx[0]].length            = sizeof(buf0);
+    desc_table[idx[0]].addr              = (uintptr_t)buf0;
+    desc_table[idx[0]].length            = sizeof(*buf0);
     desc_table[idx[0]].flags             = VIRTIO_MMIO_QUEUE_DESC_F_NEXT;
     desc_table[idx[0]].next              = idx[1];
 
@@ -215,7 +222,7 @@ int virtio_disk_rw(uint64_t sector, char *buf, size_t count, int func) {
 
     // wait the interrupt
     while (virtio_disk.trace[idx[0]].ok == 0) {
-        sleep(&virtio_disk.trace[idx[0]], &virtio_disk.lock);
+        sleep_on(&virtio_disk.trace[idx[0]].done, &virtio_disk.lock);
     }
 
     // got data
@@ -292,7 +299,7 @@ static int virtio_disk_interrupt_handler(void) {
         if (virtio_disk.trace[idx].status != 0)
             kpanic("Virtio disk status non-zero.");
         virtio_disk.trace[idx].ok = 1;
-        wakeup(&virtio_disk.trace[idx]);
+        wake_up(&virtio_disk.trace[idx].done);
         *used_idx = (*used_idx + 1) % VIRTIO_MMIO_QUEUE_NUM_VALUE;
     }
     spinlock_release(&virtio_disk.lock);
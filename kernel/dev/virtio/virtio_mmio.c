@@ -85,7 +85,7 @@ void virtio_queue_desc_free(virtio_mmio_queue_t *queue, int idx) {
     queue->io_ring->desc[idx].addr = 0;
     clear_bit(queue->desc_used_map, idx);
     // application may sleep on this
-    wakeup(queue->desc_used_map);
+    wake_up(&queue->desc_wait);
 }
 
 int virtio_queue_desc_alloc_some(virtio_mmio_queue_t *queue, int num,
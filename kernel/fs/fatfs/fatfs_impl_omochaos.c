@@ -3,14 +3,13 @@
 //
 #include "./fatfs.h"
 #include <dev/buffered_io.h>
+#include <lib/stdlib.h>
 #include <lib/string.h>
 #include <types.h>
 
 #define __FAT_FS_DEBUG__ 0
 #include <driver/console.h>
 
-#define MIN(a, b) (((a) < (b)) ? (a) : (b))
-
 static size_t HD_drv_read(uint16_t drv, uint32_t lba, char *buf, size_t bytes) {
     bio_cache_read(drv, lba);
     return bytes;
@@ -388,6 +387,21 @@ typedef struct {
 } fatfs_inode_index_t;
 
 static int open(file_t *file) { return 0; }
+
+// Copy n bytes at off of a cached sector to buffer. The buffer is pinned and
+// unlocked while copying: faulting in a user buffer may read a file mapping
+// through the same cache, or wait for mm->lock held by such a fault.
+static int read_sector(uint16_t dev, size_t addr, char *buffer, size_t off,
+                       size_t n) {
+    buffered_io_t *buf = bio_cache_read(dev, addr);
+    bio_cache_pin(buf);
+    bio_cache_release(buf);
+    int r = copy_to_buffer(buffer, buf->data + off, n);
+    bio_cache_unpin(buf);
+    return r;
+}
+
+// buffer may be a user address, data is copied from bio cache directly.
 static int read(file_t *file, char *buffer, size_t offset, size_t len) {
     fatfs_inode_data_t *fidata = (fatfs_inode_data_t *)file->f_inode->i_fs_data;
     uint32_t            clus   = fidata->start_clus;
@@ -405,14 +419,13 @@ static int read(file_t *file, char *buffer, size_t offset, size_t len) {
     size_t   r_size = len;
 
     if (p_clus % 512) {
-        size_t         s = MIN(512 - (p_clus % 512), r_size);
-        buffered_io_t *buf =
-            bio_cache_read(fs->drv, CLUS2SECTOR(fs, clus) * fs->BytesPerSec);
-        memcpy(buffer, buf->data + (p_clus % 512), s);
+        size_t s = MIN(512 - (p_clus % 512), r_size);
+        if (read_sector(fs->drv, CLUS2SECTOR(fs, clus) * fs->BytesPerSec,
+                        buffer, p_clus % 512, s) != 0)
+            return -1;
         buffer += s; // buf is sector aligned now
         p_clus += s;
         r_size -= s;
-        bio_cache_release(buf);
     }
     if (r_size == 0)
         return len;
@@ -423,10 +436,11 @@ static int read(file_t *file, char *buffer, size_t offset, size_t len) {
         kpanic("Error of p_clus' value!");
     }
     for (; r_size > 512;) {
-        buffered_io_t *buf = bio_cache_read(
-            fs->drv, (CLUS2SECTOR(fs, clus) + p_clus / 512) * fs->BytesPerSec);
-        memcpy(buffer, buf->data, BUFFER_SIZE);
-        bio_cache_release(buf);
+        if (read_sector(fs->drv,
+                        (CLUS2SECTOR(fs, clus) + p_clus / 512) *
+                            fs->BytesPerSec,
+                        buffer, 0, BUFFER_SIZE) != 0)
+            return -1;
         r_size -= 512;
         p_clus += 512;
         buffer += 512;
@@ -436,10 +450,11 @@ static int read(file_t *file, char *buffer, size_t offset, size_t len) {
         }
     }
     if (r_size) {
-        buffered_io_t *buf = bio_cache_read(
-            fs->drv, (CLUS2SECTOR(fs, clus) + p_clus / 512) * fs->BytesPerSec);
-        memcpy(buffer, buf->data, r_size);
-        bio_cache_release(buf);
+        if (read_sector(fs->drv,
+                        (CLUS2SECTOR(fs, clus) + p_clus / 512) *
+                            fs->BytesPerSec,
+                        buffer, 0, r_size) != 0)
+            return -1;
     }
     return len;
 }
@@ -472,6 +487,8 @@ static file_ops_t file_ops = {
     .mmap   = mmap,
     .flush  = flush,
     .close  = close,
+    // write is not implemented, takes nothing from buffer
+    .user_buffer = true,
 };
 
 typedef int (*fat_dirent_loop_callback_t)(union FAT32_DirEnt *dirent,
@@ -634,10 +651,8 @@ static int read_dir(inode_t *dir, read_dir_callback callback, void *data) {
         inode->i_size   = dirent->FileSize;
         inode->i_nlinks = 1;
 
-        dentry_t *dentry = (dentry_t *)kmalloc(sizeof(dentry_t));
-        memset(dentry, 0, sizeof(dentry_t));
-        dentry->d_subdirs = (list_head_t)LIST_HEAD_INIT(dentry->d_subdirs);
-        dentry->d_inode   = inode;
+        dentry_t *dentry = vfs_alloc_dentry();
+        dentry->d_inode  = inode;
         if (strlen(long_name) <= D_NAME_LEN - 1)
             strcpy(dentry->d_name, long_name);
         else {
@@ -39,6 +39,9 @@ dentry_t dev_dentry = {
 
 LIST_HEAD(filesystems_list);
 
+static KMEM_CACHE_DEFINE(file_cache, "file", file_t);
+static KMEM_CACHE_DEFINE(dentry_cache, "dentry", dentry_t);
+
 void init_vfs() {
     kprintf("[VFS] Start initialize.\n");
     list_add(&sys_dentry.d_subdirs_list, &root_dentry.d_subdirs);
@@ -268,10 +271,8 @@ int vfs_link_inode(inode_t *inode, dentry_t *parent, const char *name) {
     } else {
         r = inode->i_op->link(inode, parent->d_inode, name);
     }
-    dentry_t *d = (dentry_t *)kmalloc(sizeof(dentry_t));
-    memset(d, 0, sizeof(dentry_t));
-    d->d_subdirs = (list_head_t)LIST_HEAD_INIT(d->d_subdirs);
-    d->d_parent  = parent;
+    dentry_t *d = vfs_alloc_dentry();
+    d->d_parent = parent;
     if (inode->i_type == inode_dir)
         d->d_type = D_TYPE_DIR;
     else
@@ -282,9 +283,27 @@ int vfs_link_inode(inode_t *inode, dentry_t *parent, const char *name) {
     return r;
 }
 
-file_t *vfs_open(dentry_t *dentry, int mode) {
-    file_t *file = (file_t *)kmalloc(sizeof(file_t));
+dentry_t *vfs_alloc_dentry() {
+    dentry_t *d = (dentry_t *)kmem_cache_alloc(&dentry_cache);
+    if (!d)
+        return NULL;
+    memset(d, 0, sizeof(dentry_t));
+    d->d_subdirs = (list_head_t)LIST_HEAD_INIT(d->d_subdirs);
+    return d;
+}
+
+file_t *vfs_alloc_file() {
+    file_t *file = (file_t *)kmem_cache_alloc(&file_cache);
+    if (!file)
+        return NULL;
     memset(file, 0, sizeof(file_t));
+    return file;
+}
+
+void vfs_free_file(file_t *file) { kmem_cache_free(&file_cache, file); }
+
+file_t *vfs_open(dentry_t *dentry, int mode) {
+    file_t *file = vfs_alloc_file();
     file->f_dentry = dentry;
     file->f_inode  = dentry->d_inode;
     file->f_offset = 0;
@@ -301,20 +320,21 @@ file_t *vfs_open(dentry_t *dentry, int mode) {
 }
 
 file_t *vfs_fdup(file_t *old) {
-    old->f_counts++;
+    // threads sharing the fdtable dup and close concurrently
+    __sync_fetch_and_add(&old->f_counts, 1);
     return old;
 }
 
 int vfs_close(file_t *file) {
-    --file->f_counts;
-    if (unlikely(file->f_counts < 0)) {
+    int counts = __sync_sub_and_fetch(&file->f_counts, 1);
+    if (unlikely(counts < 0)) {
         kpanic("fild closed execced opens.");
-    } else if (file->f_counts == 0) {
+    } else if (counts == 0) {
         int r = 0;
         if (file->f_op && file->f_op->close) {
             r = file->f_op->close(file);
         }
-        kfree(file);
+        vfs_free_file(file);
         return r;
     }
     return 0;
@@ -379,12 +399,10 @@ dentry_t *vfs_mkdir(dentry_t *parent, const char *path, int mode) {
     if (!dinode)
         return NULL; // no dinode created.
     // add to dentries
-    dentry_t *new = (dentry_t *)kmalloc(sizeof(dentry_t));
-    memset(new, 0, sizeof(dentry_t));
-    new->d_subdirs = (list_head_t)LIST_HEAD_INIT(new->d_subdirs);
-    new->d_inode   = dinode;
-    new->d_parent  = parent;
-    new->d_type    = D_TYPE_DIR;
+    dentry_t *new = vfs_alloc_dentry();
+    new->d_inode  = dinode;
+    new->d_parent = parent;
+    new->d_type   = D_TYPE_DIR;
     strcpy(new->d_name, dname);
     list_add(&new->d_subdirs_list, &parent->d_subdirs);
     return new;
@@ -5,10 +5,14 @@
 #ifndef __CONFIGS_H__
 #define __CONFIGS_H__
 
-#define MAX_PROC   32
+#define MAX_PROC   4096 // live processes at most, one kernel stack slot each
 #define MAX_CPUS   8
 #define MAX_DEV_ID 32
 
+// PID空间大小(64的倍数)，回收的PID要再回收PID_REUSE_DELAY个之后才复用
+#define PID_MAX         32768
+#define PID_REUSE_DELAY 128
+
 #define DEV_TTY         1
 #define DEV_VIRTIO_DISK 2
 #define DEV_SDCARD_DISK 3
@@ -24,4 +28,27 @@
 #define TIMER_COUNTER 7800000
 //#define TIMER_COUNTER 10000
 
+// Kmem调试等级:
+// 0 - 不做检查 (release)
+// 1 - 检查cookie和金丝雀值 (默认)
+// 2 - 每次kmalloc/kfree都完整校验空闲树 (checking build, O(n))
+#ifndef KMEM_DEBUG_LEVEL
+#define KMEM_DEBUG_LEVEL 1
+#endif
+
+// 使用ASID区分各进程的TLB项，切换进程时不刷新TLB，置0用于对比测试
+#ifndef ENABLE_ASID
+#define ENABLE_ASID 1
+#endif
+
+// 调度器参数，单位为cpu_cycle() (rdtime)
+// 进程至少运行SCHED_MIN_GRANULARITY才会在时钟中断时被抢占
+#ifndef SCHED_MIN_GRANULARITY
+#define SCHED_MIN_GRANULARITY (TIMER_COUNTER / 4)
+#endif
+// 被唤醒的进程vruntime比当前进程小这么多时立即抢占
+#define SCHED_WAKEUP_GRANULARITY (SCHED_MIN_GRANULARITY / 2)
+// 睡眠进程唤醒时最多补偿这么多vruntime
+#define SCHED_SLEEPER_CREDIT (TIMER_COUNTER / 2)
+
 #endif // __CONFIGS_H__
\ No newline at end of file
@@ -6,15 +6,17 @@
 #define __DEV_PIPE_H__
 
 #include <lib/sys/spinlock.h>
+#include <lib/sys/waitqueue.h>
 #include <vfs.h>
 
 #define PIPE_SIZE 512
 
 typedef struct {
-    spinlock_t lock;
-    size_t     nread, nwrite;
-    bool       read_open, write_open;
-    char       data[PIPE_SIZE];
+    spinlock_t   lock;
+    size_t       nread, nwrite;
+    bool         read_open, write_open;
+    wait_queue_t read_wait, write_wait;
+    char         data[PIPE_SIZE];
 } pipe_t;
 
 int pipe_create(file_t *reader, file_t *writer);
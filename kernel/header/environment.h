@@ -29,7 +29,10 @@ typedef struct __cpu_t cpu_t;
 struct __env_t {
     uint64_t begin_gaurd;
     /* CPUs */
-    cpu_t cpus[MAX_CPUS] __attribute__((aligned(8)));
+    cpu_t    cpus[MAX_CPUS] __attribute__((aligned(8)));
+    uint64_t hart_mask;   // harts found in FDT, see smp.c
+    uint64_t online_mask; // harts entered scheduler
+    uint64_t boot_hart;   // hart did global init, see startup.S
     /* Timer */
     uint64_t   ticks;
     spinlock_t ticks_lock;
@@ -44,8 +47,7 @@ struct __env_t {
     list_head_t procs;
     // proc_t           proc[MAX_PROC];
     size_t           proc_count;
-    bitset_t         proc_bitmap[BITSET_ARRAY_SIZE_FOR(MAX_PROC)];
-    spinlock_t       proc_lock;
+    spinlock_t       proc_lock; // also protects pid allocation, see pid.c
     scheduler_data_t scheduler_data;
     /* VFS */
     /* Device */
@@ -62,5 +64,8 @@ extern env_t os_env; // Inside environment.c
 static ALWAYS_INLINE inline cpu_t *mycpu() { return &os_env.cpus[cpuid()]; }
 
 void init_env();
+// smp.c
+void init_smp();
+void start_harts();
 
 #endif // __ENVIRONMENT_H__
\ No newline at end of file
@@ -48,4 +48,14 @@ static inline uint64_t set_first_unset_bit(bitset_t *bitarray, size_t size) {
     return 0xFFFFFFFFFFFFFFFF;
 }
 
+// Count trailing zeros, x must not be zero.
+static inline int ctz64(uint64_t x) {
+    static const int DeBruijnBitPosition64[64] = {
+        0,  1,  48, 2,  57, 49, 28, 3,  61, 58, 50, 42, 38, 29, 17, 4,
+        62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+        63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+        46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9,  13, 8,  7,  6};
+    return DeBruijnBitPosition64[((x & -x) * 0x03F79D71B4CB0A89UL) >> 58];
+}
+
 #endif // __BITSET_H__
\ No newline at end of file
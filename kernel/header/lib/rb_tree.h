@@ -30,6 +30,9 @@ rb_node *rb_search(rb_node *x, uint64_t key);
 rb_node *rb_succ(rb_node *n);
 // Get previous smaller node
 rb_node *rb_pred(rb_node *n);
+// Get the smallest/largest node in subtree x
+rb_node *rb_first(rb_node *x);
+rb_node *rb_last(rb_node *x);
 
 // Write
 // Insert a node, return NULL if success otherwise node that already existed.
@@ -39,6 +39,9 @@ extern _Noreturn void kpanic_proto(const char *s_fn, const char *b_fn,
         (type *)((char *)__mptr - offset_of(type, member));                    \
     })
 
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -13,10 +13,23 @@
 #define SBI_CLEAR_IPI 3
 #define SBI_SEND_IPI  4
 #define SBI_SHUTDOWN  8
+// legacy remote fence, hart_mask is passed by address
+#define SBI_REMOTE_SFENCE_VMA      6
+#define SBI_REMOTE_SFENCE_VMA_ASID 7
 
 #define SBI_EXT_SRST            0x53525354
 #define SBI_EXT_SRST_FUNC_RESET 0x0
 
+#define SBI_EXT_HSM                 0x48534D
+#define SBI_EXT_HSM_FUNC_HART_START 0x0
+
+#define SBI_EXT_RFENCE                     0x52464E43
+#define SBI_EXT_RFENCE_FUNC_SFENCE_VMA      0x1
+#define SBI_EXT_RFENCE_FUNC_SFENCE_VMA_ASID 0x2
+
+#define SBI_ERR_NOT_SUPPORTED     (-2)
+#define SBI_ERR_ALREADY_AVAILABLE (-6)
+
 // RustSBI for K210
 #define SBI_SET_MIE 0x0A000005
 
@@ -36,17 +49,18 @@
         a0;                                                                    \
     })
 
-#define SBI_EXT_call(ext, func, arg0, arg1, arg2, arg3)                        \
+#define SBI_EXT_call(ext, func, arg0, arg1, arg2, arg3, arg4)                  \
     ({                                                                         \
         register uintptr_t a0 asm("a0") = (uintptr_t)(arg0);                   \
         register uintptr_t a1 asm("a1") = (uintptr_t)(arg1);                   \
         register uintptr_t a2 asm("a2") = (uintptr_t)(arg2);                   \
         register uintptr_t a3 asm("a3") = (uintptr_t)(arg3);                   \
+        register uintptr_t a4 asm("a4") = (uintptr_t)(arg4);                   \
         register uintptr_t a6 asm("a6") = (uintptr_t)(func);                   \
         register uintptr_t a7 asm("a7") = (uintptr_t)(ext);                    \
         asm volatile("ecall"                                                   \
-                     : "+r"(a0)                                                \
-                     : "r"(a1), "r"(a2), "r"(a3), "r"(a6), "r"(a7)             \
+                     : "+r"(a0), "+r"(a1)                                      \
+                     : "r"(a2), "r"(a3), "r"(a4), "r"(a6), "r"(a7)             \
                      : "memory");                                              \
         a0;                                                                    \
     })
@@ -66,7 +80,35 @@ static inline void SBI_send_ipi(uint64_t *hart_mask) {
 
 static inline void SBI_set_mie() { SBI_call(SBI_SET_MIE, 0, 0, 0, 0); }
 static inline void SBI_ext_srst() {
-    SBI_EXT_call(SBI_EXT_SRST, SBI_EXT_SRST_FUNC_RESET, 0, 0, 0, 0);
+    SBI_EXT_call(SBI_EXT_SRST, SBI_EXT_SRST_FUNC_RESET, 0, 0, 0, 0, 0);
+}
+// Start hart at physical address start with a0 = hartid, a1 = opaque.
+static inline long SBI_hart_start(uint64_t hartid, uintptr_t start,
+                                  uint64_t opaque) {
+    return (long)SBI_EXT_call(SBI_EXT_HSM, SBI_EXT_HSM_FUNC_HART_START,
+                              hartid, start, opaque, 0, 0);
+}
+// Flush [start, start + size) of asid on harts in hart_mask, which is relative
+// to hart_mask_base. size of -1 flushes the whole address space.
+static inline long SBI_remote_sfence_vma_asid(uint64_t hart_mask,
+                                              uint64_t hart_mask_base,
+                                              uintptr_t start, size_t size,
+                                              uint64_t asid) {
+    return (long)SBI_EXT_call(SBI_EXT_RFENCE,
+                              SBI_EXT_RFENCE_FUNC_SFENCE_VMA_ASID, hart_mask,
+                              hart_mask_base, start, size, asid);
+}
+// Same as above but for all address spaces, including global mappings.
+static inline long SBI_remote_sfence_vma(uint64_t hart_mask,
+                                         uint64_t hart_mask_base,
+                                         uintptr_t start, size_t size) {
+    return (long)SBI_EXT_call(SBI_EXT_RFENCE, SBI_EXT_RFENCE_FUNC_SFENCE_VMA,
+                              hart_mask, hart_mask_base, start, size, 0);
+}
+// SBI v0.1 version, no error code
+static inline void SBI_legacy_remote_sfence_vma(uint64_t *hart_mask,
+                                                uintptr_t start, size_t size) {
+    SBI_call(SBI_REMOTE_SFENCE_VMA, hart_mask, start, size, 0);
 }
 
 #endif // __SBI_H__
\ No newline at end of file
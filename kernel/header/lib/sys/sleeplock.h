@@ -6,11 +6,13 @@
 #define __SLEEPLOCK_H__
 
 #include <lib/sys/spinlock.h>
+#include <lib/sys/waitqueue.h>
 #include <proc.h>
 
 typedef struct {
-    bool       lock;
-    spinlock_t spinlock;
+    bool         lock;
+    spinlock_t   spinlock;
+    wait_queue_t wait;
 
     pid_t pid;
 } sleeplock_t;
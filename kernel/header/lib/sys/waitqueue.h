@@ -0,0 +1,27 @@
+#ifndef __WAITQUEUE_H__
+#define __WAITQUEUE_H__
+
+#include <lib/linklist.h>
+#include <lib/sys/spinlock.h>
+
+// Processes sleeping on something, linked by proc->wait_list.
+typedef struct {
+    spinlock_t  lock;
+    list_head_t sleepers;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT(name)                                                  \
+    {                                                                          \
+        .lock     = {.lock = false, .cpu = 0},                                 \
+        .sleepers = LIST_HEAD_INIT((name).sleepers),                           \
+    }
+
+void wait_queue_init(wait_queue_t *wq);
+// lock is held, released while sleeping and acquired again before return.
+void sleep_on(wait_queue_t *wq, spinlock_t *lock);
+// Same as sleep_on, but also woken at os_env.ticks reaches expires.
+// Return false if timed out.
+bool sleep_on_timeout(wait_queue_t *wq, spinlock_t *lock, uint64_t expires);
+void wake_up(wait_queue_t *wq);
+
+#endif // __WAITQUEUE_H__
@@ -5,6 +5,7 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#include <configs.h>
 #include <lib/bitset.h>
 #include <lib/linklist.h>
 #include <lib/sys/spinlock.h>
@@ -22,6 +23,10 @@ extern volatile char __end_kernel_code[];
 
 /* Built-in memory maps */
 #define HARDWARE_VBASE 0xC0000000
+// Kernel stacks with guard pages, see kstack.c
+#define KSTACK_VBASE     0x100000000UL
+#define KSTACK_SLOT_SIZE 0x4000 // lower half guard, higher half stack
+#define KSTACK_SLOTS     MAX_PROC
 
 #define PAGING_MODE_BARE 0
 #define PAGING_MODE_SV32 1
@@ -36,10 +41,19 @@ extern volatile char __end_kernel_code[];
 #define PTE_TYPE_RSV2     6
 #define PTE_TYPE_RWX      7
 
+// satp[59:44] is ASID, generation is kept above ASID_GEN_SHIFT in mm->asid
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK  0xFFFFUL
+#define SATP_ASID(satp) (((satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK)
+#define ASID_GEN_SHIFT  16
+
 #define PTE_TYPE_BIT_R 0b001
 #define PTE_TYPE_BIT_W 0b010
 #define PTE_TYPE_BIT_X 0b100
 
+// RSW bits (Reserved1) of pte, for software use
+#define PTE_RSW_COW 0b01 // writable page made read-only by fork
+
 typedef uint64_t pte_t;
 typedef pte_t   *pde_t;
 typedef union {
@@ -71,6 +85,11 @@ typedef union {
 #define PAGE_TYPE_PGTBL    0x040
 #define PAGE_TYPE_USER     0x080
 #define PAGE_TYPE_POOL     0x100
+#define PAGE_TYPE_SLAB     0x200
+#define PAGE_TYPE_KMALLOC  0x400 // large kmalloc block
+
+// page_alloc flag, return zeroed pages. Not recorded in page type.
+#define PAGE_ALLOC_ZERO 0x8000
 
 struct page_info {
     uint16_t type;
@@ -87,9 +106,47 @@ struct _block_list {
 
 typedef struct _block_list block_list;
 
+/*
+ * Per-hart hot page cache in front of buddy allocator.
+ * Small order blocks are kept in a per-hart list and refilled/drained in
+ * batches, so single page alloc/free won't touch the global memory lock.
+ */
+#define PAGE_CACHE_MAX_ORDER 3  // order 0, 1, 2 are cached
+#define PAGE_CACHE_BATCH     16 // pages moved per refill/drain
+#define PAGE_CACHE_HIGH      64 // pages kept per order at most
+
+struct page_cache {
+    block_list *list[PAGE_CACHE_MAX_ORDER];
+    size_t      count[PAGE_CACHE_MAX_ORDER];
+    // statistics
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+    // only for remote drain, local access is almost uncontended.
+    spinlock_t lock;
+} __attribute__((aligned(64)));
+
+/*
+ * Pool of pre-zeroed single pages, filled by idle harts, so page tables and
+ * fault paths asking for PAGE_ALLOC_ZERO don't have to clear pages inline.
+ */
+#define ZERO_POOL_SIZE  256 // pages kept zeroed at most
+#define ZERO_POOL_BATCH 8   // pages zeroed per idle loop
+
+struct zero_pool {
+    char  *pages[ZERO_POOL_SIZE];
+    size_t count;
+    // statistics
+    uint64_t   hits;
+    uint64_t   misses;
+    uint64_t   zeroed;
+    spinlock_t lock;
+};
+
 struct memory_info_t {
 //#define MAX_BUDDY_ORDER 11 // max block is 4MB
-#define MAX_BUDDY_ORDER 9 // max block is 1MB
+#define MAX_BUDDY_ORDER 10 // max block is 2MB, a SV39 megapage
     char  *memory_start;
     char  *memory_end;
     char  *usable_memory_start;
@@ -100,8 +157,12 @@ struct memory_info_t {
     struct page_info *pages_info;
     block_list       *free_list[MAX_BUDDY_ORDER];
     size_t            free_count[MAX_BUDDY_ORDER];
+    uint64_t          free_orders; // bit i is set if free_list[i] not empty
 
     spinlock_t lock;
+
+    struct page_cache page_caches[MAX_CPUS];
+    struct zero_pool  zero_pool;
 };
 
 #define GET_PAGE_BY_ID(mem, id)                                                \
@@ -115,6 +176,89 @@ struct memory_info_t {
         (*(volatile type *)((uintptr_t)(addr))) = ((type)(value));             \
     } while (0)
 
+/*
+ * Slab object cache for fixed-size kernel objects.
+ * Each slab is a single page with a small header at its beginning, objects
+ * carry no header. Every hart has a magazine of free objects, so alloc/free
+ * only take the cache lock when magazine is empty or full.
+ */
+#define KMEM_CACHE_MAGAZINE_SIZE 16
+#define KMEM_CACHE_ALIGN         16
+
+struct kmem_cache_magazine {
+    size_t count;
+    void  *objs[KMEM_CACHE_MAGAZINE_SIZE];
+};
+
+typedef struct __kmem_cache {
+    const char *name;
+    size_t      obj_size;
+    size_t      objs_per_slab; // setup while first slab grows
+    spinlock_t  lock;
+    list_head_t slabs_partial;
+    list_head_t slabs_full;
+    list_head_t slabs_free;
+    size_t      slab_count;
+    // statistics
+    uint64_t    allocs;
+    uint64_t    magazine_hits;
+    list_head_t cache_list;
+
+    struct kmem_cache_magazine magazines[MAX_CPUS];
+} kmem_cache_t;
+
+#define KMEM_CACHE_INIT(var, cache_name, size)                                 \
+    {                                                                          \
+        .name          = (cache_name),                                         \
+        .obj_size      = ROUNDUP_WITH(KMEM_CACHE_ALIGN, (size)),               \
+        .objs_per_slab = 0,                                                    \
+        .lock          = {.lock = false, .cpu = 0},                            \
+        .slabs_partial = LIST_HEAD_INIT((var).slabs_partial),                  \
+        .slabs_full    = LIST_HEAD_INIT((var).slabs_full),                     \
+        .slabs_free    = LIST_HEAD_INIT((var).slabs_free),                     \
+        .cache_list    = LIST_HEAD_INIT((var).cache_list),                     \
+    }
+#define KMEM_CACHE_DEFINE(var, cache_name, type)                               \
+    kmem_cache_t var = KMEM_CACHE_INIT(var, cache_name, sizeof(type))
+
+/*
+ * TLB shootdown batch, see tlb.c.
+ * Ranges are collected after page tables are changed, then flushed on this
+ * hart and, with one remote request, on other harts that may cache them.
+ */
+#define TLB_BATCH_RANGES 8
+#define TLB_LOCAL_PAGES  32 // flush whole address space locally above this
+#define TLB_REMOTE_PAGES 64 // same for the merged remote range
+#define TLB_BATCH_FREED  8  // freed blocks kept in the batch itself
+
+struct tlb_range {
+    uintptr_t start, end;
+};
+
+struct tlb_freed {
+    char  *pa;
+    size_t pages;
+};
+
+// freed blocks more than TLB_BATCH_FREED, one page each
+struct tlb_freed_chunk {
+    struct tlb_freed_chunk *next;
+    size_t                  count;
+    struct tlb_freed        blocks[];
+};
+
+typedef struct {
+    struct __proc_t        *proc; // NULL for global kernel mappings
+    int                     count;
+    bool                    full; // flush the whole address space
+    struct tlb_range        ranges[TLB_BATCH_RANGES];
+    // pages unmapped but still reachable by stale TLB entries, freed after
+    // the flush
+    int                     nfreed;
+    struct tlb_freed        freed[TLB_BATCH_FREED];
+    struct tlb_freed_chunk *chunks;
+} tlb_batch_t;
+
 struct mem_sysmap {
     char       *va, *pa;
     size_t      size;
@@ -127,11 +271,25 @@ size_t memory_available();
 
 char *page_alloc(size_t pages, int attr);
 int   page_free(char *p, size_t pages);
+void  page_cache_drain(int cpu);
+void  print_page_cache_info();
+size_t page_zero_idle();
+void   print_zero_pool_info();
 
 void  kfree(void *p);
 char *kmalloc(size_t size);
+void  print_kmem_pool_info();
+size_t kmem_shrink();
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size);
+void         *kmem_cache_alloc(kmem_cache_t *cache);
+void          kmem_cache_free(kmem_cache_t *cache, void *obj);
+kmem_cache_t *kmem_cache_of(void *obj);
+void          print_kmem_cache_info();
 
 void unmap_pages(pde_t page_dir, void *va, size_t size, int do_free);
+void unmap_pages_batch(pde_t page_dir, void *va, size_t size,
+                       tlb_batch_t *batch);
 int  map_pages(pde_t page_dir, void *va, void *pa, uint64_t size, int type,
                bool user, bool global);
 
@@ -140,12 +298,37 @@ int   mem_sysunmap(void *va);
 pde_t alloc_page_dir();
 void dealloc_page_dir(pde_t page_dir);
 
+char *kstack_alloc();
+void  kstack_free(char *stack);
+void  print_kstack_info();
+
+void tlb_batch_init(tlb_batch_t *batch, struct __proc_t *proc);
+void tlb_batch_add(tlb_batch_t *batch, void *va, size_t size);
+void tlb_batch_free(tlb_batch_t *batch, char *pa, size_t pages);
+void tlb_batch_free_table(tlb_batch_t *batch, pde_t table);
+void tlb_batch_flush(tlb_batch_t *batch);
+void tlb_shootdown(struct __proc_t *proc, void *va, size_t size);
+void print_tlb_info();
+
+void init_asid();
+void print_asid_info();
+
 void *umemcpy(void *dst, const void *src, size_t size);
 char *ustrcpy_out(char *ustr);
 void  ustrcpy_in(char *ustr, char *kbuf);
 
-int vm_copy(pde_t dst, pde_t src, char *start, char *end);
+uintptr_t search_exception_table(uintptr_t epc);
+bool      user_access_ok(const void *p, size_t size);
+size_t    copy_to_user(void *udst, const void *ksrc, size_t size);
+size_t    copy_from_user(void *kdst, const void *usrc, size_t size);
+int       copy_to_buffer(char *dst, const char *src, size_t size);
+int       copy_from_buffer(char *dst, const char *src, size_t size);
+
+int    vm_copy(pde_t dst, pde_t src, char *start, char *end);
+int    vm_share(pde_t dst, pde_t src, char *start, char *end);
+char  *vm_lookup(pde_t page_dir, void *va);
+size_t vm_resident_pages(pde_t page_dir, char *start, char *end);
 
-int do_pagefault(char *caused_va, pde_t pde, bool from_kernel);
+int do_pagefault(char *caused_va, pde_t pde, bool from_kernel, bool write);
 
 #endif // __MEMORY_H__
\ No newline at end of file
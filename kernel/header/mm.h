@@ -0,0 +1,32 @@
+#ifndef __MM_H__
+#define __MM_H__
+
+#include <lib/rb_tree.h>
+#include <lib/sys/sleeplock.h>
+#include <memory.h>
+#include <proc.h>
+
+/*
+ * 进程的地址空间，CLONE_VM创建的线程共享同一个mm，最后一个线程退出时释放。
+ * lock保护页表和下面的各项，缺页、brk、mmap/munmap以及fork复制时持有。
+ * 持有lock时不能访问用户内存，否则缺页时会再次加锁。
+ */
+typedef struct __mm_t {
+    pde_t       page_dir;
+    uint64_t    asid;     // with generation, see asid.c
+    uint64_t    tlb_mask; // harts may cache its mappings, see tlb.c
+    int         users;    // threads sharing it
+    sleeplock_t lock;
+    // Stack info
+    char *stack_top;    // in va
+    char *stack_bottom; // in va, not contains end
+    // Elf program infos
+    size_t prog_size;
+    char  *prog_image_start; // in va
+    char  *prog_break;       // in va, not contains end
+    char  *heap_start;       // in va, [heap_start, prog_break) is demand paged
+    // mmap areas
+    rb_tree vmas;
+} mm_t;
+
+#endif // __MM_H__
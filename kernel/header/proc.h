@@ -5,8 +5,11 @@
 #ifndef __PROC_H__
 #define __PROC_H__
 
+#include <lib/rb_tree.h>
 #include <lib/sys/spinlock.h>
+#include <lib/sys/waitqueue.h>
 #include <memory.h>
+#include <sys_structs.h>
 #include <types.h>
 #include <vfs.h>
 
@@ -87,6 +90,33 @@ struct task_context {
 
 #define PROC_NAME_SIZE 16
 
+// mmap areas are placed top-down below this address
+#define PROC_MMAP_TOP (PROC_STACK_BASE - 0x10000000)
+
+// A mapped area of process, pages are mapped on demand by do_pagefault.
+typedef struct __vma_t {
+    rb_node node;   // node.key = start
+    char   *start;  // in va, page aligned
+    char   *end;    // in va, not contains end
+    int     prot;   // PROT_*
+    int     flags;  // MAP_*
+    file_t *file;   // NULL for anonymous mapping
+    size_t  offset; // file offset of start
+} vma_t;
+
+//#define MAX_FILE_OPEN 32
+#define MAX_FILE_OPEN 128
+
+// File table, shared by threads created with CLONE_FILES.
+typedef struct {
+    // 0 - stdin, 1 - stdout, 2 - stderr
+    file_t    *fd[MAX_FILE_OPEN];
+    int        ref;
+    spinlock_t lock; // for fd allocation
+} fdtable_t;
+
+struct __mm_t; // address space, see mm.h
+
 struct __proc_t {
     /* 0 ~ 24 */
     uint64_t page_csr;
@@ -98,7 +128,7 @@ struct __proc_t {
     /* 280 ~ ... */
 
     // Actually Assembly doesn't need anything below
-    pde_t               page_dir;
+    struct __mm_t      *mm; // shared by CLONE_VM threads
     pid_t               pid;
     uint32_t            status;
     struct __proc_t    *parent;
@@ -110,21 +140,32 @@ struct __proc_t {
     spinlock_t          lock;
     char                name[PROC_NAME_SIZE];
     void               *waiting_chan;
+    list_head_t         wait_list;  // in wait queue, see sleep.c
+    wait_queue_t       *wait_queue; // the queue linked in
+    wait_queue_t        child_wait; // wait for children to exit
     uint64_t            start_tick;
-    // Stack info
-    char *stack_top;    // in va
-    char *stack_bottom; // in va, not contains end
-    // Elf program infos
-    size_t prog_size;
-    char  *prog_image_start; // in va
-    char  *prog_break;       // in va, not contains end
-    char  *prog_brk_pg_end;
+    // threads, see fork.c
+    bool  thread;          // CLONE_THREAD, reaped without wait4
+    int  *clear_child_tid; // CLONE_CHILD_CLEARTID, cleared and woken on exit
+    // page fault statistics
+    uint64_t page_faults;  // handled page faults
+    uint64_t cow_faults;   // write faults on CoW pages
+    uint64_t cow_copies;   // CoW pages copied
+    uint64_t cow_upgrades; // CoW pages made writable without copy
     // File table
-    //#define MAX_FILE_OPEN 32
-#define MAX_FILE_OPEN 128
-    // 0 - stdin, 1 - stdout, 2 - stderr
-    file_t   *files[MAX_FILE_OPEN];
-    dentry_t *cwd;
+    fdtable_t *fdtable;
+    file_t   **files; // fdtable->fd
+    dentry_t  *cwd;
+
+    // scheduler, see scheduler.c
+    rb_node  run_node;      // in run queue, keyed by vruntime
+    int      sched_state;   // SCHED_*
+    int      sched_cpu;     // run queue to enqueue, the cpu it last ran on
+    int      nice;          // NICE_MIN ~ NICE_MAX
+    uint64_t vruntime;      // run time weighted by nice, in cpu cycles
+    uint64_t exec_start;    // cpu_cycle() of last accounting
+    uint64_t sum_exec;      // total run time in cpu cycles
+    uint64_t prev_sum_exec; // sum_exec when picked
 
     // list
     list_head_t proc_list;
@@ -133,23 +174,58 @@ struct __proc_t {
 
 typedef struct __proc_t proc_t;
 
+extern kmem_cache_t proc_cache; // proc.c
+
 void init_proc();
 
 proc_t *proc_alloc();
+proc_t *proc_alloc_shared(struct __mm_t *mm, fdtable_t *fdtable);
 void    proc_free(proc_t *proc);
+void    proc_destroy(proc_t *proc);
 proc_t *myproc();
 proc_t *get_proc(pid_t pid);
 void    set_proc(pid_t pid, proc_t *proc);
+void    init_pid();
+pid_t   pid_alloc(proc_t *proc);
+void    pid_free(pid_t pid);
+void    print_pid_info();
 
+void init_wait_table();
 void sleep(void *chan, spinlock_t *lock);
 void wakeup(void *chan);
+void wake_proc(proc_t *proc);
 
 int do_fork(proc_t *parent, char *child_stack);
+int do_clone(proc_t *parent, int flags, char *child_stack, int *ptid,
+             uintptr_t tls, int *ctid);
 int do_execve(proc_t *old, dentry_t *cwd, const char *path, const char *argv[],
               const char *env[]);
+int do_spawn(proc_t *parent, const char *path, const char *argv[],
+             const char *env[], const spawn_attr_t *attr);
 uintptr_t do_brk(proc_t *proc, uintptr_t addr);
+uintptr_t do_mmap(proc_t *proc, char *addr, size_t len, int prot, int flags,
+                  file_t *file, size_t offset);
+int       do_munmap(proc_t *proc, char *addr, size_t len);
 void      do_exit(proc_t *proc, int ec);
 pid_t     do_wait(pid_t waitfor, int *status, int options);
+void      reap_threads();
+
+int  do_futex(proc_t *proc, uint32_t *uaddr, int op, uint32_t val,
+              uint64_t expires);
+void init_futex();
+
+void asid_switch_to(proc_t *proc);
+static inline uint64_t proc_asid(proc_t *proc) {
+    return SATP_ASID(proc->page_csr);
+}
+
+vma_t *vma_find(proc_t *proc, char *va);
+vma_t *vma_intersect(proc_t *proc, char *start, char *end);
+int    vma_fork(proc_t *child, proc_t *parent);
+void   vma_free_all(proc_t *proc);
+int    vma_fill_page(vma_t *vma, char *va, char *pa);
+int    vma_populate(vma_t *vma, pde_t pde);
+size_t vma_resident_pages(proc_t *proc);
 
 /* Note:
  *
@@ -108,4 +108,27 @@ static ALWAYS_INLINE inline void     set_cpuid(uint64_t cpuid) { w_tp(cpuid); }
 static ALWAYS_INLINE inline uint64_t cpuid() { return r_tp(); }
 static ALWAYS_INLINE inline void     flush_tlb_all() { sfence_vma(); }
 
+// Targeted flush, non-global entries of asid (and va) only.
+// k210 (priv 1.9) has no ASID, fallback to flush all.
+#ifdef PLATFORM_QEMU
+static ALWAYS_INLINE inline void flush_tlb_asid(uint64_t asid) {
+    asm volatile("sfence.vma zero, %0" ::"r"(asid) : "memory");
+}
+static ALWAYS_INLINE inline void flush_tlb_page(void *va, uint64_t asid) {
+    asm volatile("sfence.vma %0, %1" ::"r"(va), "r"(asid) : "memory");
+}
+// va in all address spaces, global entries included
+static ALWAYS_INLINE inline void flush_tlb_va(void *va) {
+    asm volatile("sfence.vma %0, zero" ::"r"(va) : "memory");
+}
+#else
+static ALWAYS_INLINE inline void flush_tlb_asid(uint64_t asid) {
+    flush_tlb_all();
+}
+static ALWAYS_INLINE inline void flush_tlb_page(void *va, uint64_t asid) {
+    flush_tlb_all();
+}
+static ALWAYS_INLINE inline void flush_tlb_va(void *va) { flush_tlb_all(); }
+#endif
+
 #endif // __RISCV_H__
\ No newline at end of file
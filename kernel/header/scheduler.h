@@ -5,21 +5,60 @@
 #ifndef __SCHEDULER_H__
 #define __SCHEDULER_H__
 
+#include <configs.h>
+#include <lib/rb_tree.h>
 #include <lib/sys/spinlock.h>
 #include <proc.h>
 
+// proc->sched_state
+#define SCHED_IDLE   0 // not runnable, or runnable but not queued yet
+#define SCHED_QUEUED 1 // in a run queue
+#define SCHED_ONCPU  2 // picked by a cpu, until it switched back
+
+// nice value of process, weight of nice 0 is NICE_0_WEIGHT
+#define NICE_MIN      (-20)
+#define NICE_MAX      19
+#define NICE_0_WEIGHT 1024
+
+// Per-CPU run queue, only runnable processes which are not on cpu are here.
+struct run_queue {
+    spinlock_t lock;
+    rb_tree    tasks;        // keyed by vruntime
+    rb_node   *leftmost;     // cached rb_first(tasks.root)
+    size_t     count;
+    uint64_t   min_vruntime; // never goes backward
+    // only accessed by the owner cpu
+    bool need_resched; // a woken process should preempt current one
+    bool pull;         // queue is empty while others are busy
+    // statistics, only written by the owner cpu
+    uint64_t picks;
+    uint64_t steals;
+    uint64_t preempts;
+} __attribute__((aligned(64)));
+
 // scheduler data is environment data, not pre-CPU data
 // must lock for access.
 typedef struct {
-    spinlock_t lock;
-    // pid_t      last_scheduled_pid;
-    proc_t *last_scheduled_proc;
+    struct run_queue rq[MAX_CPUS];
 } scheduler_data_t;
 
+void init_scheduler(scheduler_data_t *data);
+
 // Return process to be scheduled
 // NULL represent no process could be scheduled
 // process lock is hold before return.
 // scheduler must change process status
 proc_t *scheduler(scheduler_data_t *data);
 
-#endif // __SCHEDULER_H__
\ No newline at end of file
+// Put proc into run queue if it is runnable, proc->lock must be held.
+void sched_enqueue(proc_t *proc);
+// Process switched back to scheduler, proc->lock must be held.
+void sched_switched_out(proc_t *proc);
+// Account the running proc on timer tick, return true if it should yield.
+bool sched_tick(proc_t *proc);
+// Return true if a process woken on this cpu should preempt current one.
+bool sched_need_resched();
+
+void print_scheduler_info();
+
+#endif // __SCHEDULER_H__
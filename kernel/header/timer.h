@@ -0,0 +1,54 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <configs.h>
+#include <lib/linklist.h>
+#include <lib/sys/spinlock.h>
+#include <types.h>
+
+// Timer wheel levels, see timer.c
+#define TW_ROOT_BITS 8
+#define TW_LVL_BITS  6
+#define TW_LEVELS    4
+#define TW_ROOT_SIZE (1 << TW_ROOT_BITS)
+#define TW_LVL_SIZE  (1 << TW_LVL_BITS)
+
+struct __ktimer_t;
+typedef void (*timer_fn_t)(struct __ktimer_t *timer);
+
+// Expires at os_env.ticks, fn is called in timer interrupt with no lock held.
+typedef struct __ktimer_t {
+    list_head_t list;
+    uint64_t    expires;
+    timer_fn_t  fn;
+    void       *data;
+    int         cpu;     // wheel last added to, -1 if never
+    bool        pending; // in wheel
+} ktimer_t;
+
+struct timer_wheel {
+    spinlock_t  lock;
+    uint64_t    clk; // next tick to run
+    list_head_t root[TW_ROOT_SIZE];
+    list_head_t lvl[TW_LEVELS][TW_LVL_SIZE];
+    ktimer_t   *running; // fn of it is running
+    size_t      pending;
+    // statistics
+    uint64_t fired;
+    uint64_t cascades;
+} __attribute__((aligned(64)));
+
+void init_timer_wheels();
+void timer_init(ktimer_t *timer, timer_fn_t fn, void *data);
+// Add timer to wheel of this cpu, timer must not be pending.
+void timer_add(ktimer_t *timer, uint64_t expires);
+// Remove timer, wait for its fn if running. Return true if it was pending.
+bool timer_cancel(ktimer_t *timer);
+// Run expired timers of this cpu, called on every timer interrupt.
+void run_timers();
+void print_timer_info();
+
+// Sleep for ticks, return -1 if process is stopped.
+int sleep_ticks(uint64_t ticks);
+
+#endif // __TIMER_H__
@@ -23,6 +23,7 @@ void trap_pop_off();
 void context_switch(struct task_context *old, struct task_context *new);
 // yield.c
 void yield();
+void preempt(proc_t *proc);
 // user_trap.c
 void user_trap_return();
 void return_to_cpu_process();
@@ -61,6 +61,9 @@ struct vfs_file_ops {
     int (*flush)(file_t *file);
     int (*open)(file_t *file);
     int (*close)(file_t *file);
+    // read/write可以直接接受用户地址的buffer(用copy_to/from_buffer拷贝)，
+    // 系统调用不再经过内核缓冲区
+    bool user_buffer;
 };
 
 struct vfs_superblock_ops {
@@ -186,6 +189,10 @@ int       vfs_link_inode(inode_t *inode, dentry_t *parent, const char *name);
 superblock_t *vfs_create_superblock();
 void          vfs_destroy_superblock(superblock_t *sb);
 
+dentry_t *vfs_alloc_dentry();
+file_t   *vfs_alloc_file();
+void      vfs_free_file(file_t *file);
+
 file_t *vfs_open(dentry_t *dentry, int mode);
 file_t *vfs_fdup(file_t *old);
 int     vfs_close(file_t *file);
@@ -4,9 +4,11 @@
 
 #include "./plic.h"
 #include <configs.h>
+#include <environment.h>
 #include <lib/sys/SBI.h>
 #include <riscv.h>
 #include <scheduler.h>
+#include <timer.h>
 #include <trap.h>
 #include <types.h>
 
@@ -17,22 +19,16 @@ static interrupt_handler_t int_handlers[MAX_INTERRUPT] = {0};
 void handle_interrupt(uint64_t cause) {
     if (cause == 5) {
         // timer interrupt
-        // 1. master core increase the tick
-        if (cpuid() == 0)
+        // 1. boot hart increase the tick, every core runs its timers
+        if (cpuid() == os_env.boot_hart)
             timer_tick();
+        run_timers();
         // 2. set next timer.
         SBI_set_timer(cpu_cycle() + TIMER_COUNTER);
-        // 3. yield cpu for schelder running if there is any process.
+        // 3. yield cpu if process used up its slice, see scheduler.c
         proc_t *proc = myproc();
-        if (proc && proc->status & PROC_STATUS_RUNNING) {
-            spinlock_acquire(&proc->lock);
-            if (proc->status & PROC_STATUS_RUNNING) {
-                proc->status &= ~PROC_STATUS_RUNNING;
-                proc->status |= PROC_STATUS_READY;
-            }
-            spinlock_release(&proc->lock);
-            yield();
-        }
+        if (proc && proc->status & PROC_STATUS_RUNNING && sched_tick(proc))
+            preempt(proc);
     }
     // TODO: THIS IS UGLY, I HATE COMPILE TIME DEFINATION FOR HARDWARE
 #if USE_SOFT_INT_COMP
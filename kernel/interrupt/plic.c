@@ -5,6 +5,7 @@
 #include "./plic.h"
 #include <configs.h>
 #include <driver/console.h>
+#include <environment.h>
 #include <lib/stdlib.h>
 #include <lib/string.h>
 #include <memory.h>
@@ -21,7 +22,9 @@ void init_plic() {
 
 #if !USE_SOFT_INT_COMP
     // set each hart's priority for S-mode
-    for (int hart = 0; hart < HART_COUNT; hart++) {
+    for (int hart = 0; hart < MAX_CPUS; hart++) {
+        if (!(os_env.hart_mask & (1UL << hart)))
+            continue;
         int context;
         context = hart * 2 + 1;
         MEM_IO_WRITE(uint32_t,
@@ -63,7 +66,9 @@ int plic_register_irq(int irq) {
     // 1 is prio
     MEM_IO_WRITE(uint32_t, PLIC_VA + irq * sizeof(uint32_t), 1);
     // enable for each hart
-    for (int hart = 0; hart < HART_COUNT; hart++) {
+    for (int hart = 0; hart < MAX_CPUS; hart++) {
+        if (!(os_env.hart_mask & (1UL << hart)))
+            continue;
         int context;
 #if USE_SOFT_INT_COMP
         // Machine context offset is 0
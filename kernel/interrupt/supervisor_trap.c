@@ -20,6 +20,7 @@ void __attribute__((used)) supervisor_trap_handler(struct trap_context *tf) {
     uint64_t stval   = CSR_Read(stval);
     uint64_t sepc    = CSR_Read(sepc);
     uint64_t sstatus = CSR_Read(sstatus);
+    uint64_t fixup   = 0;
     uint64_t satp    = CSR_Read(satp);
 
     assert((sstatus & SSTATUS_SPP), "Supervisor trap must from kernel.");
@@ -38,15 +39,20 @@ void __attribute__((used)) supervisor_trap_handler(struct trap_context *tf) {
             if (do_pagefault(
                     (char *)stval,
                     (pde_t)((CSR_Read(satp) & 0xFFFFFFFFFFF) << PG_SHIFT),
-                    true) != 0) {
+                    true, IS_STORE_FAULT(scause)) != 0) {
                 goto exception;
             }
         } else {
         exception:
-             exception_panic(scause, stval, sepc, sstatus, tf);
-            while (1)
-                ;
-            SBI_ext_srst();
+            if ((fixup = search_exception_table(sepc)) != 0) {
+                // bad user pointer in copy_to/from_user, let it return error
+                sepc = fixup;
+            } else {
+                exception_panic(scause, stval, sepc, sstatus, tf);
+                while (1)
+                    ;
+                SBI_ext_srst();
+            }
         }
     }
     CSR_Write(sepc, sepc);
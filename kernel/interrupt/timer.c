@@ -1,10 +1,195 @@
+#include <driver/console.h>
 #include <environment.h>
+#include <lib/sys/waitqueue.h>
 #include <proc.h>
+#include <riscv.h>
+#include <smp_barrier.h>
+#include <timer.h>
+
+/*
+ * 分层时间轮，每个CPU一个，参考早期Linux的实现。
+ * 第0层有TW_ROOT_SIZE个槽，每槽一个tick；往上TW_LEVELS层每层TW_LVL_SIZE个槽，
+ * 每槽的跨度是下一层整层的跨度。定时器按到期时间与clk的距离放入对应层的槽中，
+ * 插入和删除都是O(1)。clk走过第0层一圈时，把上一层对应槽中的定时器重新插入
+ * (cascade)，这些定时器会落到更低的层。超出最高层范围的定时器放在最高层，
+ * 到时会再次cascade。
+ *
+ * 定时器加在当前CPU的时间轮上，由该CPU在时钟中断中处理到os_env.ticks为止，
+ * 到期的定时器在不持有锁的情况下调用fn。时间轮为空时直接跳过，不逐tick前进。
+ * 锁顺序：调用者的锁(如proc->lock)先于wheel->lock，fn调用时不持有wheel->lock。
+ */
+
+#define TW_ROOT_MASK         (TW_ROOT_SIZE - 1)
+#define TW_LVL_MASK          (TW_LVL_SIZE - 1)
+#define TW_LVL_SHIFT(n)      (TW_ROOT_BITS + (n)*TW_LVL_BITS)
+#define TW_LVL_INDEX(clk, n) (((clk) >> TW_LVL_SHIFT(n)) & TW_LVL_MASK)
+#define TW_MAX_DELTA         ((1UL << TW_LVL_SHIFT(TW_LEVELS)) - 1)
+
+static struct timer_wheel wheels[MAX_CPUS];
+
+void init_timer_wheels() {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        struct timer_wheel *w = &wheels[i];
+        spinlock_init(&w->lock);
+        for (int j = 0; j < TW_ROOT_SIZE; j++)
+            w->root[j] = (list_head_t)LIST_HEAD_INIT(w->root[j]);
+        for (int l = 0; l < TW_LEVELS; l++)
+            for (int j = 0; j < TW_LVL_SIZE; j++)
+                w->lvl[l][j] = (list_head_t)LIST_HEAD_INIT(w->lvl[l][j]);
+        w->clk     = 0;
+        w->running = NULL;
+        w->pending = 0;
+    }
+}
+
+void timer_init(ktimer_t *timer, timer_fn_t fn, void *data) {
+    timer->list    = (list_head_t)LIST_HEAD_INIT(timer->list);
+    timer->expires = 0;
+    timer->fn      = fn;
+    timer->data    = data;
+    timer->cpu     = -1;
+    timer->pending = false;
+}
+
+// w->lock must be held.
+static void wheel_insert(struct timer_wheel *w, ktimer_t *timer) {
+    uint64_t     expires = timer->expires;
+    uint64_t     delta   = expires - w->clk;
+    list_head_t *slot;
+    if (expires < w->clk) {
+        // already expired, run on next tick
+        slot = &w->root[w->clk & TW_ROOT_MASK];
+    } else if (delta < TW_ROOT_SIZE) {
+        slot = &w->root[expires & TW_ROOT_MASK];
+    } else {
+        int l = 0;
+        while (l < TW_LEVELS - 1 && delta >= (1UL << TW_LVL_SHIFT(l + 1)))
+            l++;
+        if (delta > TW_MAX_DELTA)
+            expires = w->clk + TW_MAX_DELTA; // cascade again when reached
+        slot = &w->lvl[l][TW_LVL_INDEX(expires, l)];
+    }
+    list_add_tail(&timer->list, slot);
+}
+
+void timer_add(ktimer_t *timer, uint64_t expires) {
+    int                 cpu = (int)cpuid();
+    struct timer_wheel *w   = &wheels[cpu];
+    assert(!timer->pending, "Timer is pending.");
+    spinlock_acquire(&w->lock);
+    if (w->pending == 0)
+        w->clk = READ_ONCE(os_env.ticks); // skipped while empty
+    timer->expires = expires;
+    timer->cpu     = cpu;
+    timer->pending = true;
+    wheel_insert(w, timer);
+    w->pending++;
+    spinlock_release(&w->lock);
+}
+
+bool timer_cancel(ktimer_t *timer) {
+    if (timer->cpu < 0)
+        return false;
+    struct timer_wheel *w = &wheels[timer->cpu];
+    spinlock_acquire(&w->lock);
+    bool pending = timer->pending;
+    if (pending) {
+        list_del(&timer->list);
+        timer->pending = false;
+        w->pending--;
+    }
+    // don't let caller free timer while fn is using it
+    while (w->running == timer) {
+        spinlock_release(&w->lock);
+        spinlock_acquire(&w->lock);
+    }
+    spinlock_release(&w->lock);
+    return pending;
+}
+
+// Move timers in lvl[l][index] down, return index. w->lock must be held.
+static int cascade(struct timer_wheel *w, int l, int index) {
+    LIST_HEAD(moving);
+    list_head_t *slot = &w->lvl[l][index];
+    if (slot->next != slot) {
+        // splice the whole slot out, timers may be inserted back into it
+        moving.next       = slot->next;
+        moving.prev       = slot->prev;
+        moving.next->prev = &moving;
+        moving.prev->next = &moving;
+        *slot             = (list_head_t)LIST_HEAD_INIT(*slot);
+        w->cascades++;
+    }
+    while (moving.next != &moving) {
+        ktimer_t *timer = container_of(moving.next, ktimer_t, list);
+        list_del(&timer->list);
+        wheel_insert(w, timer);
+    }
+    return index;
+}
+
+void run_timers() {
+    struct timer_wheel *w   = &wheels[cpuid()];
+    uint64_t            now = READ_ONCE(os_env.ticks);
+    // peek without lock, most wheels are empty most of the time
+    if (READ_ONCE(w->pending) == 0)
+        return;
+    spinlock_acquire(&w->lock);
+    while (w->pending && w->clk <= now) {
+        int index = (int)(w->clk & TW_ROOT_MASK);
+        if (index == 0) {
+            for (int l = 0; l < TW_LEVELS; l++)
+                if (cascade(w, l, TW_LVL_INDEX(w->clk, l)) != 0)
+                    break;
+        }
+        list_head_t *slot = &w->root[index];
+        while (slot->next != slot) {
+            ktimer_t *timer = container_of(slot->next, ktimer_t, list);
+            list_del(&timer->list);
+            timer->pending = false;
+            w->pending--;
+            w->running = timer;
+            w->fired++;
+            spinlock_release(&w->lock);
+            timer->fn(timer);
+            spinlock_acquire(&w->lock);
+            w->running = NULL;
+        }
+        w->clk++;
+    }
+    spinlock_release(&w->lock);
+}
 
 void timer_tick() {
     spinlock_acquire(&os_env.ticks_lock);
     os_env.ticks++;
     spinlock_release(&os_env.ticks_lock);
-    // wakeup
-    wakeup(&os_env.ticks);
-}
\ No newline at end of file
+}
+
+int sleep_ticks(uint64_t ticks) {
+    proc_t      *proc    = myproc();
+    uint64_t     expires = READ_ONCE(os_env.ticks) + ticks;
+    wait_queue_t wq;
+    wait_queue_init(&wq);
+    // nobody wakes wq, only the timer
+    spinlock_acquire(&proc->lock);
+    while (READ_ONCE(os_env.ticks) < expires) {
+        if (proc->status & PROC_STATUS_STOP) {
+            spinlock_release(&proc->lock);
+            return -1;
+        }
+        sleep_on_timeout(&wq, &proc->lock, expires);
+    }
+    spinlock_release(&proc->lock);
+    return 0;
+}
+
+void print_timer_info() {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        struct timer_wheel *w = &wheels[i];
+        if (w->fired == 0 && w->pending == 0)
+            continue;
+        kprintf("[TIMER] CPU %d: %ld pending, %ld fired, %ld cascades.\n", i,
+                w->pending, w->fired, w->cascades);
+    }
+}
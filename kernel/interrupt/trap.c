@@ -16,6 +16,10 @@ void init_trap() {
     enable_trap();
     CSR_RWOR(sie, SIE_SEIE | SIE_SSIE | SIE_STIE);
     SBI_set_timer(cpu_cycle() + TIMER_COUNTER);
+#ifdef PLATFORM_QEMU
+    // let user read cycle/time/instret with rdcycle, rdtime, rdinstret
+    CSR_Write(scounteren, 0x7);
+#endif
 }
 
 void trap_push_off() {
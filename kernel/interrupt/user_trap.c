@@ -8,6 +8,7 @@
 #include <lib/stdlib.h>
 #include <lib/sys/SBI.h>
 #include <riscv.h>
+#include <scheduler.h>
 #include <syscall.h>
 #include <trap.h>
 #include <types.h>
@@ -39,7 +40,7 @@ void __attribute__((used)) user_trap_handler(proc_t *proc) {
             if (do_pagefault(
                     (char *)stval,
                     (pde_t)((CSR_Read(satp) & 0xFFFFFFFFFFF) << PG_SHIFT),
-                    false) != 0) {
+                    false, IS_STORE_FAULT(scause)) != 0) {
                 kprintf("do page fault failed.\n");
 
                 exception_panic(scause, stval, sepc, sstatus, &proc->trapframe);
@@ -60,6 +61,9 @@ void __attribute__((used)) user_trap_handler(proc_t *proc) {
             }
         }
     }
+    // process woken by syscall or interrupt may deserve the cpu more
+    if (sched_need_resched())
+        preempt(proc);
     user_trap_return();
 }
 
@@ -90,6 +94,6 @@ void return_to_cpu_process() {
     cpu_t  *cpu  = mycpu();
     assert(proc, "Process must be valid.");
     // switch to proc kernel page
-    CSR_Write(satp, proc->page_csr);
+    asid_switch_to(proc);
     context_switch(&mycpu()->context, &mycpu()->proc->kernel_task_context);
 }
\ No newline at end of file
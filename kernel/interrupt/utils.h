@@ -15,6 +15,8 @@
 #define COULD_BE_PAGEFAULT(x)                                                  \
     ((x) == 15 || (x) == 13 || (x) == 12 || (x) == 7 || (x) == 5 || (x) == 1)
 #endif
+// store page fault, or store access fault on K210 (priv 1.9)
+#define IS_STORE_FAULT(x) ((x) == 15 || (x) == 7)
 
 // 其实用vector命名不太正确，因为这里用DIRECT MODE不是向量表模式
 // 沿用OmochaOS的命名习惯
@@ -25,4 +25,16 @@ void yield() {
     my_cpuid          = (int)cpuid();
     cpu               = &os_env.cpus[my_cpuid];
     cpu->trap_enabled = trap_enabled;
-}
\ No newline at end of file
+}
+// Give up cpu but stay runnable.
+void preempt(proc_t *proc) {
+    if (!(proc->status & PROC_STATUS_RUNNING))
+        return;
+    spinlock_acquire(&proc->lock);
+    if (proc->status & PROC_STATUS_RUNNING) {
+        proc->status &= ~PROC_STATUS_RUNNING;
+        proc->status |= PROC_STATUS_READY;
+    }
+    spinlock_release(&proc->lock);
+    yield();
+}
@@ -7,6 +7,7 @@
 #include <lib/stdlib.h>
 #include <lib/string.h>
 #include <memory.h>
+#include <mm.h>
 
 #define ERROR(s, ...) kprintf("[ELF] Error: " s "\n", ##__VA_ARGS__)
 
@@ -52,9 +53,9 @@ bool elf_load_to_process(proc_t *proc, elf_buffer_reader reader,
     bool is_valid = elf_check_header(&E_header);
     if (!is_valid)
         return false;
-    proc->prog_image_start = (char *)0xFFFFFFFFFFFFFFFF;
-    proc->prog_break       = (char *)0;
-    proc->prog_size        = 0;
+    proc->mm->prog_image_start = (char *)0xFFFFFFFFFFFFFFFF;
+    proc->mm->prog_break       = (char *)0;
+    proc->mm->prog_size        = 0;
 
     // Load Prog Header
     if (sizeof(Elf64_Phdr) != E_header.e_phentsize) {
@@ -71,18 +72,41 @@ bool elf_load_to_process(proc_t *proc, elf_buffer_reader reader,
                (char *)&P_header, sizeof(Elf64_Phdr));
         if (P_header.p_type == PT_LOAD) {
             // Only load the load type prog header.
-            if ((uintptr_t)proc->prog_image_start > P_header.p_vaddr) {
-                proc->prog_image_start = (char *)P_header.p_vaddr;
+            if ((uintptr_t)proc->mm->prog_image_start > P_header.p_vaddr) {
+                proc->mm->prog_image_start = (char *)P_header.p_vaddr;
             }
-            if ((uintptr_t)proc->prog_break <
+            if ((uintptr_t)proc->mm->prog_break <
                 P_header.p_vaddr + P_header.p_memsz) {
-                proc->prog_break = (char *)P_header.p_vaddr + P_header.p_memsz;
+                proc->mm->prog_break =
+                    (char *)P_header.p_vaddr + P_header.p_memsz;
             }
             size_t memsz = P_header.p_memsz;
             memsz        = PG_ROUNDUP(memsz);
 
+            if (P_header.p_filesz > P_header.p_memsz) {
+                ERROR("Prog header filesz larger than memsz.");
+                return false;
+            }
+            int pg_type = 0;
+            if (P_header.p_flags & PF_R)
+                pg_type |= PTE_TYPE_BIT_R;
+            if (P_header.p_flags & PF_W)
+                pg_type |= PTE_TYPE_BIT_W;
+            if (P_header.p_flags & PF_X)
+                pg_type |= PTE_TYPE_BIT_X;
+            if (pg_type != PTE_TYPE_RWX && pg_type != PTE_TYPE_RW &&
+                pg_type != PTE_TYPE_XO && pg_type != PTE_TYPE_RO &&
+                pg_type != PTE_TYPE_RX) {
+                ERROR("Elf Program memory type unsupported.");
+                return false;
+            }
+
             char *pa =
                 page_alloc(memsz / PG_SIZE, PAGE_TYPE_INUSE | PAGE_TYPE_USER);
+            if (!pa) {
+                ERROR("Cannot alloc %d page(s) for prog.", memsz / PG_SIZE);
+                return false;
+            }
             char    *va        = (char *)P_header.p_vaddr;
             uint64_t va_offset = (uintptr_t)va - PG_ROUNDDOWN(va);
 
@@ -90,33 +114,19 @@ bool elf_load_to_process(proc_t *proc, elf_buffer_reader reader,
                    P_header.p_filesz);
             if (va_offset)
                 memset(pa, 0, va_offset);
-            if (P_header.p_filesz != P_header.p_memsz) {
-                if (P_header.p_filesz > P_header.p_memsz) {
-                    // TODO: Clean-up and non panic, return false.
-                    kpanic("[ELF] Prog header filesz larger than memsz.");
-                }
+            if (P_header.p_filesz != P_header.p_memsz)
                 memset(pa + va_offset + P_header.p_filesz, 0,
                        P_header.p_memsz - P_header.p_filesz);
-            }
-            int pg_type = 0;
-            if (P_header.p_flags & PF_R)
-                pg_type |= PTE_TYPE_BIT_R;
-            if (P_header.p_flags & PF_W)
-                pg_type |= PTE_TYPE_BIT_W;
-            if (P_header.p_flags & PF_X)
-                pg_type |= PTE_TYPE_BIT_X;
-
-            // TODO: Clean-up and non panic-assert, return false.
-            assert(pg_type == PTE_TYPE_RWX || pg_type == PTE_TYPE_RW ||
-                       pg_type == PTE_TYPE_XO || pg_type == PTE_TYPE_RO ||
-                       pg_type == PTE_TYPE_RX,
-                   "Elf Program memory type unsupported.");
 
-            map_pages(proc->page_dir, (void *)PG_ROUNDDOWN(va), pa,
+            map_pages(proc->mm->page_dir, (void *)PG_ROUNDDOWN(va), pa,
                       P_header.p_memsz, pg_type, true, false);
+            // keep what is mapped covered, a failed load is unmapped by
+            // mm_release
+            proc->mm->prog_size =
+                proc->mm->prog_break - proc->mm->prog_image_start;
         }
     }
-    proc->prog_size = proc->prog_break - proc->prog_image_start;
-    proc->user_pc   = (void *)E_header.e_entry;
+    proc->mm->heap_start = (char *)PG_ROUNDUP(proc->mm->prog_break);
+    proc->user_pc        = (void *)E_header.e_entry;
     return true;
 }
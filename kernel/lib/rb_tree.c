@@ -68,6 +68,20 @@ rb_node *rb_pred(rb_node *n) {
     }
 }
 
+rb_node *rb_first(rb_node *x) {
+    if (x)
+        while (x->L)
+            x = x->L;
+    return x;
+}
+
+rb_node *rb_last(rb_node *x) {
+    if (x)
+        while (x->R)
+            x = x->R;
+    return x;
+}
+
 #if 1
 // Red-Black Tree
 static void rb_rotate_left(rb_tree *tree, rb_node *node) {
@@ -10,12 +10,13 @@
 void sleeplock_init(sleeplock_t *pLock) {
     pLock->lock = 0;
     spinlock_init(&pLock->spinlock);
+    wait_queue_init(&pLock->wait);
 }
 
 void sleeplock_acquire(sleeplock_t *pLock) {
     spinlock_acquire(&pLock->spinlock);
     while (pLock->lock) {
-        sleep(pLock, &pLock->spinlock);
+        sleep_on(&pLock->wait, &pLock->spinlock);
     }
     pLock->lock = true;
     pLock->pid  = myproc()->pid;
@@ -26,6 +27,6 @@ void sleeplock_release(sleeplock_t *pLock) {
     spinlock_acquire(&pLock->spinlock);
     pLock->lock = false;
     pLock->pid  = 0;
-    wakeup(pLock);
+    wake_up(&pLock->wait);
     spinlock_release(&pLock->spinlock);
 }
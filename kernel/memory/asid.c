@@ -0,0 +1,136 @@
+#include <configs.h>
+#include <driver/console.h>
+#include <environment.h>
+#include <lib/bitset.h>
+#include <lib/stdlib.h>
+#include <lib/string.h>
+#include <lib/sys/spinlock.h>
+#include <memory.h>
+#include <mm.h>
+#include <proc.h>
+#include <riscv.h>
+
+/*
+ * ASID分配：
+ * 每个进程在切换进来时持有一个ASID，TLB项由ASID区分，因此切换时不需要刷新TLB。
+ * mm->asid的低ASID_GEN_SHIFT位为ASID，高位为代数(generation)。ASID用完时
+ * 代数加一并清空位图，之前分配的ASID全部作废，进程下次切换时重新分配；
+ * 每个CPU在翻代后第一次切换时刷新整个TLB。各CPU上正在使用的ASID在翻代时
+ * 保留下来(reserved)，保证它们不会在新一代中被分配给别的进程。
+ * 切换时把当前CPU记录在mm->tlb_mask中，修改页表后据此向其他CPU发出
+ * TLB shootdown(见tlb.c)。
+ * ASID 0留给内核。不支持ASID的平台(asid_bits为0)退化为切换时刷新TLB，
+ * ENABLE_ASID为0时同样如此，用于对比测试。
+ */
+
+#define ASID_MAX_BITS 16
+#define ASID_NUM(ctx) ((ctx) & ((1UL << ASID_GEN_SHIFT) - 1))
+#define ASID_GEN(ctx) ((ctx) >> ASID_GEN_SHIFT)
+
+static spinlock_t asid_lock = {.lock = false, .cpu = 0};
+static int        asid_bits = 0;
+static uint64_t   asid_count;
+static uint64_t   asid_generation = 1;
+static bitset_t   asid_map[BITSET_ARRAY_SIZE_FOR(1 << ASID_MAX_BITS)];
+static uint64_t   active_asids[MAX_CPUS];
+static uint64_t   reserved_asids[MAX_CPUS];
+static bool       flush_pending[MAX_CPUS];
+static uint64_t   rollovers;
+
+void init_asid() {
+#if defined(PLATFORM_QEMU) && ENABLE_ASID
+    // ASIDLEN is WARL, write all ones to find out how many bits we have
+    CSR_Write(satp,
+              os_env.kernel_satp | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    uint64_t asid = SATP_ASID(CSR_Read(satp));
+    CSR_Write(satp, os_env.kernel_satp);
+    flush_tlb_all();
+    while (asid_bits < ASID_MAX_BITS && (asid & (1UL << asid_bits)))
+        asid_bits++;
+#endif
+    asid_count = 1UL << asid_bits;
+    memset(asid_map, 0, sizeof(asid_map));
+    set_bit(asid_map, 0);
+    // too few ASIDs to be worth it
+    if (asid_count <= MAX_CPUS + 1)
+        asid_bits = 0;
+    kprintf("[MEM] ASID bits: %d.\n", asid_bits);
+}
+
+// asid_lock must be held.
+static void asid_rollover() {
+    asid_generation++;
+    rollovers++;
+    memset(asid_map, 0, sizeof(asid_map));
+    set_bit(asid_map, 0);
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        uint64_t ctx = active_asids[cpu];
+        // cpu is idle, keep the one it used last
+        if (ctx == 0)
+            ctx = reserved_asids[cpu];
+        if (ctx)
+            set_bit(asid_map, ASID_NUM(ctx));
+        reserved_asids[cpu] = ctx;
+        active_asids[cpu]   = 0;
+        flush_pending[cpu]  = true;
+    }
+}
+
+// asid_lock must be held.
+static uint64_t asid_new_context(uint64_t old) {
+    uint64_t new_ctx = (asid_generation << ASID_GEN_SHIFT) | ASID_NUM(old);
+    if (old) {
+        // still live on some cpu since rollover, keep the number
+        bool hit = false;
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+            if (reserved_asids[cpu] == old) {
+                reserved_asids[cpu] = new_ctx;
+                hit                 = true;
+            }
+        if (hit)
+            return new_ctx;
+        if (!check_bit(asid_map, ASID_NUM(old))) {
+            set_bit(asid_map, ASID_NUM(old));
+            return new_ctx;
+        }
+    }
+    size_t   words = BITSET_ARRAY_SIZE_FOR(asid_count);
+    uint64_t num   = set_first_unset_bit(asid_map, words);
+    if (num == 0xFFFFFFFFFFFFFFFF || num >= asid_count) {
+        asid_rollover();
+        num = set_first_unset_bit(asid_map, words);
+        assert(num < asid_count, "No ASID after rollover.");
+    }
+    return (asid_generation << ASID_GEN_SHIFT) | num;
+}
+
+// Switch satp to proc, allocate a new ASID if its generation is expired.
+void asid_switch_to(proc_t *proc) {
+    int cpu = cpuid();
+    // full barrier, pairs with the one in tlb_batch_flush
+    __sync_fetch_and_or(&proc->mm->tlb_mask, 1UL << cpu);
+    if (asid_bits == 0) {
+        CSR_Write(satp, proc->page_csr);
+        flush_tlb_all();
+        return;
+    }
+    spinlock_acquire(&asid_lock);
+    uint64_t ctx = proc->mm->asid;
+    if (ctx == 0 || ASID_GEN(ctx) != asid_generation)
+        proc->mm->asid = ctx = asid_new_context(ctx);
+    active_asids[cpu] = ctx;
+    bool need_flush    = flush_pending[cpu];
+    flush_pending[cpu] = false;
+    spinlock_release(&asid_lock);
+
+    proc->page_csr = (proc->page_csr & ~(SATP_ASID_MASK << SATP_ASID_SHIFT)) |
+                     (ASID_NUM(ctx) << SATP_ASID_SHIFT);
+    CSR_Write(satp, proc->page_csr);
+    if (need_flush)
+        flush_tlb_all();
+}
+
+void print_asid_info() {
+    kprintf("[MEM] ASID bits: %d, generation: %ld, rollovers: %ld.\n",
+            asid_bits, asid_generation, rollovers);
+}
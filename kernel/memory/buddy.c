@@ -1,15 +1,25 @@
 #include "./utils.h"
 #include <driver/console.h>
+#include <lib/bitset.h>
 #include <lib/stdlib.h>
+#include <lib/string.h>
 #include <memory.h>
+#include <riscv.h>
 #include <types.h>
 
 extern struct memory_info_t memory_info; // in memory.c
 
+/*
+ * Buddy分配器：
+ * 块的下标以memory_start为基准，因此max order的块在物理地址上也是对齐的，
+ * 可以直接用作大页。free_orders记录了哪些order的空闲链表非空，分配时通过
+ * ctz64一次找到第一个可用的order，再自顶向下拆分；释放时自底向上迭代合并。
+ */
+
 static block_list *remove_from_free_list(block_list *p, int order) {
     uintptr_t end = (uintptr_t)p + PG_SIZE * (1 << order);
     assert(end > (uintptr_t)memory_info.usable_memory_start &&
-               end < (uintptr_t)memory_info.usable_memory_end,
+               end <= (uintptr_t)memory_info.usable_memory_end,
            "Block execeeded while remove.");
     if (p->prev) {
         p->prev->next = p->next;
@@ -24,13 +34,15 @@ static block_list *remove_from_free_list(block_list *p, int order) {
     }
     p->next = NULL;
     p->prev = NULL;
+    if (--memory_info.free_count[order] == 0)
+        memory_info.free_orders &= ~(1UL << order);
     return p;
 }
 
 static block_list *attach_to_free_list(block_list *p, int order) {
     uintptr_t end = (uintptr_t)p + PG_SIZE * (1 << order);
     assert(end > (uintptr_t)memory_info.usable_memory_start &&
-               end < (uintptr_t)memory_info.usable_memory_end,
+               end <= (uintptr_t)memory_info.usable_memory_end,
            "Block execeeded while attach.");
     // must attach a single node
     p->next = memory_info.free_list[order];
@@ -38,42 +50,44 @@ static block_list *attach_to_free_list(block_list *p, int order) {
         p->next->prev = p;
     p->prev                      = NULL;
     memory_info.free_list[order] = p;
+    memory_info.free_count[order]++;
+    memory_info.free_orders |= (1UL << order);
     return p;
 }
 
 static inline int xor_buddy_map(char *p, int order) {
-    size_t page_idx = (p - memory_info.usable_memory_start) / PG_SIZE;
+    size_t page_idx = GET_ID_BY_PAGE(memory_info, p);
     xor_bit(memory_info.buddy_map[order], page_idx >> (order + 1), 1);
     return check_bit(memory_info.buddy_map[order], page_idx >> (order + 1));
 }
 
+static inline void set_allocated_page_info(char *block, int order, int attr) {
+    for (int i = 0; i < (1 << order); i++) {
+        struct page_info *pg = &memory_info.pages_info[GET_ID_BY_PAGE(
+            memory_info, (block + i * PG_SIZE))];
+        pg->type             = attr;
+        pg->reference        = 1;
+    }
+}
+
 static char *allocate_pages_of_power_2(int order, int attr) {
     if (order >= MAX_BUDDY_ORDER)
         return NULL;
-    char *block = NULL;
-    if (memory_info.free_count[order] == 0) {
-        block = allocate_pages_of_power_2(order + 1, 0);
-        if (block == NULL)
-            return NULL;
-        attach_to_free_list((block_list *)block, order);
-        memory_info.free_count[order]++;
-        /* printf("= PUT %x into order %d free list =\n", block); */
-        block += ((1 << order) * PG_SIZE);
-        xor_buddy_map(block, order); // higher half is returned
-    } else {
-        block =
-            (char *)remove_from_free_list(memory_info.free_list[order], order);
-        memory_info.free_count[order]--;
-        xor_buddy_map(block, order);
-    }
-    if (block != NULL) {
-        for (int i = 0; i < (1 << order); i++) {
-            struct page_info *pg = &memory_info.pages_info[GET_ID_BY_PAGE(
-                memory_info, (block + i * PG_SIZE))];
-            pg->type             = attr;
-            pg->reference        = 1;
-        }
+    uint64_t usable = memory_info.free_orders & (~0UL << order);
+    if (usable == 0)
+        return NULL;
+    int   current = ctz64(usable);
+    char *block   = (char *)remove_from_free_list(
+        memory_info.free_list[current], current);
+    xor_buddy_map(block, current);
+    // split down, lower half is kept and higher half is returned
+    while (current > order) {
+        current--;
+        attach_to_free_list((block_list *)block, current);
+        block += ((1 << current) * PG_SIZE);
+        xor_buddy_map(block, current);
     }
+    set_allocated_page_info(block, order, attr);
     return block;
 }
 
@@ -83,31 +97,46 @@ static int free_pages_of_power_2(char *p, int order) {
     if (!(p >= memory_info.usable_memory_start &&
           p < memory_info.usable_memory_end))
         return 2; // free a block not managed by us
-    int buddy_bit = xor_buddy_map(p, order);
-    if (buddy_bit == 0 && order + 1 < MAX_BUDDY_ORDER) {
+    while (xor_buddy_map(p, order) == 0 && order + 1 < MAX_BUDDY_ORDER) {
+        // buddy is free as well, merge them
+        size_t page_idx = GET_ID_BY_PAGE(memory_info, p);
         char  *buddy    = NULL;
-        size_t page_idx = (p - memory_info.usable_memory_start) / PG_SIZE;
-        size_t buddy_even_page_idx = (page_idx >> (order + 1)) << (order + 1);
-        if (page_idx == buddy_even_page_idx)
-            buddy = p + (1 << order) * PG_SIZE;
-        else
+        if (page_idx & (1 << order))
             buddy = p - (1 << order) * PG_SIZE;
-        // printf("= REMOVE %x from order %d free list =\n", buddy, order);
+        else
+            buddy = p + (1 << order) * PG_SIZE;
         remove_from_free_list((block_list *)buddy, order);
-        memory_info.free_count[order]--;
         if (buddy < p)
-            free_pages_of_power_2(buddy, order + 1);
-        else
-            free_pages_of_power_2(p, order + 1);
-    } else {
-        attach_to_free_list((block_list *)p, order);
-        clear_page_info(&memory_info, p, 1 << order,
-                        PAGE_TYPE_USABLE | PAGE_TYPE_FREE);
-        memory_info.free_count[order]++;
+            p = buddy;
+        order++;
     }
+    attach_to_free_list((block_list *)p, order);
+    clear_page_info(&memory_info, p, 1 << order,
+                    PAGE_TYPE_USABLE | PAGE_TYPE_FREE);
     return 0;
 }
 
+/*
+ * 启动时将[start, end)按能对齐的最大order批量放入空闲链表。
+ * 除max order外，放入的块的buddy必然不完整(否则会选择更大的order)，
+ * 因此直接将其buddy位置1，表示buddy已被占用，之后也不会和它合并。
+ * memory_info.lock must be held.
+ */
+void buddy_init_free_range(char *start, char *end) {
+    char *p = (char *)PG_ROUNDUP(start);
+    while (p + PG_SIZE <= end) {
+        size_t page_idx = GET_ID_BY_PAGE(memory_info, p);
+        int    order    = MAX_BUDDY_ORDER - 1;
+        while (order > 0 && ((page_idx & ((1 << order) - 1)) ||
+                             p + (1 << order) * PG_SIZE > end))
+            order--;
+        attach_to_free_list((block_list *)p, order);
+        if (order + 1 < MAX_BUDDY_ORDER)
+            set_bit(memory_info.buddy_map[order], page_idx >> (order + 1));
+        p += (1 << order) * PG_SIZE;
+    }
+}
+
 void print_free_info() {
     kprintf("[MEM] free blocks count is\n[MEM] ");
     for (int i = 0; i < MAX_BUDDY_ORDER; i++)
@@ -121,17 +150,230 @@ void print_free_info() {
     kprintf("\n");
 }
 
-char *page_alloc(size_t pages, int attr) {
-    int order = trailing_zero(round_up_power_2(pages));
+/*
+ * Per-hart page cache.
+ * pc->lock is always taken before memory_info.lock, never after.
+ */
+
+static inline size_t page_cache_batch(int order) {
+    size_t batch = PAGE_CACHE_BATCH >> order;
+    return batch ? batch : 1;
+}
+
+static inline size_t page_cache_high(int order) {
+    size_t high = PAGE_CACHE_HIGH >> order;
+    return high > page_cache_batch(order) ? high : page_cache_batch(order);
+}
+
+// Take a batch of blocks from buddy lists. pc->lock must be held.
+static size_t page_cache_refill(struct page_cache *pc, int order) {
+    size_t batch = page_cache_batch(order);
+    size_t got   = 0;
+    spinlock_acquire(&memory_info.lock);
+    for (; got < batch; got++) {
+        char *block = allocate_pages_of_power_2(order, 0);
+        if (!block)
+            break;
+        clear_page_info(&memory_info, block, 1 << order,
+                        PAGE_TYPE_USABLE | PAGE_TYPE_FREE);
+        block_list *b   = (block_list *)block;
+        b->prev         = NULL;
+        b->next         = pc->list[order];
+        pc->list[order] = b;
+    }
+    spinlock_release(&memory_info.lock);
+    pc->count[order] += got;
+    pc->refills++;
+    return got;
+}
+
+// Give at most n blocks back to buddy lists. pc->lock must be held.
+static void page_cache_drain_order(struct page_cache *pc, int order, size_t n) {
+    spinlock_acquire(&memory_info.lock);
+    while (n-- && pc->list[order]) {
+        block_list *b   = pc->list[order];
+        pc->list[order] = b->next;
+        pc->count[order]--;
+        free_pages_of_power_2((char *)b, order);
+    }
+    spinlock_release(&memory_info.lock);
+    pc->drains++;
+}
+
+void page_cache_drain(int cpu) {
+    struct page_cache *pc = &memory_info.page_caches[cpu];
+    spinlock_acquire(&pc->lock);
+    for (int order = 0; order < PAGE_CACHE_MAX_ORDER; order++)
+        if (pc->count[order])
+            page_cache_drain_order(pc, order, pc->count[order]);
+    spinlock_release(&pc->lock);
+}
+
+static char *page_cache_alloc(int order, int attr) {
+    struct page_cache *pc = &memory_info.page_caches[cpuid()];
+    spinlock_acquire(&pc->lock);
+    if (pc->list[order] == NULL) {
+        pc->misses++;
+        if (page_cache_refill(pc, order) == 0) {
+            spinlock_release(&pc->lock);
+            return NULL;
+        }
+    } else {
+        pc->hits++;
+    }
+    block_list *b   = pc->list[order];
+    pc->list[order] = b->next;
+    pc->count[order]--;
+    spinlock_release(&pc->lock);
+    set_allocated_page_info((char *)b, order, attr);
+    return (char *)b;
+}
+
+static void page_cache_free(char *p, int order) {
+    struct page_cache *pc = &memory_info.page_caches[cpuid()];
+    clear_page_info(&memory_info, p, 1 << order,
+                    PAGE_TYPE_USABLE | PAGE_TYPE_FREE);
+    spinlock_acquire(&pc->lock);
+    block_list *b   = (block_list *)p;
+    b->prev         = NULL;
+    b->next         = pc->list[order];
+    pc->list[order] = b;
+    pc->count[order]++;
+    if (pc->count[order] > page_cache_high(order))
+        page_cache_drain_order(pc, order, page_cache_batch(order));
+    spinlock_release(&pc->lock);
+}
+
+void print_page_cache_info() {
+    kprintf("[MEM] Page cache: cpu, hits, misses, refills, drains, cached\n");
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct page_cache *pc = &memory_info.page_caches[cpu];
+        if (!pc->hits && !pc->misses && !pc->drains)
+            continue;
+        kprintf("[MEM] %d, %ld, %ld, %ld, %ld, ", cpu, pc->hits, pc->misses,
+                pc->refills, pc->drains);
+        for (int order = 0; order < PAGE_CACHE_MAX_ORDER; order++)
+            kprintf("%ld/", pc->count[order]);
+        kprintf("\n");
+    }
+}
+
+/*
+ * Zeroed page pool.
+ * Pages in pool are allocated from buddy, page_alloc(1, PAGE_ALLOC_ZERO)
+ * takes one from here and falls back to clearing a fresh page.
+ */
+static char *zero_pool_get() {
+    struct zero_pool *zp = &memory_info.zero_pool;
+    char             *p  = NULL;
+    spinlock_acquire(&zp->lock);
+    if (zp->count) {
+        p = zp->pages[--zp->count];
+        zp->hits++;
+    } else {
+        zp->misses++;
+    }
+    spinlock_release(&zp->lock);
+    return p;
+}
+
+// Give all pooled pages back, when memory is short.
+static size_t zero_pool_drain() {
+    struct zero_pool *zp = &memory_info.zero_pool;
+    size_t            n  = 0;
+    spinlock_acquire(&zp->lock);
+    while (zp->count) {
+        page_free(zp->pages[--zp->count], 1);
+        n++;
+    }
+    spinlock_release(&zp->lock);
+    return n;
+}
+
+// Called by idle harts, zero at most ZERO_POOL_BATCH pages into pool.
+// Return pages zeroed, 0 if pool is full or no memory.
+size_t page_zero_idle() {
+    struct zero_pool *zp = &memory_info.zero_pool;
+    size_t            n  = 0;
+    for (; n < ZERO_POOL_BATCH; n++) {
+        if (zp->count >= ZERO_POOL_SIZE) // racy peek, checked again below
+            break;
+        // keep some memory for real allocations
+        if (memory_available() < ZERO_POOL_SIZE * PG_SIZE * 2)
+            break;
+        char *p = page_alloc(1, PAGE_TYPE_INUSE);
+        if (!p)
+            break;
+        memset(p, 0, PG_SIZE);
+        spinlock_acquire(&zp->lock);
+        bool full = zp->count >= ZERO_POOL_SIZE;
+        if (!full) {
+            zp->pages[zp->count++] = p;
+            zp->zeroed++;
+        }
+        spinlock_release(&zp->lock);
+        if (full) {
+            page_free(p, 1);
+            break;
+        }
+    }
+    return n;
+}
+
+void print_zero_pool_info() {
+    struct zero_pool *zp = &memory_info.zero_pool;
+    kprintf("[MEM] Zero pool: %ld pages, hits: %ld, misses: %ld, zeroed: "
+            "%ld.\n",
+            zp->count, zp->hits, zp->misses, zp->zeroed);
+}
+
+static char *buddy_alloc(int order, int attr) {
     spinlock_acquire(&memory_info.lock);
     char *r = allocate_pages_of_power_2(order, attr);
     spinlock_release(&memory_info.lock);
     return r;
 }
+
+char *page_alloc(size_t pages, int attr) {
+    int   order = trailing_zero(round_up_power_2(pages));
+    char *r     = NULL;
+    bool  zero  = attr & PAGE_ALLOC_ZERO;
+    attr &= ~PAGE_ALLOC_ZERO;
+    if (zero && order == 0 && (r = zero_pool_get()) != NULL) {
+        set_allocated_page_info(r, 0, attr);
+        return r;
+    }
+    if (order < PAGE_CACHE_MAX_ORDER)
+        r = page_cache_alloc(order, attr);
+    else
+        r = buddy_alloc(order, attr);
+    if (unlikely(r == NULL)) {
+        // Cached blocks on other harts may hold what we need, give them back.
+        zero_pool_drain();
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+            page_cache_drain(cpu);
+        r = buddy_alloc(order, attr);
+    }
+    if (unlikely(r == NULL) && kmem_shrink())
+        r = buddy_alloc(order, attr); // empty kmem pools returned
+    if (r && zero)
+        memset(r, 0, (1 << order) * PG_SIZE);
+    return r;
+}
+
 int page_free(char *p, size_t pages) {
+    int order = trailing_zero(round_up_power_2(pages));
+    if (p == NULL)
+        return 1; // free a NULL block
+    if (!(p >= memory_info.usable_memory_start &&
+          p < memory_info.usable_memory_end))
+        return 2; // free a block not managed by us
+    if (order < PAGE_CACHE_MAX_ORDER) {
+        page_cache_free(p, order);
+        return 0;
+    }
     spinlock_acquire(&memory_info.lock);
-    int r = free_pages_of_power_2((char *)p,
-                                  trailing_zero(round_up_power_2(pages)));
+    int r = free_pages_of_power_2((char *)p, order);
     spinlock_release(&memory_info.lock);
     return r;
 }
@@ -4,19 +4,50 @@
 
 #include "./utils.h"
 #include <driver/console.h>
+#include <lib/bitset.h>
 #include <lib/rb_tree.h>
 #include <lib/stdlib.h>
 #include <lib/string.h>
 #include <lib/sys/spinlock.h>
 #include <memory.h>
 
+#define KMEM_DEBUG_NONE  0
+#define KMEM_DEBUG_CHEAP 1
+#define KMEM_DEBUG_FULL  2
+
+#if KMEM_DEBUG_LEVEL >= KMEM_DEBUG_CHEAP
+#define kmem_check(exp, message) assert(exp, message)
+#else
+#define kmem_check(exp, message) ((void)0)
+#endif
+
+/*
+ * 小于等于KMEM_CLASS_MAX的空闲块按大小(16字节一级)放入分级空闲链表，
+ * 通过class_bitmap找到第一个非空的级别，O(1)完成分配；更大的块放入红黑树。
+ */
+#define KMEM_CLASS_STEP  16
+#define KMEM_CLASS_COUNT 60
+#define KMEM_CLASS_MAX   (minimal_block_size + (KMEM_CLASS_COUNT - 1) * 16)
+
+/*
+ * 内存池不够用时从buddy申请KMEM_GROW_PAGES页作为新的内存池，内存紧张时
+ * 由kmem_shrink将完全空闲的动态内存池归还。
+ * 大于KMEM_LARGE_THRESHOLD的申请直接使用整页，不进入内存池。
+ */
+#define KMEM_GROW_PAGES      16
+#define KMEM_LARGE_THRESHOLD (PG_SIZE / 2)
+#define KMEM_LARGE_COOKIE    0x4B4D454D4C415247UL
+
 struct __kmem_pool {
-    size_t              size; // *not include* pool header
-    struct __kmem_pool *next_pool;
-    size_t              free;
-    rb_tree             free_tree;
-    spinlock_t          lock;
-    char                mem[0];
+    size_t               size; // *not include* pool header
+    size_t               pages; // pages from buddy, 0 for static pool
+    struct __kmem_pool  *next_pool;
+    size_t               free;
+    rb_tree              free_tree;
+    struct __kmem_block *class_free[KMEM_CLASS_COUNT];
+    uint64_t             class_bitmap;
+    spinlock_t           lock;
+    char                 mem[0] __attribute__((aligned(16)));
 };
 
 typedef struct __kmem_pool kmem_pool;
@@ -29,6 +60,8 @@ static spinlock_t          kmem_lock = {.lock = false, .cpu = 0};
 #define KMEM_TYPE_INUSE     0x1000
 #define KMEM_TYPE_HAVE_NEXT 0x0002
 #define KMEM_TYPE_IN_TREE   0x0004
+#define KMEM_TYPE_IN_CLASS  0x0008
+#define KMEM_TYPE_PREV_FREE 0x0010 // previous block is free (has footer)
 
 //#define KMEM_BEGIN_CANARY 0xBEC5C5C5BABABABAL
 //#define KMEM_END_CANARY   0xED9D9D9D5A5A5A5AL
@@ -36,6 +69,7 @@ static spinlock_t          kmem_lock = {.lock = false, .cpu = 0};
 #define KMEM_END_CANARY   0xEDEDEDEDEDEDEDEDL
 
 // TODO: Smaller the block, glibc is amazing at pool management
+// 空闲块的最后8字节为footer，保存块大小，用于和前一块合并
 struct __kmem_block {
     uint16_t cookie;
     uint16_t type;
@@ -54,16 +88,34 @@ struct __kmem_block {
 
 typedef struct __kmem_block kmem_block;
 
+struct __kmem_large_head {
+    uint64_t cookie;
+    size_t   pages;
+};
+
+typedef struct __kmem_large_head kmem_large_head;
+
+extern struct memory_info_t memory_info; // in memory.c
+
 static const size_t kmem_block_head_size =
     sizeof(uint16_t) * 2 + sizeof(uint32_t) + sizeof(kmem_pool *);
 
-static const size_t minimal_block_size = ROUNDUP_WITH(16, sizeof(kmem_block));
+static const size_t footer_size = sizeof(uint64_t);
+
+static const size_t minimal_block_size =
+    ROUNDUP_WITH(16, sizeof(kmem_block) + sizeof(uint64_t));
 
+#if KMEM_DEBUG_LEVEL >= KMEM_DEBUG_CHEAP
 static const size_t canary_size = sizeof(uint64_t);
+#else
+static const size_t canary_size = 0;
+#endif
 
 _Static_assert(ROUNDUP_WITH(16, sizeof(kmem_block)) == 64,
                "size assert failed.");
 
+_Static_assert(KMEM_CLASS_COUNT <= 64, "Class bitmap too small.");
+
 _Static_assert(sizeof(kmem_block) == sizeof(uint16_t) * 2 + sizeof(uint32_t) +
                                          sizeof(kmem_pool *) +
                                          sizeof(struct __kmem_block_free),
@@ -77,6 +129,27 @@ static spinlock_t global_pool_lock = {.lock = 0, .cpu = 0};
 static void insert_into_pool(kmem_pool *pool, char *mem, size_t sz);
 static void remove_from_pool(kmem_block *block);
 
+static inline int size_class(size_t sz) {
+    if (sz > KMEM_CLASS_MAX || (sz % KMEM_CLASS_STEP) != 0)
+        return -1;
+    return (int)((sz - minimal_block_size) / KMEM_CLASS_STEP);
+}
+
+// 返回物理上相邻的下一块，若已到达池末尾则返回NULL
+static inline kmem_block *next_block_of(kmem_block *block) {
+    char *next = (char *)block + block->size;
+    if (next >= block->pool->mem + block->pool->size)
+        return NULL;
+    return (kmem_block *)next;
+}
+
+// 通过前一块的footer找到前一块，只有KMEM_TYPE_PREV_FREE时有效
+static inline kmem_block *prev_block_of(kmem_block *block) {
+    uint64_t prev_size = *(uint64_t *)((char *)block - footer_size);
+    return (kmem_block *)((char *)block - prev_size);
+}
+
+#if KMEM_DEBUG_LEVEL >= KMEM_DEBUG_FULL
 static size_t get_tree_totalsize(rb_node *node) {
     if (!node)
         return 0;
@@ -97,35 +170,129 @@ static size_t get_tree_totalsize(rb_node *node) {
     return sz;
 }
 
-void attach_to_memory_pool(char *mem, size_t sz) {
-    kprintf("[MEM] Attaching 0x%lx - 0x%lx to kernel memory pool.\n", mem,
-            mem + sz);
-    if (((uintptr_t)mem & 0xF) != 0)
-        return; // must aligned
-    if (sz <= sizeof(kmem_pool))
-        return;
+// 完整校验内存池，遍历整棵空闲树和分级链表，只在checking build中启用
+static void kmem_validate_pool(kmem_pool *pool) {
+    if (pool->free_tree.root)
+        rb_validate(pool->free_tree.root);
+    size_t total_size = get_tree_totalsize(pool->free_tree.root);
+    for (int i = 0; i < KMEM_CLASS_COUNT; i++) {
+        assert(!(pool->class_free[i]) == !(pool->class_bitmap & (1UL << i)),
+               "Class bitmap not match.");
+        for (kmem_block *b = pool->class_free[i]; b; b = b->mem.free.next_free)
+            total_size += b->size;
+    }
+    assert(pool->free == total_size, "Size not match.");
+}
+#else
+#define kmem_validate_pool(pool) ((void)0)
+#endif
 
+static void setup_pool(char *mem, size_t sz, size_t pages) {
     kmem_pool *pool = (kmem_pool *)mem;
     memset(pool, 0, sizeof(kmem_pool));
     spinlock_init(&pool->lock);
     spinlock_acquire(&pool->lock);
-    pool->size = sz - sizeof(kmem_pool); // 减去内存池头的大小
-    pool->free = pool->size;
-    assert(mem + sz == pool->mem + pool->free, "Pool size Not match");
+    // 减去内存池头的大小，保持所有块大小都是16的倍数
+    pool->size  = ROUNDDOWN_WITH(16, sz - sizeof(kmem_pool));
+    pool->free  = pool->size;
+    pool->pages = pages;
+    assert(pool->mem + pool->free <= mem + sz, "Pool size Not match");
     spinlock_acquire(&global_pool_lock);
     pool->next_pool = memory_pool;
     memory_pool     = pool;
-    insert_into_pool(pool, mem + sizeof(kmem_pool), pool->free);
+    insert_into_pool(pool, pool->mem, pool->free);
     spinlock_release(&global_pool_lock);
     spinlock_release(&pool->lock);
 }
 
+void attach_to_memory_pool(char *mem, size_t sz) {
+    kprintf("[MEM] Attaching 0x%lx - 0x%lx to kernel memory pool.\n", mem,
+            mem + sz);
+    if (((uintptr_t)mem & 0xF) != 0)
+        return; // must aligned
+    if (sz <= sizeof(kmem_pool) + minimal_block_size)
+        return;
+    setup_pool(mem, sz, 0);
+}
+
+// 从buddy申请新的内存池，kmem_lock must *not* be held.
+static bool kmem_grow() {
+    char *mem = page_alloc(KMEM_GROW_PAGES, PAGE_TYPE_INUSE | PAGE_TYPE_SYSTEM |
+                                                PAGE_TYPE_POOL);
+    if (!mem)
+        return false;
+    setup_pool(mem, KMEM_GROW_PAGES * PG_SIZE, KMEM_GROW_PAGES);
+    return true;
+}
+
+// 归还所有完全空闲的动态内存池，返回归还的页数
+size_t kmem_shrink() {
+    kmem_pool *empty = NULL;
+    spinlock_acquire(&kmem_lock);
+    spinlock_acquire(&global_pool_lock);
+    kmem_pool **pp = &memory_pool;
+    while (*pp) {
+        kmem_pool *pool = *pp;
+        if (pool->pages && pool->free == pool->size) {
+            *pp             = pool->next_pool;
+            pool->next_pool = empty;
+            empty           = pool;
+        } else {
+            pp = &pool->next_pool;
+        }
+    }
+    spinlock_release(&global_pool_lock);
+    spinlock_release(&kmem_lock);
+
+    size_t pages = 0;
+    while (empty) {
+        kmem_pool *next = empty->next_pool;
+        pages += empty->pages;
+        page_free((char *)empty, empty->pages);
+        empty = next;
+    }
+    return pages;
+}
+
+static char *kmalloc_large(size_t size) {
+    size_t pages = PG_ROUNDUP(size + sizeof(kmem_large_head)) / PG_SIZE;
+    char  *mem   = page_alloc(pages, PAGE_TYPE_INUSE | PAGE_TYPE_SYSTEM |
+                                         PAGE_TYPE_KMALLOC);
+    if (!mem)
+        return NULL;
+    kmem_large_head *head = (kmem_large_head *)mem;
+    head->cookie          = KMEM_LARGE_COOKIE;
+    head->pages           = pages;
+#if KMEM_MAKE_CLEAN
+    memset(mem + sizeof(kmem_large_head), 0, size);
+#endif
+    return mem + sizeof(kmem_large_head);
+}
+
+// 若p由kmalloc_large分配则释放并返回true
+static bool kfree_large(void *p) {
+    char *page = (char *)PG_ROUNDDOWN(p);
+    if (!(page >= memory_info.usable_memory_start &&
+          page < memory_info.usable_memory_end))
+        return false;
+    if (!(memory_info.pages_info[GET_ID_BY_PAGE(memory_info, page)].type &
+          PAGE_TYPE_KMALLOC))
+        return false;
+    kmem_large_head *head = (kmem_large_head *)page;
+    assert(head->cookie == KMEM_LARGE_COOKIE, "Large block invalid at kfree.");
+    assert((char *)p == page + sizeof(kmem_large_head),
+           "Free inside a large block.");
+    head->cookie = 0;
+    page_free(page, head->pages);
+    return true;
+}
+
 // 向内存池中插入一块地址为 mem 大小为 sz 的块内存
 static void insert_into_pool(kmem_pool *pool, char *mem, size_t sz) {
-    assert(pool, "Pool must be a valid pointer.");
-    assert(mem, "Mem must be a valid pointer (Null protector).");
-    assert(sz >= minimal_block_size,
-           "Mem size must be larger than minimal block size");
+    kmem_check(pool, "Pool must be a valid pointer.");
+    kmem_check(mem, "Mem must be a valid pointer (Null protector).");
+    kmem_check(sz >= minimal_block_size,
+               "Mem size must be larger than minimal block size");
 
     kmem_block *block = (kmem_block *)mem;
     memset(block, 0, sizeof(kmem_block));
@@ -137,6 +304,25 @@ static void insert_into_pool(kmem_pool *pool, char *mem, size_t sz) {
     block->pool   = pool;
     block->size = node->key = sz;
 
+    // 设置footer，并告知后一块其前一块空闲
+    *(uint64_t *)(mem + sz - footer_size) = sz;
+    kmem_block *next_block = next_block_of(block);
+    if (next_block)
+        next_block->type |= KMEM_TYPE_PREV_FREE;
+
+    int cls = size_class(sz);
+    if (cls >= 0) {
+        kmem_block *head          = pool->class_free[cls];
+        block->mem.free.prev_free = NULL;
+        block->mem.free.next_free = head;
+        if (head)
+            head->mem.free.prev_free = block;
+        pool->class_free[cls] = block;
+        pool->class_bitmap |= (1UL << cls);
+        block->type |= KMEM_TYPE_IN_CLASS;
+        return;
+    }
+
     rb_node *existed = rb_insert(&pool->free_tree, node);
     if (existed && existed != node) {
         /*
@@ -147,16 +333,16 @@ static void insert_into_pool(kmem_pool *pool, char *mem, size_t sz) {
          */
         kmem_block *eblock = container_of(existed, kmem_block, mem.free.node);
 
-        assert(eblock->cookie == KMEM_COOKIE, "Existed Block invalid.");
-        assert(eblock->type & KMEM_TYPE_IN_TREE,
-               "Existed Block type mismatch.");
-        assert(eblock->pool == pool, "Existed Block not inside our pool.");
-        assert(existed->key == node->key, "Exitsed but not same key.");
+        kmem_check(eblock->cookie == KMEM_COOKIE, "Existed Block invalid.");
+        kmem_check(eblock->type & KMEM_TYPE_IN_TREE,
+                   "Existed Block type mismatch.");
+        kmem_check(eblock->pool == pool, "Existed Block not inside our pool.");
+        kmem_check(existed->key == node->key, "Exitsed but not same key.");
 
         if (eblock->type & KMEM_TYPE_HAVE_NEXT) {
-            assert(eblock->mem.free.next_free, "Have next but no next.");
+            kmem_check(eblock->mem.free.next_free, "Have next but no next.");
             kmem_block *next = eblock->mem.free.next_free;
-            assert(next->mem.free.prev_free == eblock, "list guard.");
+            kmem_check(next->mem.free.prev_free == eblock, "list guard.");
             next->mem.free.prev_free   = block;
             block->mem.free.next_free  = next;
             eblock->mem.free.next_free = block;
@@ -177,11 +363,38 @@ static void insert_into_pool(kmem_pool *pool, char *mem, size_t sz) {
 
 // Trust block->tree_node is in tree
 static void remove_from_pool(kmem_block *block) {
-    assert(block->cookie == KMEM_COOKIE, "Kmem block invalid.");
-    assert(block->pool, "Kmem Block have not inserted into a pool.");
+    kmem_check(block->cookie == KMEM_COOKIE, "Kmem block invalid.");
+    kmem_check(block->pool, "Kmem Block have not inserted into a pool.");
     kmem_pool *pool = block->pool;
     rb_node   *node = &block->mem.free.node;
 
+    kmem_block *next_block = next_block_of(block);
+    if (next_block)
+        next_block->type &= ~(KMEM_TYPE_PREV_FREE);
+
+    if (block->type & KMEM_TYPE_IN_CLASS) {
+        int         cls  = size_class(block->size);
+        kmem_block *prev = block->mem.free.prev_free;
+        kmem_block *next = block->mem.free.next_free;
+        kmem_check(cls >= 0, "Block in class but size mismatch.");
+        if (prev) {
+            kmem_check(prev->mem.free.next_free == block,
+                       "Prev block's next is not current block.");
+            prev->mem.free.next_free = next;
+        } else {
+            kmem_check(pool->class_free[cls] == block,
+                       "Block is not the head of class.");
+            pool->class_free[cls] = next;
+            if (!next)
+                pool->class_bitmap &= ~(1UL << cls);
+        }
+        if (next)
+            next->mem.free.prev_free = prev;
+        block->type &= ~(KMEM_TYPE_IN_CLASS);
+        block->mem.free.prev_free = block->mem.free.next_free = NULL;
+        return;
+    }
+
     /*
      * 将内存块从内存池中移除有如下步骤：
      * 判断内存块是否有树节点，如果有：
@@ -194,28 +407,30 @@ static void remove_from_pool(kmem_block *block) {
 
     kmem_block *prev = block->mem.free.prev_free;
     if (!(block->type & KMEM_TYPE_IN_TREE)) {
-        assert(prev, "Not in tree but no prev");
-        assert(prev->cookie == KMEM_COOKIE, "Prev block is not valid.");
-        assert(prev->pool == pool, "Prev block is not inside correct pool.");
-        assert(prev->mem.free.next_free == block,
-               "Prev block's next is not current block.");
+        kmem_check(prev, "Not in tree but no prev");
+        kmem_check(prev->cookie == KMEM_COOKIE, "Prev block is not valid.");
+        kmem_check(prev->pool == pool,
+                   "Prev block is not inside correct pool.");
+        kmem_check(prev->mem.free.next_free == block,
+                   "Prev block's next is not current block.");
     } else {
-        assert(prev == NULL, "In tree but have prev.");
+        kmem_check(prev == NULL, "In tree but have prev.");
     }
 
     kmem_block *next = block->mem.free.next_free;
     if (block->type & KMEM_TYPE_HAVE_NEXT) {
-        assert(next, "Have next but no next.");
-        assert(next->cookie == KMEM_COOKIE, "Next block is not valid.");
-        assert(next->pool == pool, "Next block is not inside correct pool.");
-        assert(next->mem.free.prev_free == block,
-               "Next block's prev is not current block.");
+        kmem_check(next, "Have next but no next.");
+        kmem_check(next->cookie == KMEM_COOKIE, "Next block is not valid.");
+        kmem_check(next->pool == pool,
+                   "Next block is not inside correct pool.");
+        kmem_check(next->mem.free.prev_free == block,
+                   "Next block's prev is not current block.");
     } else {
-        assert(next == NULL, "Have no next but next not null.");
+        kmem_check(next == NULL, "Have no next but next not null.");
     }
 
     if (block->type & KMEM_TYPE_IN_TREE) {
-        assert(node->key, "In tree but key is 0.");
+        kmem_check(node->key, "In tree but key is 0.");
         if (block->type & KMEM_TYPE_HAVE_NEXT) {
             rb_replace(&pool->free_tree, node, &next->mem.free.node);
             next->mem.free.prev_free = NULL;
@@ -256,9 +471,23 @@ static rb_node *rb_search_upper(rb_node *x, uint64_t key) {
         return closet;
 }
 
+// 在池中寻找能装下need_size的最小空闲块，pool->lock must be held.
+static kmem_block *search_free_block(kmem_pool *pool, size_t need_size) {
+    int cls = size_class(need_size);
+    if (cls >= 0) {
+        uint64_t mask = pool->class_bitmap & (~0UL << cls);
+        if (mask)
+            return pool->class_free[ctz64(mask)];
+    }
+    rb_node *node = rb_search_upper(pool->free_tree.root, need_size);
+    if (!node)
+        return NULL;
+    return container_of(node, kmem_block, mem.free.node);
+}
+
 /*
  * kmem提供kmalloc和kfree两个函数作为内核内小块内存分配器。
- * TODO: Slab内存分配器
+ * 固定大小的对象请使用slab.c中的kmem_cache。
  */
 
 char *kmalloc(size_t size) {
@@ -269,8 +498,11 @@ char *kmalloc(size_t size) {
      * 3. 若块大小 - (头大小 + 所申请的大小)
      *    大于空闲内存块结构的大小，则将剩余的部分插入回内存池
      * 4. 返回前设置金丝雀值
+     * 若所有内存池都放不下，则从buddy申请新的内存池后重试一次
      */
-    spinlock_acquire(&kmem_lock);
+    if (size > KMEM_LARGE_THRESHOLD)
+        return kmalloc_large(size);
+
     size += canary_size * 2; // add canary
     size = ROUNDUP_WITH(16, size);
 
@@ -282,109 +514,171 @@ char *kmalloc(size_t size) {
     assert(need_size >= sizeof(kmem_block), "Size guard.");
     // need_size 是所需的最小内存块大小
 
-    kmem_pool *pool = memory_pool;
-    rb_node   *node = NULL;
-    spinlock_acquire(&pool->lock);
-    while (pool && !node) {
-        node = rb_search_upper(pool->free_tree.root, need_size);
-        if (node == NULL) {
-            if (need_size <= pool->free)
-                kpanic("Kmem have free but cannot search tree.");
-            spinlock_release(&pool->lock);
-            pool = pool->next_pool;
-            if (!pool)
-                return NULL;
-            spinlock_acquire(&pool->lock);
-        }
+    bool        grown = false;
+    kmem_pool  *pool  = NULL;
+    kmem_block *block = NULL;
+retry:
+    spinlock_acquire(&kmem_lock);
+    for (pool = memory_pool; pool; pool = pool->next_pool) {
+        spinlock_acquire(&pool->lock);
+        block = search_free_block(pool, need_size);
+        if (block)
+            break;
+        spinlock_release(&pool->lock);
     }
-    if (node == NULL)
+    if (block == NULL) {
+        spinlock_release(&kmem_lock);
+        if (!grown && kmem_grow()) {
+            grown = true;
+            goto retry;
+        }
         return NULL;
+    }
 
-    rb_validate(pool->free_tree.root);
-    kmem_block *block = container_of(node, kmem_block, mem.free.node);
+    kmem_validate_pool(pool);
     remove_from_pool(block);
     size_t remaining_size = block->size - need_size;
     if (remaining_size >= minimal_block_size) {
         block->size     = need_size;
         char *new_block = block->mem.mem + size;
-        assert(((char *)block) + need_size == new_block, "Size not match.");
+        kmem_check(((char *)block) + need_size == new_block,
+                   "Size not match.");
         insert_into_pool(pool, new_block, remaining_size);
     } else {
         size = block->size - kmem_block_head_size;
     }
     block->type = KMEM_TYPE_INUSE;
     pool->free -= block->size;
-    rb_validate(pool->free_tree.root);
-    size_t total_size = get_tree_totalsize(pool->free_tree.root);
-    assert(pool->free == total_size, "Size not match.");
+    kmem_validate_pool(pool);
     spinlock_release(&pool->lock);
     spinlock_release(&kmem_lock);
 
+#if KMEM_DEBUG_LEVEL >= KMEM_DEBUG_CHEAP
     // set canary
     uint64_t *begin_canary = (uint64_t *)block->mem.mem;
     uint64_t *end_canary   = (uint64_t *)(block->mem.mem + size - canary_size);
 
     *begin_canary = KMEM_BEGIN_CANARY;
     *end_canary   = KMEM_END_CANARY;
+#endif
 #if KMEM_MAKE_CLEAN
-    memset(((char *)begin_canary) + canary_size, 0,
-           (uintptr_t)end_canary - (uintptr_t)begin_canary - 2 * canary_size);
+    memset(block->mem.mem + canary_size, 0, size - 2 * canary_size);
 #endif
 
     return block->mem.mem + canary_size;
 }
 
 void kfree(void *p) {
+    if (!p)
+        return;
+    if (kfree_large(p))
+        return;
+    // objects from slab caches could be kfree'd as well
+    kmem_cache_t *cache = kmem_cache_of(p);
+    if (cache) {
+        kmem_cache_free(cache, p);
+        return;
+    }
     spinlock_acquire(&kmem_lock);
     kmem_block *block = (kmem_block *)(p - kmem_block_head_size - canary_size);
-    assert(block->cookie == KMEM_COOKIE, "Memory block invalid at kfree.");
-    assert(block->type == KMEM_TYPE_INUSE, "Memory block not inuse.");
+    kmem_check(block->cookie == KMEM_COOKIE, "Memory block invalid at kfree.");
+    kmem_check((block->type & ~KMEM_TYPE_PREV_FREE) == KMEM_TYPE_INUSE,
+               "Memory block not inuse.");
+#if KMEM_DEBUG_LEVEL >= KMEM_DEBUG_CHEAP
     uint64_t *begin_canary = (uint64_t *)block->mem.mem;
     uint64_t *end_canary =
         (uint64_t *)(((char *)block) + block->size - canary_size);
     assert(*begin_canary == KMEM_BEGIN_CANARY, "Begin canary dead.");
     assert(*end_canary == KMEM_END_CANARY, "End canary dead.");
+#endif
 
-#if KMEM_MAKE_CLEAN
+#if KMEM_DEBUG_LEVEL >= KMEM_DEBUG_FULL
+    // poison freed memory to catch use-after-free
     memset(begin_canary, 0xFA,
            (uintptr_t)end_canary - (uintptr_t)begin_canary + canary_size);
 #endif
 
     kmem_pool *pool = block->pool;
 
-    size_t total_size = get_tree_totalsize(pool->free_tree.root);
-    assert(pool->free == total_size, "Size not match.");
-
-    kmem_block *next_block = (kmem_block *)((char *)block + block->size);
+    /*
+     * 释放时和相邻的空闲块双向合并：
+     * 后一块通过block->size找到，前一块通过KMEM_TYPE_PREV_FREE和footer找到。
+     * 由于每次释放都会合并，池中不存在两个相邻的空闲块。
+     */
     spinlock_acquire(&pool->lock);
-    rb_validate(pool->free_tree.root);
-    if ((char *)next_block < pool->mem + pool->size) {
+    kmem_validate_pool(pool);
+    kmem_block *next_block = next_block_of(block);
+    if (next_block) {
         // Next block is inside pool
-        assert(next_block->cookie == KMEM_COOKIE,
-               "Next Block is not KMem block.");
-        while (next_block->type & KMEM_TYPE_FREE) {
-            assert(next_block->pool == pool, "Next block pool not match.");
+        kmem_check(next_block->cookie == KMEM_COOKIE,
+                   "Next Block is not KMem block.");
+        if (next_block->type & KMEM_TYPE_FREE) {
+            kmem_check(next_block->pool == pool, "Next block pool not match.");
             // detach free block
             remove_from_pool(next_block);
             pool->free -= next_block->size;
             block->size += next_block->size;
-            // search for next
-            char *m    = (char *)next_block;
-            next_block = (kmem_block *)(m + next_block->size);
             // clear next_block head
-            memset(m, 0xBA, sizeof(kmem_block));
-            if ((char *)next_block >= pool->mem + pool->size) {
-                break;
-            }
+            memset(next_block, 0xBA, sizeof(kmem_block));
         }
     }
+    if (block->type & KMEM_TYPE_PREV_FREE) {
+        kmem_block *prev_block = prev_block_of(block);
+        kmem_check(prev_block->cookie == KMEM_COOKIE,
+                   "Prev Block is not KMem block.");
+        kmem_check(prev_block->type & KMEM_TYPE_FREE, "Prev block not free.");
+        kmem_check(prev_block->pool == pool, "Prev block pool not match.");
+        remove_from_pool(prev_block);
+        pool->free -= prev_block->size;
+        prev_block->size += block->size;
+        memset(block, 0xBA, sizeof(kmem_block));
+        block = prev_block;
+    }
 
     insert_into_pool(pool, (char *)block, block->size);
 
     pool->free += block->size;
-    rb_validate(pool->free_tree.root);
-    total_size = get_tree_totalsize(pool->free_tree.root);
-    assert(pool->free == total_size, "Size not match.");
+    kmem_validate_pool(pool);
     spinlock_release(&pool->lock);
     spinlock_release(&kmem_lock);
 }
+
+#define KMEM_HISTOGRAM_BUCKETS 12 // 64B, 128B, ... , >= 128K
+
+// 打印每个内存池的碎片情况：最大空闲块和按2的幂分桶的空闲块直方图
+void print_kmem_pool_info() {
+    spinlock_acquire(&global_pool_lock);
+    for (kmem_pool *pool = memory_pool; pool; pool = pool->next_pool) {
+        size_t histogram[KMEM_HISTOGRAM_BUCKETS] = {0};
+        size_t largest = 0, free_blocks = 0, used_blocks = 0;
+        spinlock_acquire(&pool->lock);
+        for (kmem_block *block = (kmem_block *)pool->mem; block;
+             block = next_block_of(block)) {
+            if (!(block->type & KMEM_TYPE_FREE)) {
+                used_blocks++;
+                continue;
+            }
+            free_blocks++;
+            if (block->size > largest)
+                largest = block->size;
+            int bucket = 0;
+            while (bucket < KMEM_HISTOGRAM_BUCKETS - 1 &&
+                   block->size >= (128UL << bucket))
+                bucket++;
+            histogram[bucket]++;
+        }
+        kprintf("[MEM] Kmem pool 0x%lx: size %ld, free %ld, largest free "
+                "%ld, %ld free / %ld used blocks.\n",
+                pool, pool->size, pool->free, largest, free_blocks,
+                used_blocks);
+        if (pool->free)
+            kprintf("[MEM] Fragmentation: %ld%%\n",
+                    100 - largest * 100 / pool->free);
+        for (int i = 0; i < KMEM_HISTOGRAM_BUCKETS; i++)
+            if (histogram[i])
+                kprintf("[MEM]   >= %ld bytes: %ld\n", 64UL << i,
+                        histogram[i]);
+        spinlock_release(&pool->lock);
+    }
+    spinlock_release(&global_pool_lock);
+}
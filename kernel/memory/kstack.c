@@ -0,0 +1,105 @@
+#include <configs.h>
+#include <driver/console.h>
+#include <environment.h>
+#include <lib/bitset.h>
+#include <lib/stdlib.h>
+#include <lib/sys/spinlock.h>
+#include <memory.h>
+#include <proc.h>
+#include <riscv.h>
+
+/*
+ * 内核栈不再放在直接映射区，而是映射到KSTACK_VBASE开始的独立区域。
+ * 每个slot大小为KSTACK_SLOT_SIZE，低半部分不映射作为guard page，高半部分
+ * 映射PROG_KSTACK_SIZE的栈，栈溢出会在guard page上缺页。trap.S在sp落入
+ * guard page时切换到每个hart的溢出栈再panic，避免在guard page上反复陷入。
+ * 释放的栈保持映射放入缓存，下次分配直接复用，不需要分配页面和刷新TLB。
+ * 缓存满时才解除映射，全局表项可能在任何CPU的TLB中，刷新所有CPU。
+ * 该区域的一级页表在init_paging时建立，所有页目录共享，映射对所有进程可见。
+ */
+
+_Static_assert(PROG_KSTACK_SIZE == 0x2000 &&
+                   KSTACK_SLOT_SIZE == 2 * PROG_KSTACK_SIZE,
+               "trap.S checks bit 13 of sp for kstack guard pages.");
+_Static_assert((uint64_t)KSTACK_SLOTS * KSTACK_SLOT_SIZE <= 0x40000000,
+               "Kernel stacks must fit in the shared 1G page table.");
+
+#define KSTACK_CACHE_SIZE 8 // mapped stacks kept at most
+
+static spinlock_t kstack_lock = {.lock = false, .cpu = 0};
+static bitset_t   kstack_slots[BITSET_ARRAY_SIZE_FOR(KSTACK_SLOTS)];
+static char      *kstack_cache[KSTACK_CACHE_SIZE];
+static size_t     kstack_cached;
+// statistics
+static uint64_t kstack_hits;
+static uint64_t kstack_misses;
+
+// used by trap.S
+char __attribute__((aligned(PG_SIZE)))
+kstack_overflow_stack[MAX_CPUS][PG_SIZE];
+
+static inline char *kstack_of_slot(uint64_t slot) {
+    return (char *)(KSTACK_VBASE + slot * KSTACK_SLOT_SIZE + KSTACK_SLOT_SIZE -
+                    PROG_KSTACK_SIZE);
+}
+
+// Return the lowest address of a kernel stack, NULL if none.
+char *kstack_alloc() {
+    spinlock_acquire(&kstack_lock);
+    if (kstack_cached) {
+        char *stack = kstack_cache[--kstack_cached];
+        kstack_hits++;
+        spinlock_release(&kstack_lock);
+        return stack;
+    }
+    kstack_misses++;
+    uint64_t slot =
+        set_first_unset_bit(kstack_slots, BITSET_ARRAY_SIZE_FOR(KSTACK_SLOTS));
+    if (slot == 0xFFFFFFFFFFFFFFFF || slot >= KSTACK_SLOTS) {
+        spinlock_release(&kstack_lock);
+        return NULL;
+    }
+    char *stack = kstack_of_slot(slot);
+    char *pa    = page_alloc(PROG_KSTACK_SIZE / PG_SIZE, PAGE_TYPE_SYSTEM);
+    if (!pa || map_pages(os_env.kernel_pagedir, stack, pa, PROG_KSTACK_SIZE,
+                         PTE_TYPE_RW, false, true) != 0) {
+        page_free(pa, PROG_KSTACK_SIZE / PG_SIZE);
+        clear_bit(kstack_slots, slot);
+        spinlock_release(&kstack_lock);
+        return NULL;
+    }
+    spinlock_release(&kstack_lock);
+    return stack;
+}
+
+void kstack_free(char *stack) {
+    uint64_t slot = ((uintptr_t)stack - KSTACK_VBASE) / KSTACK_SLOT_SIZE;
+    assert(slot < KSTACK_SLOTS && stack == kstack_of_slot(slot),
+           "Invalid kernel stack.");
+    spinlock_acquire(&kstack_lock);
+    if (kstack_cached < KSTACK_CACHE_SIZE) {
+        kstack_cache[kstack_cached++] = stack;
+        spinlock_release(&kstack_lock);
+        return;
+    }
+    // global mapping, flush everywhere before the slot and pages can be
+    // reused
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, NULL);
+    unmap_pages_batch(os_env.kernel_pagedir, stack, PROG_KSTACK_SIZE / PG_SIZE,
+                      &batch);
+    tlb_batch_flush(&batch);
+    clear_bit(kstack_slots, slot);
+    spinlock_release(&kstack_lock);
+}
+
+// trap.S jumps here on the overflow stack
+void __attribute__((used, noreturn)) kstack_overflow() {
+    kpanic("Kernel stack overflow, sepc: 0x%lx, stval: 0x%lx.",
+           CSR_Read(sepc), CSR_Read(stval));
+}
+
+void print_kstack_info() {
+    kprintf("[MEM] Kernel stacks: cached %ld, hits: %ld, misses: %ld.\n",
+            kstack_cached, kstack_hits, kstack_misses);
+}
@@ -6,23 +6,29 @@
 
 struct memory_info_t memory_info;
 
-// kmem.c
-extern void attach_to_memory_pool(char *mem, size_t sz);
+// buddy.c
+extern void buddy_init_free_range(char *start, char *end);
 // paging.c
 extern void init_paging(void *init_start, void *init_end);
 
 void init_memory() {
     spinlock_init(&memory_info.lock);
+    for (int i = 0; i < MAX_CPUS; i++)
+        spinlock_init(&memory_info.page_caches[i].lock);
+    spinlock_init(&memory_info.zero_pool.lock);
     spinlock_acquire(&memory_info.lock);
     kprintf("[MEM] Init memory From 0x%lx - 0x%lx\n", memory_info.memory_start,
             memory_info.memory_end);
     size_t pg_count =
         (memory_info.memory_end - memory_info.memory_start) / PG_SIZE;
-    size_t pg_info_size = pg_count * sizeof(struct page_info);
-    size_t buddy_table_size =
-        ((1 << (MAX_BUDDY_ORDER)) - 1) * pg_count / (1 << MAX_BUDDY_ORDER);
-    size_t max_block_size = (1 << (MAX_BUDDY_ORDER - 1)) *
-                            PG_SIZE; // minimal allocate unit is a page.
+    size_t pg_info_size     = pg_count * sizeof(struct page_info);
+    size_t buddy_table_size = 0;
+    size_t buddy_map_size[MAX_BUDDY_ORDER]; // in bitset_t
+    for (int i = 0; i < MAX_BUDDY_ORDER; i++) {
+        size_t pairs      = (pg_count >> (i + 1)) + 1;
+        buddy_map_size[i] = BITSET_ARRAY_SIZE_FOR(pairs);
+        buddy_table_size += buddy_map_size[i] * sizeof(bitset_t);
+    }
     memory_info.page_count   = pg_count;
     memory_info.buddy_map[0] = (bitset_t *)ROUNDDOWN_WITH(
         0x10, (memory_info.memory_end - buddy_table_size));
@@ -42,60 +48,18 @@ void init_memory() {
             memory_info.usable_memory_start, memory_info.usable_memory_end,
             (memory_info.memory_end - memory_info.usable_memory_end) / 1024);
 
-    memory_info.free_count[0] = 0;
-    memory_info.free_list[0]  = (block_list *)NULL;
-    for (int i = 0; i < MAX_BUDDY_ORDER - 1; i++) {
-        memory_info.buddy_map[i + 1] = (bitset_t *)((memory_info.buddy_map[i]) +
-                                                    (pg_count >> (i + 1)) / 8);
-        memory_info.free_list[i + 1] = (block_list *)NULL;
-        memory_info.free_count[i + 1] = 0;
+    memory_info.free_orders = 0;
+    for (int i = 0; i < MAX_BUDDY_ORDER; i++) {
+        if (i + 1 < MAX_BUDDY_ORDER)
+            memory_info.buddy_map[i + 1] =
+                memory_info.buddy_map[i] + buddy_map_size[i];
+        memory_info.free_list[i]  = (block_list *)NULL;
+        memory_info.free_count[i] = 0;
     }
-#if 0
-    void *pg            = NULL;
-    int   current_order = MAX_BUDDY_ORDER;
-    for (pg = memory_info.usable_memory_start;
-         pg < memory_info.usable_memory_end;) {
-        // Assure pg could contains current order size.
-        size_t current_size = (1 << (current_order - 1)) * PG_SIZE;
-        do {
-            if (pg + current_size < memory_info.usable_memory_end) {
-                break;
-            }
-            current_order--;
-            current_size = (1 << (current_order - 1)) * PG_SIZE;
-            if (current_order <= 0) {
-                current_size = 0;
-                break;
-            }
-        } while (current_order > 0);
-        if (!current_size)
-            break;
+    // 批量将可用内存按最大可能的order放入空闲链表，不再逐页释放
+    buddy_init_free_range(memory_info.usable_memory_start,
+                          memory_info.usable_memory_end);
 
-        block_list *current = (block_list *)pg;
-        current->next       = memory_info.free_list[current_order - 1];
-        current->prev       = NULL;
-        if (current->next)
-            current->next->prev = current;
-        memory_info.free_list[current_order - 1] = current;
-        memory_info.free_count[current_order - 1]++;
-        pg += current_size;
-    }
-#else
-    char *pg = NULL;
-    for (pg = memory_info.usable_memory_start;
-         pg < memory_info.usable_memory_end - max_block_size;
-         pg += max_block_size) {
-        block_list *current = (block_list *)pg;
-        current->next       = memory_info.free_list[MAX_BUDDY_ORDER - 1];
-        current->prev       = NULL;
-        if (current->next)
-            current->next->prev = current;
-        memory_info.free_list[MAX_BUDDY_ORDER - 1] = current;
-        memory_info.free_count[MAX_BUDDY_ORDER - 1]++;
-    }
-    kprintf("[MEM] Waste: %ld Kbytes.\n",
-            (memory_info.usable_memory_end - (pg - max_block_size)) / 1024);
-#endif
     // setup system page info
     for (size_t i = 0; i < pg_count; i++) {
         char *page = GET_PAGE_BY_ID(memory_info, i);
@@ -106,11 +70,8 @@ void init_memory() {
             memory_info.pages_info[i].type = PAGE_TYPE_INUSE | PAGE_TYPE_SYSTEM;
     }
     kprintf("[MEM] Finish Initialization.\n");
-    // TODO: init memory pool with wasted memory
     spinlock_release(&memory_info.lock);
-    char  *pool_addr = (char *)PG_ROUNDUP(pg);
-    size_t pool_sz   = memory_info.usable_memory_end - pool_addr;
-    attach_to_memory_pool(pool_addr, pool_sz);
+    // kmem pools are grown from buddy on demand
 
     kprintf("[MEM] Setup SV39 MMU. In position mapping for kernel.\n");
     init_paging(memory_info.memory_start, memory_info.memory_end);
@@ -123,6 +84,12 @@ size_t memory_available() {
         size_t current_size = (1 << (order)) * PG_SIZE;
         sz += memory_info.free_count[order] * current_size;
     }
+    // pages held by per-hart caches are free too
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        for (int order = 0; order < PAGE_CACHE_MAX_ORDER; order++)
+            sz += memory_info.page_caches[cpu].count[order] * (1 << order) *
+                  PG_SIZE;
+    sz += memory_info.zero_pool.count * PG_SIZE;
     return sz;
 }
 
@@ -9,7 +9,9 @@
 #include <lib/stdlib.h>
 #include <lib/string.h>
 #include <memory.h>
+#include <mm.h>
 #include <riscv.h>
+#include <stddef.h>
 
 /*
  * SV39: 三级页表，虚拟地址每级9位，一级共512个，刚好一页（4096Bytes）。
@@ -17,11 +19,18 @@
  * 二级页表：一页2MB，一张表映射1G
  * 三级页表：一页4K，一张表映射2MB
  * 内核表用大页映射。
+ * map_pages在VA和PA都按2MB对齐且剩余大小足够时，自动在二级页表中放置2MB的
+ * 大页(megapage)。需要按4K操作大页的一部分时(unmap、CoW)，先将其拆分为一张
+ * 三级页表。
  */
 #define PG_SIZE_LEVEL_1 (0x40000000)
 #define PG_SIZE_LEVEL_2 (0x00200000)
 #define PG_SIZE_LEVEL_3 (0x00001000) // equ to PG_SIZE
 
+#define MEGAPAGE_PAGES (PG_SIZE_LEVEL_2 / PG_SIZE)
+#define IS_MEGAPAGE_ALIGNED(x)                                                 \
+    ((((uintptr_t)(x)) & (PG_SIZE_LEVEL_2 - 1)) == 0)
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PX_MASK         0x1FF // 9 bits
 #define PX_SHIFT(level) (PG_SHIFT + (9 * (level)))
@@ -33,96 +42,339 @@
 // that have the high bit set.
 #define MAXVA (1L << (9 + 9 + 9 + 12 - 1))
 
+// first root page table entry of kernel space, PX(2, 0x80000000)
+#define KERNEL_PDE_START 2
+
 #define PAGING_DEBUG 0
 
 _Static_assert(sizeof(pte_st) == sizeof(pte_t), "PTE Definination wrong.");
 
 extern struct memory_info_t memory_info;
 
-pte_t *walk_pages(pde_t page_dir, void *va, int alloc) {
+/*
+ * 全局共享的只读零页。brk扩展的堆只保留范围不分配内存，读缺页时映射零页，
+ * 写缺页时才分配新的零页。零页不参与引用计数，也不会被释放。
+ */
+static char *zero_page = NULL;
+
+#define IS_ZERO_PAGE(pa) (((char *)(pa)) == zero_page)
+
+// first va of the next level-2 table, used to skip unmapped holes
+#define NEXT_TABLE_BOUNDARY(va)                                                \
+    ((char *)ROUNDUP_WITH(PG_SIZE_LEVEL_2, (uintptr_t)(va) + 1))
+
+/*
+ * 返回va在target_level级页表中的页表项，途中遇到大页叶子时直接返回该叶子。
+ * level非空时写入返回的页表项所在的级别(0为4K，1为2MB，2为1GB)。
+ */
+static pte_t *walk_to_level(pde_t page_dir, void *va, int alloc,
+                            int target_level, int *level) {
     if ((uint64_t)va >= MAXVA)
         kpanic("Virtual address exceeded max virtual address.");
-    for (int level = 2; level > 0; level--) {
-        pte_st *pte = (pte_st *)&page_dir[PX(level, va)];
+    for (int l = 2; l > target_level; l--) {
+        pte_st *pte = (pte_st *)&page_dir[PX(l, va)];
+        if (pte->fields.V && pte->fields.Type != 0) {
+            // superpage leaf
+            if (level)
+                *level = l;
+            return (pte_t *)pte;
+        }
         if (pte->fields.V) {
             page_dir =
                 (pde_t)(((uint64_t)pte->fields.PhyPageNumber) << PG_SHIFT);
         } else {
-            if (!alloc ||
-                (page_dir = (pde_t)page_alloc(1, PAGE_TYPE_PGTBL)) == NULL)
+            if (!alloc || (page_dir = (pde_t)page_alloc(
+                               1, PAGE_TYPE_PGTBL | PAGE_ALLOC_ZERO)) == NULL)
                 return NULL;
-            memset(page_dir, 0, PG_SIZE);
             pte->fields.PhyPageNumber = (uint64_t)page_dir >> PG_SHIFT;
             pte->fields.V             = 1;
         }
     }
-    return &page_dir[PX(0, va)];
+    if (level)
+        *level = target_level;
+    return &page_dir[PX(target_level, va)];
 }
 
-int map_pages(pde_t page_dir, void *va, void *pa, uint64_t size, int type,
-              bool user, bool global) {
-    void   *a, *last;
-    pte_st *pte;
-    a    = (void *)PG_ROUNDDOWN((uint64_t)va);
-    last = (void *)PG_ROUNDDOWN((uint64_t)va + size - 1);
-    // TODO: large page map
-    // TODO: record pte count in somewhere to free pde after unmap
-    for (;;) {
-        if ((pte = (pte_st *)walk_pages(page_dir, a, 1)) == NULL)
-            return -1;
-        if (pte->fields.V) {
-            kprintf("[MEM] Paging remap for VA 0x%lx => PA 0x%lx. pte addr: "
-                    "0x%lx.\n",
-                    a, pa, pte);
-            return -2;
+// Return the leaf pte of va, which may be a superpage leaf.
+pte_t *walk_pages(pde_t page_dir, void *va, int alloc) {
+    return walk_to_level(page_dir, va, alloc, 0, NULL);
+}
+
+// 将2MB大页拆分为一张包含512个4K页的三级页表，权限保持不变
+static int split_megapage(pte_st *pte) {
+    pde_t table = (pde_t)page_alloc(1, PAGE_TYPE_PGTBL);
+    if (!table)
+        return -1;
+    uint64_t ppn = pte->fields.PhyPageNumber;
+    for (int i = 0; i < MEGAPAGE_PAGES; i++) {
+        pte_st *p               = (pte_st *)&table[i];
+        p->raw                  = pte->raw;
+        p->fields.PhyPageNumber = ppn + i;
+    }
+    pte_st dir               = {.raw = 0};
+    dir.fields.PhyPageNumber = (uint64_t)table >> PG_SHIFT;
+    dir.fields.V             = 1;
+    pte->raw                 = dir.raw;
+    return 0;
+}
+
+#define PTE_PA(pte)                                                            \
+    ((char *)((uintptr_t)((pte)->fields.PhyPageNumber) << PG_SHIFT))
+#define PTE_TABLE(pte) ((pde_t)PTE_PA(pte))
+
+/*
+ * 按页表页遍历[start, end)：每张三级页表只从根页表向下走一次，对其中落在范围
+ * 内的一段连续页表项调用一次fn，而不是每个4K页都从根页表重新查找。
+ * fn(ptes, va, n, level, arg)：
+ *   level为0时，ptes是三级页表中从va开始的连续n项；
+ *   level为1时，ptes是覆盖va的2MB大页叶子，n是范围内的4K页数，
+ *   n小于MEGAPAGE_PAGES时范围只覆盖了大页的一部分。
+ * flags:
+ *   WALK_ALLOC    分配缺少的页表，否则跳过没有页表的空洞
+ *   WALK_MEGAPAGE 和WALK_ALLOC同用。整个2MB都在范围内且二级页表项为空时，
+ *                 先用这个空项调用fn，fn可以直接在此放置大页
+ *   WALK_PRUNE    fn处理完后回收变空的三级、二级页表，只能用于用户地址空间。
+ *                 页表在batch刷新后才释放，batch为NULL时立即释放
+ * fn返回负数时中止遍历并返回该值；返回WALK_AGAIN时重新处理当前的二级页表项，
+ * 用于fn拆分大页之后。
+ */
+#define WALK_ALLOC    0x1
+#define WALK_MEGAPAGE 0x2
+#define WALK_PRUNE    0x4
+#define WALK_AGAIN    1
+
+typedef int (*pte_range_fn)(pte_st *ptes, char *va, size_t n, int level,
+                            void *arg);
+
+static pde_t table_alloc(pte_st *pte) {
+    pde_t table = (pde_t)page_alloc(1, PAGE_TYPE_PGTBL | PAGE_ALLOC_ZERO);
+    if (!table)
+        return NULL;
+    pte->raw                  = 0;
+    pte->fields.PhyPageNumber = (uint64_t)table >> PG_SHIFT;
+    pte->fields.V             = 1;
+    return table;
+}
+
+static bool table_empty(pde_t table) {
+    for (int i = 0; i < PG_SIZE / sizeof(pte_t); i++)
+        if (table[i])
+            return false;
+    return true;
+}
+
+static int walk_range(pde_t page_dir, char *start, char *end, int flags,
+                      tlb_batch_t *batch, pte_range_fn fn, void *arg) {
+    if ((uint64_t)end > MAXVA)
+        kpanic("Virtual address exceeded max virtual address.");
+    // kernel page tables are shared by all page dirs, never free them
+    if ((flags & WALK_PRUNE) &&
+        (uint64_t)end > KERNEL_PDE_START * (uint64_t)PG_SIZE_LEVEL_1)
+        kpanic("walk_range: prune kernel page tables.");
+    char *a = start;
+    while (a < end) {
+        pte_st *l2     = (pte_st *)&page_dir[PX(2, a)];
+        char   *l2_end = (char *)ROUNDUP_WITH(PG_SIZE_LEVEL_1, a + 1);
+        pde_t   table1;
+        if (l2_end > end)
+            l2_end = end;
+        if (!l2->fields.V) {
+            if (!(flags & WALK_ALLOC)) {
+                a = l2_end;
+                continue;
+            }
+            if ((table1 = table_alloc(l2)) == NULL)
+                return -1;
+        } else if (l2->fields.Type != 0) {
+            kpanic("walk_range: walk into a gigapage.");
+        } else {
+            table1 = PTE_TABLE(l2);
         }
-        pte->fields.PhyPageNumber = (uint64_t)pa >> PG_SHIFT;
-        pte->fields.Type          = type;
-        pte->fields.V             = 1;
-        pte->fields.U             = user;
-        pte->fields.G             = global;
-        // *pte = PA2PTE(pa) | perm | PTE_V;
-        // increase_page_ref(&memory_info, pa);
+        while (a < l2_end) {
+            pte_st *l1     = (pte_st *)&table1[PX(1, a)];
+            char   *l1_end = NEXT_TABLE_BOUNDARY(a);
+            if (l1_end > l2_end)
+                l1_end = l2_end;
+            size_t n = (l1_end - a) / PG_SIZE;
+            int    r;
+            if (!l1->fields.V) {
+                if (!(flags & WALK_ALLOC)) {
+                    a = l1_end;
+                    continue;
+                }
+                if ((flags & WALK_MEGAPAGE) && n == MEGAPAGE_PAGES) {
+                    if ((r = fn(l1, a, n, 1, arg)) < 0)
+                        return r;
+                    if (l1->fields.V) {
+                        a = l1_end;
+                        continue;
+                    }
+                }
+                if (!table_alloc(l1))
+                    return -1;
+            }
+            if (l1->fields.Type != 0)
+                r = fn(l1, a, n, 1, arg);
+            else
+                r = fn((pte_st *)&PTE_TABLE(l1)[PX(0, a)], a, n, 0, arg);
+            if (r < 0)
+                return r;
+            if (r == WALK_AGAIN)
+                continue;
+            if ((flags & WALK_PRUNE) && l1->fields.V &&
+                l1->fields.Type == 0 && table_empty(PTE_TABLE(l1))) {
+                tlb_batch_free_table(batch, PTE_TABLE(l1));
+                l1->raw = 0;
+            }
+            a = l1_end;
+        }
+        if ((flags & WALK_PRUNE) && table_empty(table1)) {
+            tlb_batch_free_table(batch, table1);
+            l2->raw = 0;
+        }
+    }
+    return 0;
+}
+
+struct map_range_arg {
+    char *pa;
+    int   type;
+    bool  user;
+    bool  global;
+};
+
+static void set_leaf(pte_st *pte, struct map_range_arg *m) {
+    pte_st leaf               = {.raw = 0};
+    leaf.fields.PhyPageNumber = (uint64_t)m->pa >> PG_SHIFT;
+    leaf.fields.Type          = m->type;
+    leaf.fields.V             = 1;
+    leaf.fields.U             = m->user;
+    leaf.fields.G             = m->global;
+    pte->raw                  = leaf.raw;
+}
+
+static int map_range_fn(pte_st *ptes, char *va, size_t n, int level,
+                        void *arg) {
+    struct map_range_arg *m = (struct map_range_arg *)arg;
+    if (level == 1) {
+        if (ptes->fields.V)
+            goto remap;
+        // whole 2MB in range, use megapage if pa is aligned too
+        if (IS_MEGAPAGE_ALIGNED(m->pa)) {
+            set_leaf(ptes, m);
+            m->pa += PG_SIZE_LEVEL_2;
+        }
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++, va += PG_SIZE, m->pa += PG_SIZE) {
+        if (ptes[i].fields.V) {
+            ptes += i;
+            goto remap;
+        }
+        set_leaf(&ptes[i], m);
 #if PAGING_DEBUG
-        if (a <= 0x80000000)
-            kprintf("[MEM] Map 0x%lx => 0x%lx on PDE 0x%lx.\n", a, pa, pte);
+        if (va <= (char *)0x80000000)
+            kprintf("[MEM] Map 0x%lx => 0x%lx on PDE 0x%lx.\n", va, m->pa,
+                    &ptes[i]);
 #endif
-        if (a == last)
-            break;
-        a += PG_SIZE;
-        pa += PG_SIZE;
     }
     return 0;
+remap:
+    kprintf("[MEM] Paging remap for VA 0x%lx => PA 0x%lx. pte addr: 0x%lx.\n",
+            va, m->pa, ptes);
+    return -2;
 }
 
-// Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
-void unmap_pages(pde_t page_dir, void *va, size_t size, int do_free) {
-    void   *a;
-    pte_st *pte;
+int map_pages(pde_t page_dir, void *va, void *pa, uint64_t size, int type,
+              bool user, bool global) {
+    char *start = (char *)PG_ROUNDDOWN((uint64_t)va);
+    char *end   = (char *)PG_ROUNDDOWN((uint64_t)va + size - 1) + PG_SIZE;
+    struct map_range_arg m = {
+        .pa = pa, .type = type, .user = user, .global = global};
+    return walk_range(page_dir, start, end, WALK_ALLOC | WALK_MEGAPAGE, NULL,
+                      map_range_fn, &m);
+}
 
-    if (((uint64_t)va % PG_SIZE) != 0)
-        kpanic("vmunmap: not aligned");
+struct unmap_range_arg {
+    int          do_free;
+    tlb_batch_t *batch;
+};
 
-    for (a = va; a < va + size * PG_SIZE; a += PG_SIZE) {
-        if ((pte = (pte_st *)walk_pages(page_dir, a, 0)) == 0)
-            kpanic("vmunmap: walk");
+static int unmap_range_fn(pte_st *ptes, char *va, size_t n, int level,
+                          void *arg) {
+    struct unmap_range_arg *u       = (struct unmap_range_arg *)arg;
+    int                     do_free = u->do_free;
+    char                   *pa;
+    if (level == 1) {
+        if (n < MEGAPAGE_PAGES) {
+            // partially unmap, split it and walk again
+            if (split_megapage(ptes) != 0)
+                kpanic("vmunmap: cannot split megapage");
+            return WALK_AGAIN;
+        }
+        pa             = PTE_PA(ptes);
+        bool all_freed = true;
+        for (int i = 0; i < MEGAPAGE_PAGES; i++)
+            if (decrease_page_ref(&memory_info, pa + i * PG_SIZE) != 0)
+                all_freed = false;
+        if (do_free && all_freed) {
+            tlb_batch_free(u->batch, pa, MEGAPAGE_PAGES);
+        } else if (do_free) {
+            for (int i = 0; i < MEGAPAGE_PAGES; i++)
+                if (get_page_reference(&memory_info, pa + i * PG_SIZE) == 0)
+                    tlb_batch_free(u->batch, pa + i * PG_SIZE, 1);
+        }
+        ptes->raw = 0;
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        pte_st *pte = &ptes[i];
         if (pte->fields.V == 0)
-            kpanic("vmunmap: not mapped");
+            continue;
         if (pte->fields.Type == 0)
             kpanic("vmunmap: not a leaf");
-        char *pa = (char *)((uint64_t)pte->fields.PhyPageNumber << PG_SHIFT);
+        pa = PTE_PA(pte);
 #if PAGING_DEBUG
-        if (a <= 0x80000000)
-            kprintf("[MEM] Unmap 0x%lx => 0x%lx on PDE 0x%lx.\n", a, pa, pte);
+        if (va + i * PG_SIZE <= (char *)0x80000000)
+            kprintf("[MEM] Unmap 0x%lx => 0x%lx on PDE 0x%lx.\n",
+                    va + i * PG_SIZE, pa, pte);
 #endif
-        int ref = decrease_page_ref(&memory_info, pa);
-        if (do_free && ref == 0) {
-            page_free(pa, 1);
-        }
+        if (!IS_ZERO_PAGE(pa) && decrease_page_ref(&memory_info, pa) == 0 &&
+            do_free)
+            tlb_batch_free(u->batch, pa, 1);
         pte->raw = 0;
     }
+    return 0;
+}
+
+static void unmap_range(pde_t page_dir, char *start, size_t size,
+                        struct unmap_range_arg *u) {
+    if (((uint64_t)start % PG_SIZE) != 0)
+        kpanic("vmunmap: not aligned");
+    char *end   = start + size * PG_SIZE;
+    int   flags = 0;
+    if ((uint64_t)end <= KERNEL_PDE_START * (uint64_t)PG_SIZE_LEVEL_1)
+        flags |= WALK_PRUNE;
+    walk_range(page_dir, start, end, flags, u->batch, unmap_range_fn, u);
+}
+
+// Remove npages of mappings starting from va. va must be
+// page-aligned. Holes are skipped since heap is mapped on demand.
+// Optionally free the physical memory. Page tables of user space left empty
+// are freed too. Only for mappings no other hart can be using.
+void unmap_pages(pde_t page_dir, void *va, size_t size, int do_free) {
+    struct unmap_range_arg u = {.do_free = do_free, .batch = NULL};
+    unmap_range(page_dir, (char *)va, size, &u);
+}
+
+// Like unmap_pages with do_free, but the range is added to batch and the
+// pages are freed only after batch is flushed.
+void unmap_pages_batch(pde_t page_dir, void *va, size_t size,
+                       tlb_batch_t *batch) {
+    struct unmap_range_arg u = {.do_free = true, .batch = batch};
+    // before any page is freed, an early flush must cover the range
+    tlb_batch_add(batch, va, size * PG_SIZE);
+    unmap_range(page_dir, (char *)va, size, &u);
 }
 
 void init_paging(void *init_start, void *init_end) {
@@ -142,11 +394,41 @@ void init_paging(void *init_start, void *init_end) {
     p->fields.G             = 1;
     p->fields.U             = 0;
 #endif
+    // kernel stacks area, the table is shared by all page dirs
+    if (!walk_to_level(os_env.kernel_pagedir, (void *)KSTACK_VBASE, 1, 1,
+                       NULL))
+        kpanic("Cannot alloc page table for kernel stacks.");
     uint64_t satp = ((uint64_t)os_env.kernel_pagedir / PG_SIZE) |
                     ((uint64_t)PAGING_MODE_SV39 << 60);
     os_env.kernel_satp = satp;
     CSR_Write(satp, satp);
     flush_tlb_all();
+
+    init_asid();
+
+    zero_page = page_alloc(1, PAGE_TYPE_INUSE | PAGE_TYPE_SYSTEM);
+    if (!zero_page)
+        kpanic("Cannot alloc zero page.");
+    memset(zero_page, 0, PG_SIZE);
+}
+
+/*
+ * 页目录缓存：用户地址空间只占页目录的前KERNEL_PDE_START项，其余项(直接映射、
+ * sysmap、内核栈)都指向内核页目录的页表，所有进程共享。新页目录从内核页目录
+ * 复制这些项，释放时只回收用户部分的页表，用户项清零后放回缓存，
+ * 下次分配直接使用。sysmap和内核栈都映射在共享的页表中，不需要逐个重放。
+ */
+#define PGDIR_CACHE_SIZE 16
+
+static spinlock_t pgdir_lock = {.lock = false, .cpu = 0};
+static pde_t      pgdir_cache[PGDIR_CACHE_SIZE];
+static size_t     pgdir_cached;
+
+static void pgdir_cache_drain() {
+    spinlock_acquire(&pgdir_lock);
+    while (pgdir_cached)
+        page_free((char *)pgdir_cache[--pgdir_cached], 1);
+    spinlock_release(&pgdir_lock);
 }
 
 // TODO: Currently sysmap only used in init. No lock here.
@@ -163,6 +445,8 @@ int mem_sysmap(void *va, void *pa, size_t size, int type) {
         return -1;
     }
     list_add(&sysmap->list, &os_env.mem_sysmaps);
+    // cached page dirs may miss a new top level entry
+    pgdir_cache_drain();
     return 0;
 }
 
@@ -172,23 +456,20 @@ int mem_sysunmap(void *va) {
 }
 
 pde_t alloc_page_dir() {
-    pde_t pgdir = (pde_t)page_alloc(1, PAGE_TYPE_PGTBL);
+    pde_t pgdir = NULL;
+    spinlock_acquire(&pgdir_lock);
+    if (pgdir_cached)
+        pgdir = pgdir_cache[--pgdir_cached];
+    spinlock_release(&pgdir_lock);
+    if (pgdir)
+        return pgdir;
+    pgdir = (pde_t)page_alloc(1, PAGE_TYPE_PGTBL);
     if (!pgdir)
         return NULL;
-    memset(pgdir, 0, PG_SIZE);
-    // Setup big kernel pte from 0x80000000 ~ 0xC0000000
-    pte_st *p               = (pte_st *)&pgdir[2];
-    p->fields.V             = 1;
-    p->fields.PhyPageNumber = 0x80000000 >> PG_SHIFT;
-    p->fields.Type          = PTE_TYPE_RWX;
-    p->fields.G             = 1;
-    p->fields.U             = 0;
-    // Setup sysmap
-    list_foreach_entry(&os_env.mem_sysmaps, struct mem_sysmap, list, sysmap) {
-        // TODO: check result.
-        map_pages(pgdir, sysmap->va, sysmap->pa, sysmap->size, sysmap->type,
-                  false, true);
-    }
+    memset(pgdir, 0, KERNEL_PDE_START * sizeof(pte_t));
+    // Share kernel part: direct map, sysmaps and kernel stacks
+    memcpy(&pgdir[KERNEL_PDE_START], &os_env.kernel_pagedir[KERNEL_PDE_START],
+           PG_SIZE - KERNEL_PDE_START * sizeof(pte_t));
     return pgdir;
 }
 
@@ -211,70 +492,312 @@ static void do_pde_free(pde_t pde, int level) {
 }
 
 void dealloc_page_dir(pde_t page_dir) {
-    do_pde_free(page_dir, 0);
+    // free user page tables only, kernel ones are shared
+    for (int i = 0; i < KERNEL_PDE_START; i++) {
+        pte_st *p = (pte_st *)&page_dir[i];
+        if ((p->raw & 0xF) == 1)
+            do_pde_free(
+                (pde_t)((uintptr_t)(p->fields.PhyPageNumber << PG_SHIFT)), 1);
+        p->raw = 0;
+    }
+    spinlock_acquire(&pgdir_lock);
+    if (pgdir_cached < PGDIR_CACHE_SIZE) {
+        pgdir_cache[pgdir_cached++] = page_dir;
+        page_dir                    = NULL;
+    }
+    spinlock_release(&pgdir_lock);
+    if (page_dir)
+        page_free((char *)page_dir, 1);
 }
 
-int vm_copy(pde_t dst, pde_t src, char *start, char *end) {
+struct copy_range_arg {
+    pde_t dst;
+    bool  cow;
+};
+
+static void copy_leaf(pte_st *cpte, pte_st *pte, bool cow) {
+    if (cpte->fields.V)
+        kpanic("Child pte remap while copy.");
+    cpte->fields.PhyPageNumber = pte->fields.PhyPageNumber;
+    cpte->fields.V             = 1;
+    cpte->fields.U             = pte->fields.U;
+    cpte->fields.G             = pte->fields.G;
+    assert(cpte->fields.U == 1, "Must be user area for vm_copy");
+    // set read-only for CoW
+    uint8_t type = pte->fields.Type;
+    if (cow && (type & PTE_TYPE_BIT_W)) {
+        type &= ~PTE_TYPE_BIT_W; // clear write flag
+        pte->fields.Reserved1 |= PTE_RSW_COW;
+    }
+    cpte->fields.Reserved1 = pte->fields.Reserved1;
+    cpte->fields.Type = pte->fields.Type = type;
+}
+
+static int copy_range_fn(pte_st *ptes, char *va, size_t n, int level,
+                         void *arg) {
+    struct copy_range_arg *c     = (struct copy_range_arg *)arg;
+    pte_st                *cptes = NULL;
+    int                    clevel;
+    if (level == 1) {
+        if (n < MEGAPAGE_PAGES) {
+            // only part of the megapage is copied
+            if (split_megapage(ptes) != 0)
+                kpanic("vm_copy: cannot split megapage");
+            return WALK_AGAIN;
+        }
+        if ((cptes = (pte_st *)walk_to_level(c->dst, va, 1, 1, NULL)) ==
+            NULL)
+            kpanic("Cannot walk child pte.");
+        char *pa = PTE_PA(ptes);
+        for (int i = 0; i < MEGAPAGE_PAGES; i++)
+            increase_page_ref(&memory_info, pa + i * PG_SIZE);
+        copy_leaf(cptes, ptes, c->cow);
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        pte_st *pte = &ptes[i];
+        if (pte->fields.V == 0)
+            continue; // not touched yet
+        if (pte->fields.Type == 0)
+            kpanic("vm_copy: not a leaf");
+        // child table is walked once for the whole run
+        if (!cptes) {
+            cptes = (pte_st *)walk_to_level(c->dst, va, 1, 0, &clevel);
+            if (!cptes)
+                kpanic("Cannot walk child pte.");
+            if (clevel != 0)
+                kpanic("Child pte remap while copy.");
+        }
+        if (!IS_ZERO_PAGE(PTE_PA(pte)))
+            increase_page_ref(&memory_info, PTE_PA(pte));
+        copy_leaf(&cptes[i], pte, c->cow);
+    }
+    return 0;
+}
+
+// Map pages of src in [start, end) into dst, set both read-only if cow.
+static int vm_copy_range(pde_t dst, pde_t src, char *start, char *end,
+                         bool cow) {
     // debug
 #if PAGING_DEBUG
     proc_t *proc = myproc();
     kprintf("do vm copy at va 0x%lx ~ 0x%lx for [%d]%s.\n", start, end,
             proc->pid, proc->name);
 #endif
+    struct copy_range_arg c = {.dst = dst, .cow = cow};
+    return walk_range(src, (char *)PG_ROUNDDOWN(start),
+                      (char *)PG_ROUNDUP(end), 0, NULL, copy_range_fn, &c);
+}
 
-    char   *a;
-    char   *va     = (char *)PG_ROUNDDOWN(start);
-    char   *va_end = (char *)PG_ROUNDUP(end);
-    pte_st *pte;
+int vm_copy(pde_t dst, pde_t src, char *start, char *end) {
+    return vm_copy_range(dst, src, start, end, true);
+}
 
-    for (a = va; a < va_end; a += PG_SIZE) {
-        if ((pte = (pte_st *)walk_pages(src, a, 0)) == 0)
-            kpanic("vm_copy cannot walk pages");
-        if (pte->fields.V == 0)
-            kpanic("vm_copy: source not mapped");
-        if (pte->fields.Type == 0)
-            kpanic("vm_copy: not a leaf");
-        // do copy map
+// Like vm_copy but pages stay writable and shared by both, for MAP_SHARED.
+int vm_share(pde_t dst, pde_t src, char *start, char *end) {
+    return vm_copy_range(dst, src, start, end, false);
+}
+
+// Return the physical address of va if it is mapped, otherwise NULL.
+char *vm_lookup(pde_t page_dir, void *va) {
+    int     level = 0;
+    pte_st *pte   = (pte_st *)walk_to_level(page_dir, va, 0, 0, &level);
+    if (!pte || !pte->fields.V || pte->fields.Type == 0)
+        return NULL;
+    char *pa = (char *)((uintptr_t)(pte->fields.PhyPageNumber << PG_SHIFT));
+    if (level == 1)
+        pa += (uintptr_t)va & (PG_SIZE_LEVEL_2 - 1);
+    else
+        pa += (uintptr_t)va & (PG_SIZE - 1);
+    return pa;
+}
+
+// PTE type of a vma, write-only is not supported by the hardware
+static inline int vma_pte_type(vma_t *vma) {
+    int type = vma->prot & (PROT_READ | PROT_WRITE | PROT_EXEC);
+    if (type & PTE_TYPE_BIT_W)
+        type |= PTE_TYPE_BIT_R;
+    return type;
+}
+
+static inline bool vma_access_ok(vma_t *vma, bool write) {
+    if (write)
+        return vma->prot & PROT_WRITE;
+    return vma->prot & (PROT_READ | PROT_EXEC);
+}
+
+/*
+ * mmap区域内未映射页的缺页：私有匿名映射与堆相同，读缺页映射零页；
+ * 共享匿名映射必须分配实际的页，否则fork后无法共享写入；文件映射从文件读入。
+ */
+static int do_vma_fault(vma_t *vma, pde_t pde, char *caused_va, bool write) {
+    char *va = (char *)PG_ROUNDDOWN(caused_va);
+    if (!vma->file && !(vma->flags & MAP_SHARED) && !write)
+        return map_pages(pde, va, zero_page, PG_SIZE, PTE_TYPE_RO, true,
+                         false);
+    char *pa =
+        page_alloc(1, PAGE_TYPE_INUSE | PAGE_TYPE_USER | PAGE_ALLOC_ZERO);
+    if (!pa)
+        return -2;
+    if (vma->file && vma_fill_page(vma, va, pa) != 0) {
+        page_free(pa, 1);
+        return -2;
+    }
+    if (map_pages(pde, va, pa, PG_SIZE, vma_pte_type(vma), true, false) !=
+        0) {
+        page_free(pa, 1);
+        return -2;
+    }
+    return 0;
+}
+
+/*
+ * 为共享映射中尚未访问的页分配物理页。fork前调用，
+ * 否则父子进程之后各自缺页，得到的是不同的页。
+ */
+int vma_populate(vma_t *vma, pde_t pde) {
+    for (char *a = vma->start; a < vma->end; a += PG_SIZE) {
+        if (vm_lookup(pde, a))
+            continue;
+        int r = do_vma_fault(vma, pde, a, true);
+        if (r != 0)
+            return r;
+    }
+    return 0;
+}
+
+/*
+ * 堆上只有整个2MB都在堆内且还没有任何映射时，写缺页直接分配一个2MB对齐的块，
+ * 用大页映射。申请不到对齐的块时退回4K页。
+ */
+static int map_heap_megapage(proc_t *proc, pde_t pde, char *va) {
+    char *start = (char *)ROUNDDOWN_WITH(PG_SIZE_LEVEL_2, va);
+    if (start < proc->mm->heap_start ||
+        start + PG_SIZE_LEVEL_2 > (char *)PG_ROUNDUP(proc->mm->prog_break))
+        return -1;
+    pte_st *l1 = (pte_st *)walk_to_level(pde, start, 0, 1, NULL);
+    if (l1 && l1->fields.V)
+        return -1;
+    char *pa = page_alloc(MEGAPAGE_PAGES,
+                          PAGE_TYPE_INUSE | PAGE_TYPE_USER | PAGE_ALLOC_ZERO);
+    if (!pa)
+        return -1;
+    if (!IS_MEGAPAGE_ALIGNED(pa) ||
+        map_pages(pde, start, pa, PG_SIZE_LEVEL_2, PTE_TYPE_RW, true, false) !=
+            0) {
+        page_free(pa, MEGAPAGE_PAGES);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 堆上未映射页的缺页：读缺页映射共享的零页，写缺页分配新的零页。
+ * brk只保留[heap_start, prog_break)的范围，物理内存在首次访问时才分配。
+ */
+static int do_anonymous_fault(proc_t *proc, pde_t pde, char *caused_va,
+                              bool write) {
+    char *va = (char *)PG_ROUNDDOWN(caused_va);
+    if (!(va >= proc->mm->heap_start &&
+          va < (char *)PG_ROUNDUP(proc->mm->prog_break)))
+        return -1;
+    if (!write)
+        return map_pages(pde, va, zero_page, PG_SIZE, PTE_TYPE_RO, true,
+                         false);
+    if (map_heap_megapage(proc, pde, va) == 0)
+        return 0;
+    char *pa =
+        page_alloc(1, PAGE_TYPE_INUSE | PAGE_TYPE_USER | PAGE_ALLOC_ZERO);
+    if (!pa)
+        return -2;
+    if (map_pages(pde, va, pa, PG_SIZE, PTE_TYPE_RW, true, false) != 0) {
+        page_free(pa, 1);
+        return -2;
+    }
+    return 0;
+}
+
+// Copy a page by 64-bit words, both must be page aligned.
+static inline void copy_page(char *dst, const char *src) {
+    uint64_t       *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+    for (size_t i = 0; i < PG_SIZE / sizeof(uint64_t); i += 4) {
+        d[i]     = s[i];
+        d[i + 1] = s[i + 1];
+        d[i + 2] = s[i + 2];
+        d[i + 3] = s[i + 3];
+    }
+}
+
+/*
+ * CoW fault-around: fork之后父子进程往往连续写一片页面(栈、堆)，一方写过
+ * 复制之后，另一方对应的页引用计数降为1。处理一次CoW缺页时，顺带把同一窗口
+ * 内引用计数为1的CoW页直接改为可写，省去之后的缺页。窗口不会跨越三级页表。
+ */
+#define FAULT_AROUND_PAGES 16
+
+static void cow_fault_around(proc_t *proc, pde_t pde, char *caused_va,
+                             tlb_batch_t *batch) {
+    char   *start = (char *)ROUNDDOWN_WITH(FAULT_AROUND_PAGES * PG_SIZE,
+                                           caused_va);
+    int     level = 0;
+    pte_st *ptes  = (pte_st *)walk_to_level(pde, start, 0, 0, &level);
+    if (!ptes || level != 0)
+        return;
+    for (int i = 0; i < FAULT_AROUND_PAGES; i++) {
+        pte_st *pte = &ptes[i];
+        if (!pte->fields.V || pte->fields.Type == 0 ||
+            (pte->fields.Type & PTE_TYPE_BIT_W) ||
+            !(pte->fields.Reserved1 & PTE_RSW_COW))
+            continue;
         char *pa = (char *)((uintptr_t)(pte->fields.PhyPageNumber << PG_SHIFT));
-        pte_st *cpte;
-        if ((cpte = (pte_st *)walk_pages(dst, a, 1)) == NULL)
-            kpanic("Cannot walk child pte.");
-        if (cpte->fields.V) {
-            kpanic("Child pte remap while copy.");
-        }
-        cpte->fields.PhyPageNumber = pte->fields.PhyPageNumber;
-        cpte->fields.V             = 1;
-        cpte->fields.U             = pte->fields.U;
-        cpte->fields.G             = pte->fields.G;
-        assert(cpte->fields.U == 1, "Must be user area for vm_copy");
-        increase_page_ref(&memory_info, pa);
-        // set read-only for CoW
-        uint8_t type = pte->fields.Type;
-        type &= ~PTE_TYPE_BIT_W; // clear write flag
-        cpte->fields.Type = pte->fields.Type = type;
+        if (get_page_reference(&memory_info, pa) != 1)
+            continue;
+        pte->fields.Reserved1 &= ~PTE_RSW_COW;
+        pte->fields.Type |= PTE_TYPE_BIT_W;
+        tlb_batch_add(batch, start + i * PG_SIZE, PG_SIZE);
+        proc->cow_upgrades++;
     }
 }
 
-int do_pagefault(char *caused_va, pde_t pde, bool from_kernel) {
-    proc_t *proc = myproc();
-    if (!proc)
-        return -5; // no proc here.
-    assert(proc->page_dir == pde,
-           "PDE not identical to currently holding process.");
+// proc->mm->lock must be held.
+static int handle_pagefault(proc_t *proc, char *caused_va, pde_t pde,
+                            bool from_kernel, bool write) {
     if ((uintptr_t)caused_va >= 0x80000000) {
         kprintf("not use page fault.");
         return -3;
     }
     // kprintf("DO PF for 0x%lx, pde: 0x%lx.\n", caused_va, pde);
-    pte_st *pte = (pte_st *)walk_pages(pde, caused_va, 0);
-    char   *pa  = (char *)((uintptr_t)(pte->fields.PhyPageNumber << PG_SHIFT));
+    int     level = 0;
+    pte_st *pte   = (pte_st *)walk_to_level(pde, caused_va, 0, 0, &level);
+    vma_t  *vma   = vma_find(proc, caused_va);
+    if (vma && !vma_access_ok(vma, write))
+        return -1;
+    if (!pte || !pte->fields.V) {
+        if (from_kernel && !IS_UMEM_ACCESS()) {
+            BEGIN_UMEM_ACCESS();
+            return 0;
+        }
+        int r = vma ? do_vma_fault(vma, pde, caused_va, write)
+                    : do_anonymous_fault(proc, pde, caused_va, write);
+        if (r == 0) {
+            flush_tlb_page(caused_va, proc_asid(proc));
+            proc->page_faults++;
+        }
+        return r;
+    }
+    if (level == 1) {
+        // CoW works on 4K pages, split the megapage first
+        if (split_megapage(pte) != 0)
+            return -2;
+        pte = (pte_st *)walk_pages(pde, caused_va, 0);
+    }
+    char *pa = (char *)((uintptr_t)(pte->fields.PhyPageNumber << PG_SHIFT));
     if (!(pa >= memory_info.usable_memory_start &&
           pa < memory_info.usable_memory_end)) {
         kprintf("not use page fault.");
         return -3;
     }
-    if (!pte)
-        return -1;
     // kprintf("PF pa: 0x%lx, reference count: %d.\n", pa,
     //        get_page_reference(&memory_info, pa));
 
@@ -285,25 +808,88 @@ int do_pagefault(char *caused_va, pde_t pde, bool from_kernel) {
     }
 
     uint8_t type = pte->fields.Type;
-    if (type & PTE_TYPE_BIT_W) {
+    if (proc->mm->users > 1 && pte->fields.U &&
+        (type & (write ? PTE_TYPE_BIT_W : PTE_TYPE_BIT_R))) {
+        // another thread has handled it before we got the lock, our TLB may
+        // still hold the old entry
+        flush_tlb_page(caused_va, proc_asid(proc));
+        return 0;
+    }
+    if ((type & PTE_TYPE_BIT_W) || !write) {
         kprintf("PF invailed.\n");
         return -4;
     }
-    if (get_page_reference(&memory_info, pa) == 1) {
-        // just change type
-        type |= PTE_TYPE_BIT_W;
-        pte->fields.Type = type;
-    } else {
-        // do copy
-        char *new_pa = page_alloc(1, PAGE_TYPE_INUSE | PAGE_TYPE_USER);
+    // the old pte may be cached by other harts running this process
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, proc);
+    tlb_batch_add(&batch, caused_va, PG_SIZE);
+    if (IS_ZERO_PAGE(pa)) {
+        // first write to a zero page backed heap page
+        char *new_pa =
+            page_alloc(1, PAGE_TYPE_INUSE | PAGE_TYPE_USER | PAGE_ALLOC_ZERO);
         if (!new_pa)
             return -2;
-        memcpy(new_pa, pa, PG_SIZE);
         pte->fields.PhyPageNumber = ((uintptr_t)new_pa >> PG_SHIFT);
-        decrease_page_ref(&memory_info, pa);
+        pte->fields.Type          = vma ? vma_pte_type(vma) : PTE_TYPE_RW;
+    } else if (!(pte->fields.Reserved1 & PTE_RSW_COW)) {
+        kprintf("PF write to read-only page.\n");
+        return -4;
+    } else {
+        proc->cow_faults++;
+        if (get_page_reference(&memory_info, pa) == 1) {
+            // the other side has copied or gone, just change type
+            proc->cow_upgrades++;
+        } else {
+            // do copy
+            char *new_pa = page_alloc(1, PAGE_TYPE_INUSE | PAGE_TYPE_USER);
+            if (!new_pa)
+                return -2;
+            copy_page(new_pa, pa);
+            pte->fields.PhyPageNumber = ((uintptr_t)new_pa >> PG_SHIFT);
+            decrease_page_ref(&memory_info, pa);
+            proc->cow_copies++;
+        }
         type |= PTE_TYPE_BIT_W;
         pte->fields.Type = type;
+        pte->fields.Reserved1 &= ~PTE_RSW_COW;
+        cow_fault_around(proc, pde, caused_va, &batch);
     }
-    flush_tlb_all();
+    tlb_batch_flush(&batch);
+    proc->page_faults++;
+    return 0;
+}
+
+int do_pagefault(char *caused_va, pde_t pde, bool from_kernel, bool write) {
+    proc_t *proc = myproc();
+    if (!proc)
+        return -5; // no proc here.
+    assert(proc->mm->page_dir == pde,
+           "PDE not identical to currently holding process.");
+    // threads sharing the mm may fault on the same page at the same time
+    sleeplock_acquire(&proc->mm->lock);
+    int r = handle_pagefault(proc, caused_va, pde, from_kernel, write);
+    sleeplock_release(&proc->mm->lock);
+    return r;
+}
+
+static int count_range_fn(pte_st *ptes, char *va, size_t n, int level,
+                          void *arg) {
+    size_t *count = (size_t *)arg;
+    if (level == 1) {
+        *count += n;
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++)
+        if (ptes[i].fields.V && ptes[i].fields.Type != 0 &&
+            !IS_ZERO_PAGE(PTE_PA(&ptes[i])))
+            (*count)++;
     return 0;
-}
\ No newline at end of file
+}
+
+// Count resident pages in [start, end), the zero page is not counted.
+size_t vm_resident_pages(pde_t page_dir, char *start, char *end) {
+    size_t count = 0;
+    walk_range(page_dir, (char *)PG_ROUNDDOWN(start), (char *)PG_ROUNDUP(end),
+               0, NULL, count_range_fn, &count);
+    return count;
+}
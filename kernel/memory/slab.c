@@ -0,0 +1,189 @@
+#include "./utils.h"
+#include <driver/console.h>
+#include <lib/linklist.h>
+#include <lib/stdlib.h>
+#include <lib/string.h>
+#include <lib/sys/spinlock.h>
+#include <memory.h>
+#include <riscv.h>
+#include <trap.h>
+
+/*
+ * 简易的Slab分配器：
+ * 每个slab为一页，页首放置slab头，其余空间切分为等大的对象，空闲对象通过
+ * 对象内的第一个指针链接。对象所属的slab即为其所在页的页首。
+ * 每个CPU持有一个空闲对象的弹匣(magazine)，分配和释放只在弹匣空/满时
+ * 才需要获取cache的锁，批量和slab交换对象。
+ */
+
+extern struct memory_info_t memory_info; // in memory.c
+
+#define KMEM_SLAB_COOKIE 0x51AB51AB
+
+struct kmem_slab {
+    uint32_t      cookie;
+    uint32_t      inuse;
+    kmem_cache_t *cache;
+    void         *free_objs;
+    list_head_t   list;
+};
+
+typedef struct kmem_slab kmem_slab;
+
+static const size_t slab_head_size =
+    ROUNDUP_WITH(KMEM_CACHE_ALIGN, sizeof(kmem_slab));
+
+static LIST_HEAD(kmem_caches);
+static spinlock_t kmem_caches_lock = {.lock = false, .cpu = 0};
+
+static inline kmem_slab *slab_of(void *obj) {
+    return (kmem_slab *)PG_ROUNDDOWN(obj);
+}
+
+// Return the cache which obj belongs to, NULL if obj is not a slab object.
+kmem_cache_t *kmem_cache_of(void *obj) {
+    char *p = (char *)obj;
+    if (!(p >= memory_info.usable_memory_start &&
+          p < memory_info.usable_memory_end))
+        return NULL;
+    if (!(memory_info.pages_info[GET_ID_BY_PAGE(memory_info, p)].type &
+          PAGE_TYPE_SLAB))
+        return NULL;
+    kmem_slab *slab = slab_of(obj);
+    assert(slab->cookie == KMEM_SLAB_COOKIE, "Slab page without slab head.");
+    return slab->cache;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size) {
+    kmem_cache_t *cache = (kmem_cache_t *)kmalloc(sizeof(kmem_cache_t));
+    if (!cache)
+        return NULL;
+    *cache = (kmem_cache_t)KMEM_CACHE_INIT(*cache, name, size);
+    return cache;
+}
+
+// cache->lock must be held.
+static kmem_slab *slab_grow(kmem_cache_t *cache) {
+    if (cache->objs_per_slab == 0) {
+        assert(cache->obj_size >= sizeof(void *) &&
+                   cache->obj_size <= PG_SIZE - slab_head_size,
+               "Kmem cache object size unsupported.");
+        cache->objs_per_slab = (PG_SIZE - slab_head_size) / cache->obj_size;
+        spinlock_acquire(&kmem_caches_lock);
+        list_add_tail(&cache->cache_list, &kmem_caches);
+        spinlock_release(&kmem_caches_lock);
+    }
+    char *page = page_alloc(1, PAGE_TYPE_INUSE | PAGE_TYPE_SYSTEM |
+                                   PAGE_TYPE_SLAB);
+    if (!page)
+        return NULL;
+    kmem_slab *slab = (kmem_slab *)page;
+    slab->cookie    = KMEM_SLAB_COOKIE;
+    slab->inuse     = 0;
+    slab->cache     = cache;
+    slab->free_objs = NULL;
+    // link objects from tail, so they are handed out in address order
+    char *obj = page + slab_head_size + cache->obj_size * cache->objs_per_slab;
+    for (size_t i = 0; i < cache->objs_per_slab; i++) {
+        obj -= cache->obj_size;
+        *(void **)obj   = slab->free_objs;
+        slab->free_objs = obj;
+    }
+    list_add(&slab->list, &cache->slabs_free);
+    cache->slab_count++;
+    return slab;
+}
+
+// Take an object from slabs. cache->lock must be held.
+static void *slab_get_obj(kmem_cache_t *cache) {
+    kmem_slab *slab = NULL;
+    if (cache->slabs_partial.next != &cache->slabs_partial)
+        slab = container_of(cache->slabs_partial.next, kmem_slab, list);
+    else if (cache->slabs_free.next != &cache->slabs_free)
+        slab = container_of(cache->slabs_free.next, kmem_slab, list);
+    else if ((slab = slab_grow(cache)) == NULL)
+        return NULL;
+
+    void *obj       = slab->free_objs;
+    slab->free_objs = *(void **)obj;
+    slab->inuse++;
+    list_del(&slab->list);
+    if (slab->free_objs)
+        list_add(&slab->list, &cache->slabs_partial);
+    else
+        list_add(&slab->list, &cache->slabs_full);
+    return obj;
+}
+
+// Return an object to its slab. cache->lock must be held.
+static void slab_put_obj(kmem_cache_t *cache, void *obj) {
+    kmem_slab *slab = slab_of(obj);
+    assert(slab->cookie == KMEM_SLAB_COOKIE, "Object is not inside a slab.");
+    assert(slab->cache == cache, "Object freed to wrong kmem cache.");
+    *(void **)obj   = slab->free_objs;
+    slab->free_objs = obj;
+    slab->inuse--;
+    list_del(&slab->list);
+    if (slab->inuse != 0) {
+        list_add(&slab->list, &cache->slabs_partial);
+    } else if (cache->slabs_free.next == &cache->slabs_free) {
+        // keep one empty slab to avoid grow/shrink thrash
+        list_add(&slab->list, &cache->slabs_free);
+    } else {
+        slab->cookie = 0;
+        cache->slab_count--;
+        page_free((char *)slab, 1);
+    }
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    void *obj = NULL;
+    trap_push_off(); // stay on this hart
+    struct kmem_cache_magazine *mag = &cache->magazines[cpuid()];
+    if (likely(mag->count)) {
+        obj = mag->objs[--mag->count];
+        cache->magazine_hits++;
+    } else {
+        // refill half of the magazine
+        spinlock_acquire(&cache->lock);
+        while (mag->count < KMEM_CACHE_MAGAZINE_SIZE / 2) {
+            void *o = slab_get_obj(cache);
+            if (!o)
+                break;
+            mag->objs[mag->count++] = o;
+        }
+        spinlock_release(&cache->lock);
+        if (mag->count)
+            obj = mag->objs[--mag->count];
+    }
+    if (obj)
+        cache->allocs++;
+    trap_pop_off();
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!obj)
+        return;
+    trap_push_off();
+    struct kmem_cache_magazine *mag = &cache->magazines[cpuid()];
+    if (unlikely(mag->count == KMEM_CACHE_MAGAZINE_SIZE)) {
+        // flush half of the magazine
+        spinlock_acquire(&cache->lock);
+        while (mag->count > KMEM_CACHE_MAGAZINE_SIZE / 2)
+            slab_put_obj(cache, mag->objs[--mag->count]);
+        spinlock_release(&cache->lock);
+    }
+    mag->objs[mag->count++] = obj;
+    trap_pop_off();
+}
+
+void print_kmem_cache_info() {
+    kprintf("[MEM] Kmem caches: name, object size, slabs, allocs, hits\n");
+    spinlock_acquire(&kmem_caches_lock);
+    list_foreach_entry(&kmem_caches, kmem_cache_t, cache_list, cache) {
+        kprintf("[MEM] %s, %ld, %ld, %ld, %ld\n", cache->name, cache->obj_size,
+                cache->slab_count, cache->allocs, cache->magazine_hits);
+    }
+    spinlock_release(&kmem_caches_lock);
+}
@@ -0,0 +1,262 @@
+#include <configs.h>
+#include <driver/console.h>
+#include <environment.h>
+#include <lib/stdlib.h>
+#include <lib/sys/SBI.h>
+#include <memory.h>
+#include <mm.h>
+#include <proc.h>
+#include <riscv.h>
+#include <smp_barrier.h>
+#include <trap.h>
+
+/*
+ * TLB shootdown：
+ * 修改页表后，除了当前hart，其他运行过该进程的hart的TLB中也可能留有旧表项。
+ * mm->tlb_mask记录切换到过该地址空间的hart(见asid.c)，从没运行过它的hart直接
+ * 跳过。要刷新的地址范围先收集在tlb_batch_t中，本地逐页刷新，远端把所有范围
+ * 合并成一个覆盖它们的请求，通过SBI RFENCE扩展一次发给所有目标hart。
+ * SBI在M态用IPI通知目标hart并等待它们完成，S态关中断的hart同样会响应，
+ * 所以持有自旋锁时也可以调用。SBI不支持RFENCE时退回v0.1的remote fence。
+ * 内核全局映射(proc为NULL，如内核栈)刷新所有在线的hart。
+ * 缺页时新建的映射(无效变有效)只刷新本地，CoW和零页替换会改变已有表项，
+ * 需要远端刷新。
+ * 解除映射时页面不能立即释放：刷新之前其他hart上的线程仍可能通过旧表项访问
+ * 它，页面被重新分配后就会读写别人的数据。释放的页先记在batch中，刷新完成
+ * 后再交还伙伴系统，记不下时分配一页继续记录，分配失败则提前刷新。
+ * 回收了中间页表时，sfence.vma带地址只保证刷新叶子表项，需要刷新整个ASID。
+ */
+
+struct tlb_stat {
+    uint64_t flushes;    // batches flushed
+    uint64_t shootdowns; // remote requests sent
+    uint64_t targets;    // harts the requests sent to
+    uint64_t skipped;    // online harts skipped, never ran the address space
+    uint64_t full;       // remote requests flushing whole address space
+    uint64_t latency;    // time ticks spent in remote requests
+    uint64_t max_latency;
+} __attribute__((aligned(64)));
+
+static struct tlb_stat tlb_stats[MAX_CPUS];
+static bool            rfence_missing = false;
+
+static int hart_count(uint64_t mask) {
+    int n = 0;
+    for (; mask; mask &= mask - 1)
+        n++;
+    return n;
+}
+
+#define TLB_CHUNK_BLOCKS                                                       \
+    ((PG_SIZE - sizeof(struct tlb_freed_chunk)) / sizeof(struct tlb_freed))
+
+void tlb_batch_init(tlb_batch_t *batch, proc_t *proc) {
+    batch->proc   = proc;
+    batch->count  = 0;
+    batch->full   = false;
+    batch->nfreed = 0;
+    batch->chunks = NULL;
+}
+
+void tlb_batch_add(tlb_batch_t *batch, void *va, size_t size) {
+    if (batch->full || size == 0)
+        return;
+    uintptr_t start = PG_ROUNDDOWN(va);
+    uintptr_t end   = PG_ROUNDUP((uintptr_t)va + size);
+    if (batch->count) {
+        // merge into last range if they touch
+        struct tlb_range *last = &batch->ranges[batch->count - 1];
+        if (start <= last->end && end >= last->start) {
+            last->start = start < last->start ? start : last->start;
+            last->end   = end > last->end ? end : last->end;
+            return;
+        }
+    }
+    if (batch->count == TLB_BATCH_RANGES) {
+        batch->full = true;
+        return;
+    }
+    batch->ranges[batch->count].start = start;
+    batch->ranges[batch->count].end   = end;
+    batch->count++;
+}
+
+static void local_flush(tlb_batch_t *batch, uint64_t asid) {
+    size_t pages = 0;
+    for (int i = 0; i < batch->count; i++)
+        pages += (batch->ranges[i].end - batch->ranges[i].start) / PG_SIZE;
+    if (batch->full || pages > TLB_LOCAL_PAGES) {
+        if (batch->proc)
+            flush_tlb_asid(asid);
+        else
+            flush_tlb_all();
+        return;
+    }
+    for (int i = 0; i < batch->count; i++)
+        for (uintptr_t va = batch->ranges[i].start; va < batch->ranges[i].end;
+             va += PG_SIZE) {
+            if (batch->proc)
+                flush_tlb_page((void *)va, asid);
+            else
+                flush_tlb_va((void *)va);
+        }
+}
+
+static void remote_flush(uint64_t mask, tlb_batch_t *batch, uintptr_t start,
+                         size_t size, uint64_t asid) {
+    if (!rfence_missing) {
+        long ret = batch->proc ? SBI_remote_sfence_vma_asid(mask, 0, start,
+                                                            size, asid)
+                               : SBI_remote_sfence_vma(mask, 0, start, size);
+        if (ret == 0)
+            return;
+        if (ret != SBI_ERR_NOT_SUPPORTED)
+            kpanic("Remote sfence.vma failed: %ld.", ret);
+        rfence_missing = true;
+        kprintf("[MEM] No SBI RFENCE extension, use legacy remote fence.\n");
+    }
+    SBI_legacy_remote_sfence_vma(&mask, start, size);
+}
+
+static void batch_sync(tlb_batch_t *batch) {
+    if (!batch->full && batch->count == 0)
+        return;
+    // stay on this hart, or the new one may miss both flushes
+    trap_push_off();
+    uint64_t         self = 1UL << cpuid();
+    struct tlb_stat *stat = &tlb_stats[cpuid()];
+    uint64_t         asid = batch->proc ? proc_asid(batch->proc) : 0;
+    stat->flushes++;
+    local_flush(batch, asid);
+
+    // page table writes must be visible before reading the mask, pairs with
+    // the fetch_and_or in asid_switch_to
+    __sync_synchronize();
+    uint64_t online = READ_ONCE(os_env.online_mask) & ~self;
+    uint64_t mask   = online;
+    if (batch->proc)
+        mask &= READ_ONCE(batch->proc->mm->tlb_mask);
+    stat->skipped += hart_count(online & ~mask);
+    if (mask) {
+        uintptr_t start = 0;
+        size_t    size  = (size_t)-1;
+        if (!batch->full) {
+            uintptr_t end = 0;
+            start         = (uintptr_t)-1;
+            for (int i = 0; i < batch->count; i++) {
+                if (batch->ranges[i].start < start)
+                    start = batch->ranges[i].start;
+                if (batch->ranges[i].end > end)
+                    end = batch->ranges[i].end;
+            }
+            size = end - start;
+        }
+        if (size != (size_t)-1 && size / PG_SIZE > TLB_REMOTE_PAGES) {
+            start = 0;
+            size  = (size_t)-1;
+        }
+        uint64_t begin = cpu_cycle();
+        remote_flush(mask, batch, start, size, asid);
+        uint64_t elapsed = cpu_cycle() - begin;
+        stat->shootdowns++;
+        stat->targets += hart_count(mask);
+        stat->full += size == (size_t)-1;
+        stat->latency += elapsed;
+        if (elapsed > stat->max_latency)
+            stat->max_latency = elapsed;
+    }
+    trap_pop_off();
+}
+
+static void batch_release(tlb_batch_t *batch) {
+    for (int i = 0; i < batch->nfreed; i++)
+        page_free(batch->freed[i].pa, batch->freed[i].pages);
+    batch->nfreed = 0;
+    while (batch->chunks) {
+        struct tlb_freed_chunk *chunk = batch->chunks;
+        batch->chunks                 = chunk->next;
+        for (size_t i = 0; i < chunk->count; i++)
+            page_free(chunk->blocks[i].pa, chunk->blocks[i].pages);
+        page_free((char *)chunk, 1);
+    }
+}
+
+// Free pages once the batch is flushed, now if batch is NULL. The range they
+// were mapped at must already be added to the batch.
+void tlb_batch_free(tlb_batch_t *batch, char *pa, size_t pages) {
+    if (!batch) {
+        page_free(pa, pages);
+        return;
+    }
+    if (batch->nfreed < TLB_BATCH_FREED) {
+        batch->freed[batch->nfreed].pa    = pa;
+        batch->freed[batch->nfreed].pages = pages;
+        batch->nfreed++;
+        return;
+    }
+    struct tlb_freed_chunk *chunk = batch->chunks;
+    if (!chunk || chunk->count == TLB_CHUNK_BLOCKS) {
+        chunk = (struct tlb_freed_chunk *)page_alloc(1, PAGE_TYPE_SYSTEM);
+        if (!chunk) {
+            // nowhere to keep it, flush early. ranges are kept since the
+            // caller is still unmapping them.
+            batch_sync(batch);
+            batch_release(batch);
+            page_free(pa, pages);
+            return;
+        }
+        chunk->next   = batch->chunks;
+        chunk->count  = 0;
+        batch->chunks = chunk;
+    }
+    chunk->blocks[chunk->count].pa    = pa;
+    chunk->blocks[chunk->count].pages = pages;
+    chunk->count++;
+}
+
+// A page table removed from the tree, leaf-only flushes may miss entries
+// cached from it.
+void tlb_batch_free_table(tlb_batch_t *batch, pde_t table) {
+    if (batch)
+        batch->full = true;
+    tlb_batch_free(batch, (char *)table, 1);
+}
+
+void tlb_batch_flush(tlb_batch_t *batch) {
+    batch_sync(batch);
+    batch_release(batch);
+    batch->count = 0;
+    batch->full  = false;
+}
+
+// Flush [va, va + size) of proc (or kernel if NULL) everywhere, whole address
+// space if va is NULL.
+void tlb_shootdown(proc_t *proc, void *va, size_t size) {
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, proc);
+    if (va)
+        tlb_batch_add(&batch, va, size);
+    else
+        batch.full = true;
+    tlb_batch_flush(&batch);
+}
+
+void print_tlb_info() {
+    struct tlb_stat sum = {0};
+    for (int i = 0; i < MAX_CPUS; i++) {
+        sum.flushes += tlb_stats[i].flushes;
+        sum.shootdowns += tlb_stats[i].shootdowns;
+        sum.targets += tlb_stats[i].targets;
+        sum.skipped += tlb_stats[i].skipped;
+        sum.full += tlb_stats[i].full;
+        sum.latency += tlb_stats[i].latency;
+        if (tlb_stats[i].max_latency > sum.max_latency)
+            sum.max_latency = tlb_stats[i].max_latency;
+    }
+    kprintf("[MEM] TLB flushes: %ld, shootdowns: %ld (full %ld), "
+            "harts targeted: %ld, skipped: %ld.\n",
+            sum.flushes, sum.shootdowns, sum.full, sum.targets, sum.skipped);
+    kprintf("[MEM] Shootdown latency: avg %ld, max %ld time ticks.\n",
+            sum.shootdowns ? sum.latency / sum.shootdowns : 0,
+            sum.max_latency);
+}
@@ -9,6 +9,11 @@
 #include <types.h>
 
 #define KERNEL_MEM_START 0x80000000
+#define USTR_CACHE_SIZE  256
+
+// 大部分从用户空间复制的字符串(路径等)都很短，使用slab缓存
+static kmem_cache_t ustr_cache =
+    KMEM_CACHE_INIT(ustr_cache, "ustr", USTR_CACHE_SIZE);
 
 static ALWAYS_INLINE inline void *umem_access_memcpy(void *dst, const void *src,
                                                      size_t size) {
@@ -59,15 +64,86 @@ void *umemset(void *dst, char c, size_t size) {
     STOP_UMEM_ACCESS();
 }
 
+/*
+ * 带异常表的用户内存拷贝：__copy_user(usercopy_asm.S)访问用户内存的指令都
+ * 登记在ExTable中，缺页处理失败时supervisor trap跳到fixup，返回未拷贝的
+ * 字节数，调用者返回错误即可，不会因为用户传入的坏指针panic。
+ */
+struct exception_table_entry {
+    uintptr_t insn;
+    uintptr_t fixup;
+};
+
+extern size_t __copy_user(void *dst, const void *src, size_t size);
+
+// Return fixup address for faulting instruction at epc, 0 if none.
+uintptr_t search_exception_table(uintptr_t epc) {
+    section_foreach_entry(ExTable, struct exception_table_entry, e) {
+        if (e->insn == epc)
+            return e->fixup;
+    }
+    return 0;
+}
+
+// [p, p + size) lies in user space
+bool user_access_ok(const void *p, size_t size) {
+    uintptr_t end = (uintptr_t)p + size;
+    return end >= (uintptr_t)p && end <= KERNEL_MEM_START;
+}
+
+// Return bytes not copied, 0 on success.
+size_t copy_to_user(void *udst, const void *ksrc, size_t size) {
+    if (!user_access_ok(udst, size))
+        return size;
+    BEGIN_UMEM_ACCESS();
+    size_t r = __copy_user(udst, ksrc, size);
+    STOP_UMEM_ACCESS();
+    return r;
+}
+
+// Return bytes not copied, 0 on success.
+size_t copy_from_user(void *kdst, const void *usrc, size_t size) {
+    if (!user_access_ok(usrc, size))
+        return size;
+    BEGIN_UMEM_ACCESS();
+    size_t r = __copy_user(kdst, usrc, size);
+    STOP_UMEM_ACCESS();
+    return r;
+}
+
+// For file ops that accept both kernel and user buffers (see user_buffer in
+// file_ops), dispatch by address. Return 0 on success, -1 on bad user buffer.
+int copy_to_buffer(char *dst, const char *src, size_t size) {
+    if ((uintptr_t)dst >= KERNEL_MEM_START) {
+        memcpy(dst, src, size);
+        return 0;
+    }
+    return copy_to_user(dst, src, size) == 0 ? 0 : -1;
+}
+
+int copy_from_buffer(char *dst, const char *src, size_t size) {
+    if ((uintptr_t)src >= KERNEL_MEM_START) {
+        memcpy(dst, src, size);
+        return 0;
+    }
+    return copy_from_user(dst, src, size) == 0 ? 0 : -1;
+}
+
 char *ustrcpy_out(char *ustr) {
     if (!ustr)
         return NULL;
     BEGIN_UMEM_ACCESS();
     size_t len = strlen(ustr);
     assert((uintptr_t)ustr + len + 1 < KERNEL_MEM_START, "user str execeed.");
-    char *kbuf = (char *)kmalloc(len + 1);
-    if (!kbuf)
+    char *kbuf = NULL;
+    if (len + 1 <= USTR_CACHE_SIZE)
+        kbuf = (char *)kmem_cache_alloc(&ustr_cache);
+    else
+        kbuf = (char *)kmalloc(len + 1);
+    if (!kbuf) {
+        STOP_UMEM_ACCESS();
         return NULL;
+    }
     memcpy(kbuf, ustr, len);
     kbuf[len] = '\0';
     STOP_UMEM_ACCESS();
@@ -3,33 +3,40 @@
 //
 
 #include <memory.h>
+#include <mm.h>
 #include <proc.h>
+#include <riscv.h>
 
-uintptr_t do_brk(proc_t *proc, uintptr_t addr) {
-    assert(proc, "proc must valid.");
-    char *current_brk = proc->prog_break;
+static uintptr_t brk_locked(proc_t *proc, uintptr_t addr) {
+    char *current_brk = proc->mm->prog_break;
     if (addr == 0)
         return (uintptr_t)current_brk;
     char *new_brk = (char *)addr;
-    if (PG_ROUNDDOWN(current_brk) != PG_ROUNDDOWN(new_brk)) {
-        size_t pgs =
-            (PG_ROUNDDOWN(current_brk) - PG_ROUNDDOWN(new_brk)) / PG_SIZE;
-        if (PG_ROUNDDOWN(new_brk) < PG_ROUNDDOWN(current_brk)) {
-            // smaller, do free
-            unmap_pages(proc->page_dir, (char *)(PG_ROUNDDOWN(current_brk)),
-                        pgs, true);
-        } else {
-            char *new_pa = page_alloc(pgs, PAGE_TYPE_USER | PAGE_TYPE_INUSE);
-            if (!new_pa)
-                return -1;
-            // TODO: maybe require a bzero?
-            if (map_pages(proc->page_dir,
-                          (char *)(PG_ROUNDDOWN(current_brk) + PG_SIZE), new_pa,
-                          PG_SIZE * pgs, PTE_TYPE_RW, true, false) != 0)
-                return -1;
-        }
+    if (new_brk < proc->mm->heap_start || new_brk > proc->mm->stack_top)
+        return -1;
+    // pages in [heap_start, PG_ROUNDUP(prog_break)) are only reserved, they
+    // are mapped by do_pagefault on first touch.
+    char *old_end = (char *)PG_ROUNDUP(current_brk);
+    char *new_end = (char *)PG_ROUNDUP(new_brk);
+    if (new_end > old_end && vma_intersect(proc, old_end, new_end))
+        return -1; // collide with mmap area
+    if (new_end < old_end) {
+        // smaller, free pages already touched
+        tlb_batch_t batch;
+        tlb_batch_init(&batch, proc);
+        unmap_pages_batch(proc->mm->page_dir, new_end,
+                          (old_end - new_end) / PG_SIZE, &batch);
+        tlb_batch_flush(&batch);
     }
-    proc->prog_break = new_brk;
-    proc->prog_size  = proc->prog_break - proc->prog_image_start;
+    proc->mm->prog_break = new_brk;
+    proc->mm->prog_size  = proc->mm->prog_break - proc->mm->prog_image_start;
     return (uintptr_t)new_brk;
 }
+
+uintptr_t do_brk(proc_t *proc, uintptr_t addr) {
+    assert(proc, "proc must valid.");
+    sleeplock_acquire(&proc->mm->lock);
+    uintptr_t r = brk_locked(proc, addr);
+    sleeplock_release(&proc->mm->lock);
+    return r;
+}
@@ -5,7 +5,9 @@
 #include <lib/elf.h>
 #include <lib/string.h>
 #include <memory.h>
+#include <mm.h>
 #include <proc.h>
+#include <scheduler.h>
 #include <stddef.h>
 #include <trap.h>
 #include <vfs.h>
@@ -28,24 +30,27 @@ static inline char *get_offset_addr(char *base, char *addr, char *vbase) {
     return (vbase + (addr - base));
 }
 
-int do_execve(proc_t *old, dentry_t *cwd, const char *path, const char *argv[],
-              const char *env[]) {
-    // locate file
-    dentry_t *dentry = vfs_get_dentry(path, cwd);
-    if (!dentry)
-        return -1; // no file
-    if (dentry->d_type != D_TYPE_FILE)
-        return -2; // not a file
-    file_t *f = vfs_open(dentry, 0);
-    if (!f)
-        return -3; // cannot open file
-    spinlock_acquire(&old->lock);
-    // setup new exec stack
+/*
+ * 新的用户栈在内核中构造好，装载ELF之后再映射到PROC_STACK_BASE之下。
+ * execve在当前进程上替换映像；spawn直接在新分配的进程上装载，不复制父进程的
+ * 地址空间，父进程的文件表只增加引用。
+ */
+struct exec_stack {
+    char     *pages;  // PROC_STACK_SIZE bytes, not mapped yet
+    char     *sp;     // in kernel va
+    uintptr_t argv_va;
+    uintptr_t envp_va;
+    int       argc;
+};
+
+// Return false if out of memory.
+static bool exec_stack_build(struct exec_stack *st, const char *argv[],
+                             const char *env[]) {
     size_t stack_pages = PG_ROUNDUP(PROC_STACK_SIZE) / PG_SIZE;
     char  *process_stack =
         page_alloc(stack_pages, PAGE_TYPE_INUSE | PAGE_TYPE_USER);
     if (!process_stack)
-        return -4; // cannot allocate stack
+        return false;
     char *stack_bottom = process_stack + PG_ROUNDUP(PROC_STACK_SIZE);
     char *sp           = stack_bottom;
 
@@ -133,16 +138,68 @@ int do_execve(proc_t *old, dentry_t *cwd, const char *path, const char *argv[],
     sp -= sizeof(uintptr_t);
     *((uintptr_t *)sp) = (uintptr_t)argc;
 
-    // free old process's pages
+    st->pages   = process_stack;
+    st->sp      = sp;
+    st->argv_va = (uintptr_t)argv_va;
+    st->envp_va = (uintptr_t)envp_va;
+    st->argc    = argc;
+    return true;
+}
+
+// Map the stack built by exec_stack_build into proc, and start from it.
+static void exec_stack_install(proc_t *proc, struct exec_stack *st) {
+    size_t stack_pages  = PG_ROUNDUP(PROC_STACK_SIZE) / PG_SIZE;
+    char  *stack_bottom = st->pages + PG_ROUNDUP(PROC_STACK_SIZE);
+    char  *process_stack_top =
+        (char *)(PROC_STACK_BASE - stack_pages * PG_SIZE);
+    // load new stack
+    map_pages(proc->mm->page_dir, (void *)(process_stack_top), st->pages,
+              PROC_STACK_SIZE, PTE_TYPE_RW, true, false);
+
+    proc->trapframe.sp =
+        ROUNDDOWN_WITH(sizeof(uintptr_t),
+                       (uintptr_t)(PROC_STACK_BASE - (stack_bottom - st->sp)));
+    // These are riscv call convention
+    proc->trapframe.a1 = st->argv_va;
+    proc->trapframe.a2 = st->envp_va;
+
+    proc->mm->stack_bottom = (char *)PROC_STACK_BASE;
+    proc->mm->stack_top    = process_stack_top;
+}
+
+int do_execve(proc_t *old, dentry_t *cwd, const char *path, const char *argv[],
+              const char *env[]) {
+    // other threads are still running in the old image
+    if (old->mm->users > 1)
+        return -5;
+    // locate file
+    dentry_t *dentry = vfs_get_dentry(path, cwd);
+    if (!dentry)
+        return -1; // no file
+    if (dentry->d_type != D_TYPE_FILE)
+        return -2; // not a file
+    file_t *f = vfs_open(dentry, 0);
+    if (!f)
+        return -3; // cannot open file
+    // setup new exec stack
+    struct exec_stack st;
+    if (!exec_stack_build(&st, argv, env)) {
+        vfs_close(f);
+        return -4; // cannot allocate stack
+    }
+
+    // free old process's pages, we are the only user of mm. no lock is held,
+    // shared mappings are written back.
     // unmap all userspace
-    pde_t pagedir = old->page_dir;
-    unmap_pages(pagedir, old->prog_image_start,
-                PG_ROUNDUP(old->prog_size) / PG_SIZE, true);
-    unmap_pages(pagedir, old->stack_top,
-                PG_ROUNDUP(old->stack_bottom - (uintptr_t)old->stack_top) /
+    pde_t pagedir = old->mm->page_dir;
+    vma_free_all(old);
+    unmap_pages(pagedir, old->mm->prog_image_start,
+                PG_ROUNDUP(old->mm->prog_size) / PG_SIZE, true);
+    unmap_pages(pagedir, old->mm->stack_top,
+                PG_ROUNDUP(old->mm->stack_bottom -
+                           (uintptr_t)old->mm->stack_top) /
                     PG_SIZE,
                 true);
-    spinlock_release(&old->lock);
 
     // load elf file
     bool ret = elf_load_to_process(old, vfs_reader, f);
@@ -151,20 +208,8 @@ int do_execve(proc_t *old, dentry_t *cwd, const char *path, const char *argv[],
         kpanic("no way...todo here");
     }
 
-    char *process_stack_top = (char *)(PROC_STACK_BASE - stack_pages * PG_SIZE);
-    // load new stack
-    map_pages(old->page_dir, (void *)(process_stack_top), process_stack,
-              PROC_STACK_SIZE, PTE_TYPE_RW, true, false);
-
-    old->trapframe.sp = ROUNDDOWN_WITH(
-        sizeof(uintptr_t), (uintptr_t)(PROC_STACK_BASE - (stack_bottom - sp)));
-    // These are riscv call convention
-    old->trapframe.a1 = (uintptr_t)(argv_va);
-    old->trapframe.a2 = (uintptr_t)(envp_va);
-
-    old->stack_bottom = (char *)PROC_STACK_BASE;
-    old->stack_top    = process_stack_top;
-    flush_tlb_all();
+    exec_stack_install(old, &st);
+    tlb_shootdown(old, NULL, 0);
 
     // close file
     vfs_close(f);
@@ -175,5 +220,125 @@ int do_execve(proc_t *old, dentry_t *cwd, const char *path, const char *argv[],
     // let it go
     old->status = PROC_STATUS_READY | PROC_STATUS_NORMAL;
 
-    return argc; // jump to switch with argc as a0
+    return st.argc; // jump to switch with argc as a0
+}
+
+// Apply file actions on the child's own file table.
+static int spawn_file_actions(proc_t *child, const spawn_attr_t *attr) {
+    file_t **ftable = child->files;
+    for (int i = 0; i < attr->nactions; i++) {
+        const struct spawn_file_action *fa = &attr->actions[i];
+        if (fa->fd < 0 || fa->fd >= MAX_FILE_OPEN)
+            return -1;
+        switch (fa->action) {
+        case SPAWN_FA_CLOSE:
+            if (ftable[fa->fd]) {
+                vfs_close(ftable[fa->fd]);
+                ftable[fa->fd] = NULL;
+            }
+            break;
+        case SPAWN_FA_DUP2:
+            if (fa->newfd < 0 || fa->newfd >= MAX_FILE_OPEN ||
+                !ftable[fa->fd])
+                return -1;
+            if (fa->newfd == fa->fd)
+                break;
+            if (ftable[fa->newfd])
+                vfs_close(ftable[fa->newfd]);
+            ftable[fa->newfd] = vfs_fdup(ftable[fa->fd]);
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Free a child that never ran.
+static void spawn_abort(proc_t *child) {
+    proc_free(child);
+    proc_destroy(child);
+}
+
+/*
+ * 创建一个运行path的新进程，相当于fork之后在子进程中执行attr中的文件操作、
+ * chdir和execve，但子进程从一个空的地址空间开始，不复制父进程的页表和VMA。
+ * 文件表继承父进程的，每个文件只增加引用计数。返回子进程的pid，父进程之后
+ * 用wait4等待它。
+ */
+int do_spawn(proc_t *parent, const char *path, const char *argv[],
+             const char *env[], const spawn_attr_t *attr) {
+    dentry_t *cwd = parent->cwd;
+    if (attr && attr->cwd) {
+        cwd = vfs_get_dentry(attr->cwd, parent->cwd);
+        if (!cwd || (cwd->d_type != D_TYPE_DIR &&
+                     cwd->d_type != D_TYPE_MOUNTED))
+            return -1; // no such directory
+    }
+    dentry_t *dentry = vfs_get_dentry(path, cwd);
+    if (!dentry)
+        return -1; // no file
+    if (dentry->d_type != D_TYPE_FILE)
+        return -2; // not a file
+    file_t *f = vfs_open(dentry, 0);
+    if (!f)
+        return -3; // cannot open file
+
+    proc_t *child = proc_alloc();
+    if (!child) {
+        vfs_close(f);
+        return -4;
+    }
+    // not linked anywhere yet, set it up without lock
+    spinlock_release(&child->lock);
+
+    // inherit the file table instead of the default 0, 1, 2
+    for (int fd = 0; fd < 3; fd++) {
+        if (child->files[fd])
+            vfs_close(child->files[fd]);
+        child->files[fd] = NULL;
+    }
+    fdtable_t *fdt = parent->fdtable;
+    spinlock_acquire(&fdt->lock);
+    for (int fd = 0; fd < MAX_FILE_OPEN; fd++) {
+        if (fdt->fd[fd])
+            child->files[fd] = vfs_fdup(fdt->fd[fd]);
+    }
+    spinlock_release(&fdt->lock);
+    child->cwd = cwd;
+
+    struct exec_stack st;
+    if ((attr && spawn_file_actions(child, attr) != 0) ||
+        !exec_stack_build(&st, argv, env)) {
+        vfs_close(f);
+        spawn_abort(child);
+        return -5;
+    }
+    if (!elf_load_to_process(child, vfs_reader, f)) {
+        page_free(st.pages, PG_ROUNDUP(PROC_STACK_SIZE) / PG_SIZE);
+        vfs_close(f);
+        spawn_abort(child);
+        return -6; // bad elf
+    }
+    vfs_close(f);
+    exec_stack_install(child, &st);
+    child->trapframe.a0 = st.argc;
+    strcpy(child->name, dentry->d_name);
+
+    spinlock_acquire(&parent->lock);
+    spinlock_acquire(&child->lock);
+    child->parent = parent;
+    list_add(&child->child_list, &parent->children);
+    // same as fork, spawn can't be used to get more cpu time
+    child->nice     = parent->nice;
+    child->vruntime = parent->vruntime;
+    child->status   = PROC_STATUS_READY | PROC_STATUS_NORMAL;
+    spinlock_acquire(&os_env.ticks_lock);
+    child->start_tick = os_env.ticks;
+    spinlock_release(&os_env.ticks_lock);
+    pid_t pid = child->pid;
+    sched_enqueue(child);
+    spinlock_release(&child->lock);
+    spinlock_release(&parent->lock);
+    return pid;
 }
@@ -4,16 +4,75 @@
 
 #include <environment.h>
 #include <proc.h>
+#include <riscv.h>
+#include <smp_barrier.h>
 #include <stddef.h>
 #include <trap.h>
 
+/*
+ * CLONE_THREAD的线程退出后不通知父进程，而是挂到zombie_threads上，
+ * 等它的CPU切换离开内核栈后，由下一次clone或wait4调用reap_threads回收。
+ */
+static spinlock_t  zombie_lock    = {.lock = false, .cpu = 0};
+static list_head_t zombie_threads = LIST_HEAD_INIT(zombie_threads);
+
+// Free a proc nobody else refers to, no lock is held. The pid goes away under
+// os_env.proc_lock before the memory, get_proc users hold that lock.
+void proc_destroy(proc_t *proc) {
+    spinlock_acquire(&os_env.proc_lock);
+    list_del(&proc->proc_list);
+    pid_free(proc->pid);
+    os_env.proc_count--;
+    spinlock_release(&os_env.proc_lock);
+    if (proc->kernel_stack)
+        kstack_free(proc->kernel_stack);
+    kmem_cache_free(&proc_cache, proc);
+}
+
+void reap_threads() {
+    if (READ_ONCE(zombie_threads.next) == &zombie_threads)
+        return;
+    LIST_HEAD(reaped);
+    spinlock_acquire(&zombie_lock);
+    list_head_t *node = zombie_threads.next;
+    while (node != &zombie_threads) {
+        list_head_t *next = node->next;
+        proc_t      *proc = container_of(node, proc_t, child_list);
+        spinlock_acquire(&proc->lock);
+        // one still switching away from its stack is left for next time
+        if (proc->sched_state != SCHED_ONCPU) {
+            list_del(node);
+            list_add(node, &reaped);
+        }
+        spinlock_release(&proc->lock);
+        node = next;
+    }
+    spinlock_release(&zombie_lock);
+    // proc_destroy takes os_env.proc_lock, which nests outside proc locks
+    while (reaped.next != &reaped) {
+        proc_t *proc = container_of(reaped.next, proc_t, child_list);
+        list_del(&proc->child_list);
+        proc_destroy(proc);
+    }
+}
+
 void do_exit(proc_t *proc, int ec) {
-    spinlock_acquire(&proc->lock);
+    if (proc->clear_child_tid) {
+        // tell the joiner, user memory must be touched without locks held
+        uint32_t zero = 0;
+        if (copy_to_user(proc->clear_child_tid, &zero, sizeof(zero)) == 0)
+            do_futex(proc, (uint32_t *)proc->clear_child_tid, FUTEX_WAKE, 1,
+                     0);
+        proc->clear_child_tid = NULL;
+    }
     if (proc->pid == 1)
         kpanic("Init process cannot exit.");
-
+    // the page dir may be freed and reused below, kernel mappings are global
+    CSR_Write(satp, os_env.kernel_satp);
+    // without proc->lock, shared mappings are written back
     proc_free(proc);
 
+    spinlock_acquire(&proc->lock);
     // reparent proc's child to init
     proc_t *parent = proc->parent;
     assert(parent, "Proc must have a parent.");
@@ -27,14 +86,18 @@ void do_exit(proc_t *proc, int ec) {
 
     proc->exit_status = ec;
     proc->status      = PROC_STATUS_STOP;
-
-    // wakeup parent if parent is waiting
-    // there is like a manually wakeup function
-    if (parent->status | PROC_STATUS_WAITING) {
-        parent->status &= ~(PROC_STATUS_WAITING);
-        parent->status |= (PROC_STATUS_READY | PROC_STATUS_NORMAL);
+    if (proc->thread) {
+        // nobody waits for it
+        list_del(&proc->child_list);
+        spinlock_acquire(&zombie_lock);
+        list_add(&proc->child_list, &zombie_threads);
+        spinlock_release(&zombie_lock);
     }
+
     spinlock_release(&parent->lock);
+    // wakeup parent if parent is waiting, parent can not go away before it
+    // gets our lock to reparent us.
+    wake_up(&parent->child_wait);
     spinlock_release(&proc->lock);
 
     yield(); // never return.
@@ -42,34 +105,49 @@ void do_exit(proc_t *proc, int ec) {
 
 pid_t do_wait(pid_t waitfor, int *status, int options) {
     proc_t *p = myproc();
+    reap_threads();
 
     spinlock_acquire(&p->lock); // avoid wakeup miss
     while (true) {
         bool have_child = false;
+        bool switching  = false;
         list_foreach_entry(&p->children, proc_t, child_list, child) {
+            if (child->thread)
+                continue; // reaped by reap_threads
             have_child = true;
             spinlock_acquire(&child->lock);
-            if (child->status == PROC_STATUS_STOP) {
-                // got a stopped child
-                if (waitfor == -1 || waitfor == child->pid) {
-                    // got the waiting one
+            // got a stopped child, and it is the waiting one
+            if (child->status == PROC_STATUS_STOP &&
+                (waitfor == -1 || waitfor == child->pid)) {
+                if (child->sched_state == SCHED_ONCPU) {
+                    // another cpu is still switching away from its stack,
+                    // sleep under child's lock, sched_switched_out wakes us
+                    // up under it once the child is off the cpu
+                    spinlock_release(&p->lock);
+                    sleep_on(&p->child_wait, &child->lock);
+                    spinlock_release(&child->lock);
+                    switching = true;
+                    break;
+                } else {
                     *status = (int)child->exit_status;
                     // destory child'process
-                    list_del(&child->child_list);
-                    list_del(&child->proc_list);
                     pid_t pid = child->pid;
-                    kfree(child);
-                    spinlock_acquire(&os_env.proc_lock);
-                    clear_bit(os_env.proc_bitmap, pid);
-                    set_proc(pid, NULL);
-                    spinlock_release(&os_env.proc_lock);
+                    list_del(&child->child_list);
+                    spinlock_release(&child->lock);
                     spinlock_release(&p->lock);
+                    proc_destroy(child);
                     return pid;
                 }
             }
             spinlock_release(&child->lock);
         }
+        if (switching) {
+            // the child may be off the cpu now, scan again
+            spinlock_acquire(&p->lock);
+            continue;
+        }
         if (options == WNOHANG) {
+            spinlock_release(&p->lock);
             return 0; // imm return
         } else if (!have_child) {
             // no child, return
@@ -77,6 +155,6 @@ pid_t do_wait(pid_t waitfor, int *status, int options) {
             return -1;
         }
         // got child, wait for child
-        sleep(p, &p->lock);
+        sleep_on(&p->child_wait, &p->lock);
     }
 }
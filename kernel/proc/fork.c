@@ -5,40 +5,28 @@
 #include <environment.h>
 #include <lib/string.h>
 #include <memory.h>
+#include <mm.h>
 #include <proc.h>
+#include <stddef.h>
 #include <trap.h>
 
-// TODO: impl clone
+/*
+ * clone：没有CLONE_VM时和fork相同，复制(写时复制)整个地址空间。
+ * 有CLONE_VM时子进程是一个线程，共享父进程的mm，有CLONE_FILES时再共享文件表，
+ * 不复制任何页面，只需要分配proc和内核栈。线程在调用者给出的栈上从clone返回，
+ * CLONE_SETTLS设置它的tp。CLONE_THREAD的线程退出后不需要wait4，由
+ * reap_threads回收。CLONE_CHILD_CLEARTID给出的地址在线程退出时清零并做一次
+ * futex唤醒，用户态据此等待线程结束。
+ * 没有线程组，线程有自己的pid，getpid返回的是线程自己的pid。
+ */
 
-int do_fork(proc_t *parent, char *child_stack) {
-    spinlock_acquire(&parent->lock);
-    if (parent->status & PROC_STATUS_RUNNING) {
-        parent->status &= ~PROC_STATUS_RUNNING;
-        parent->status |= PROC_STATUS_READY;
-    }
-    proc_t *child = proc_alloc();
-    if (!child)
-        return -1;
-    // fork memory, TODO: but copy on write
-    vm_copy(child->page_dir, parent->page_dir, parent->prog_image_start,
-            parent->prog_break);
-    vm_copy(child->page_dir, parent->page_dir, parent->stack_top,
-            parent->stack_bottom);
-
-    // set parent-child relationship
-    child->parent = parent;
-    list_add(&child->child_list, &parent->children);
-
-    // fork prog info
-    child->prog_brk_pg_end  = parent->prog_brk_pg_end;
-    child->prog_image_start = parent->prog_image_start;
-    child->prog_size        = parent->prog_size;
-    child->prog_break       = parent->prog_break;
-    // fork proc stack info
-    child->stack_top    = parent->stack_top;
-    child->stack_bottom = parent->stack_bottom;
+#define CLONE_SUPPORTED                                                        \
+    (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD |        \
+     CLONE_SETTLS | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID |               \
+     CLONE_CHILD_SETTID | 0xFF)
 
-    // dup file table
+static void dup_files(proc_t *child, proc_t *parent) {
+    spinlock_acquire(&parent->fdtable->lock);
     for (int fp = 3; fp < MAX_FILE_OPEN; fp++) {
         file_t *f = parent->files[fp];
         if (f) {
@@ -52,6 +40,56 @@ int do_fork(proc_t *parent, char *child_stack) {
             child->files[fp] = vfs_fdup(f);
         }
     }
+    spinlock_release(&parent->fdtable->lock);
+}
+
+int do_fork(proc_t *parent, char *child_stack) {
+    // other threads may fault on it while copying
+    sleeplock_acquire(&parent->mm->lock);
+    proc_t *child = proc_alloc();
+    if (!child) {
+        sleeplock_release(&parent->mm->lock);
+        return -1;
+    }
+    // not linked to parent nor queued yet. shared file mappings are read in
+    // while copying, which sleeps, so no spinlock is held here.
+    spinlock_release(&child->lock);
+    // fork prog info, before copying so a failed child can be torn down
+    child->mm->heap_start       = parent->mm->heap_start;
+    child->mm->prog_image_start = parent->mm->prog_image_start;
+    child->mm->prog_size        = parent->mm->prog_size;
+    child->mm->prog_break       = parent->mm->prog_break;
+    // fork proc stack info
+    child->mm->stack_top    = parent->mm->stack_top;
+    child->mm->stack_bottom = parent->mm->stack_bottom;
+    vm_copy(child->mm->page_dir, parent->mm->page_dir,
+            parent->mm->prog_image_start, parent->mm->prog_break);
+    vm_copy(child->mm->page_dir, parent->mm->page_dir, parent->mm->stack_top,
+            parent->mm->stack_bottom);
+    int r = vma_fork(child, parent);
+    // parent's pages are read-only now, even if it failed half way
+    tlb_shootdown(parent, NULL, 0);
+    if (r != 0) {
+        sleeplock_release(&parent->mm->lock);
+        // never ran nor linked to parent
+        proc_free(child);
+        proc_destroy(child);
+        return -1;
+    }
+
+    spinlock_acquire(&parent->lock);
+    spinlock_acquire(&child->lock);
+    if (parent->status & PROC_STATUS_RUNNING) {
+        parent->status &= ~PROC_STATUS_RUNNING;
+        parent->status |= PROC_STATUS_READY;
+    }
+
+    // set parent-child relationship
+    child->parent = parent;
+    list_add(&child->child_list, &parent->children);
+
+    // dup file table
+    dup_files(child, parent);
     // fork cwd
     child->cwd = parent->cwd;
 
@@ -63,6 +101,9 @@ int do_fork(proc_t *parent, char *child_stack) {
         child->status |= PROC_STATUS_READY;
     }
     child->waiting_chan = parent->waiting_chan;
+    // start where parent is, fork can't be used to get more cpu time
+    child->nice     = parent->nice;
+    child->vruntime = parent->vruntime;
     // memcpy(&child->trapframe, &parent->trapframe, sizeof(struct
     // trap_context));
     child->trapframe = parent->trapframe;
@@ -83,9 +124,77 @@ int do_fork(proc_t *parent, char *child_stack) {
     child->start_tick = os_env.ticks;
     spinlock_release(&os_env.ticks_lock);
 
+    pid_t pid = child->pid;
+    sched_enqueue(child);
     spinlock_release(&child->lock);
     spinlock_release(&parent->lock);
+    sleeplock_release(&parent->mm->lock);
     // parent yield
     yield();
-    return child->pid;
+    return pid;
+}
+
+int do_clone(proc_t *parent, int flags, char *child_stack, int *ptid,
+             uintptr_t tls, int *ctid) {
+    if (flags & ~CLONE_SUPPORTED)
+        return -1;
+    if (!(flags & CLONE_VM)) {
+        if (flags & ~0xFF)
+            return -1;
+        return do_fork(parent, child_stack);
+    }
+    // a thread can't share the stack with its parent
+    if (!child_stack)
+        return -1;
+    reap_threads();
+
+    // may open /dev/tty for a new fdtable, and takes os_env.proc_lock which
+    // nests outside proc locks, so no lock is held here
+    proc_t *child = proc_alloc_shared(
+        parent->mm, (flags & CLONE_FILES) ? parent->fdtable : NULL);
+    if (!child)
+        return -1;
+    spinlock_release(&child->lock);
+
+    spinlock_acquire(&parent->lock);
+    spinlock_acquire(&child->lock);
+    child->parent = parent;
+    list_add(&child->child_list, &parent->children);
+    if (!(flags & CLONE_FILES))
+        dup_files(child, parent);
+    child->cwd = parent->cwd;
+
+    child->user_pc  = parent->user_pc;
+    child->status   = PROC_STATUS_READY | PROC_STATUS_NORMAL;
+    child->nice     = parent->nice;
+    child->vruntime = parent->vruntime;
+
+    child->trapframe    = parent->trapframe;
+    child->trapframe.a0 = 0;
+    child->trapframe.sp = (uintptr_t)child_stack;
+    if (flags & CLONE_SETTLS)
+        child->trapframe.tp = tls;
+    child->thread = (flags & CLONE_THREAD) != 0;
+    if (flags & CLONE_CHILD_CLEARTID)
+        child->clear_child_tid = ctid;
+    strcpy(child->name, parent->name);
+
+    spinlock_acquire(&os_env.ticks_lock);
+    child->start_tick = os_env.ticks;
+    spinlock_release(&os_env.ticks_lock);
+
+    pid_t pid = child->pid;
+    spinlock_release(&child->lock);
+    spinlock_release(&parent->lock);
+
+    // before the child runs, it may clear them on exit
+    if (flags & CLONE_PARENT_SETTID)
+        copy_to_user(ptid, &pid, sizeof(pid));
+    if (flags & CLONE_CHILD_SETTID)
+        copy_to_user(ctid, &pid, sizeof(pid));
+
+    spinlock_acquire(&child->lock);
+    sched_enqueue(child);
+    spinlock_release(&child->lock);
+    return pid;
 }
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include <environment.h>
+#include <lib/sys/spinlock.h>
+#include <lib/sys/waitqueue.h>
+#include <memory.h>
+#include <mm.h>
+#include <proc.h>
+#include <smp_barrier.h>
+#include <stddef.h>
+
+/*
+ * futex：用户态在一个32位字上等待和唤醒。
+ * 只支持进程私有的futex，以(mm, 用户地址)为key散列到固定数量的桶中，
+ * 不同进程之间通过MAP_SHARED共享的futex不支持。
+ * 每个等待者在自己的栈上带一个等待队列，挂在桶的链表上，唤醒时按key找到
+ * 等待者，从链表摘下后唤醒它的队列，其他key的等待者不受影响。
+ *
+ * 锁顺序：mm->lock -> bucket->lock -> proc->lock。WAIT在mm->lock下查到物理
+ * 地址，这期间页表不会变化(缺页、CoW都要先拿mm->lock)，再在bucket->lock下
+ * 读值并挂入链表，所以唤醒者改变值之后的WAKE不会错过它。持有锁时不能直接
+ * 访问用户内存，值通过物理地址读取。
+ */
+
+#define FUTEX_HASH_BITS 6
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+#define FUTEX_HASH(mm, uaddr)                                                  \
+    (((((uintptr_t)(mm)) ^ ((uintptr_t)(uaddr))) * 0x9E3779B97F4A7C15UL) >>    \
+     (64 - FUTEX_HASH_BITS))
+
+struct futex_bucket {
+    spinlock_t  lock;
+    list_head_t waiters;
+} __attribute__((aligned(64)));
+
+struct futex_waiter {
+    list_head_t  list;
+    mm_t        *mm;
+    uint32_t    *uaddr;
+    bool         woken;
+    wait_queue_t wq;
+};
+
+static struct futex_bucket futex_table[FUTEX_HASH_SIZE];
+
+void init_futex() {
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        spinlock_init(&futex_table[i].lock);
+        futex_table[i].waiters =
+            (list_head_t)LIST_HEAD_INIT(futex_table[i].waiters);
+    }
+}
+
+// Return 0 if woken, -1 if *uaddr != val, -2 if timed out, -3 for bad uaddr.
+static int futex_wait(proc_t *proc, uint32_t *uaddr, uint32_t val,
+                      uint64_t expires) {
+    mm_t                *mm = proc->mm;
+    struct futex_bucket *b  = &futex_table[FUTEX_HASH(mm, uaddr)];
+    uint32_t            *pa;
+    // fault the page in if it is not mapped, then look again
+    for (int tries = 0;; tries++) {
+        sleeplock_acquire(&mm->lock);
+        if ((pa = (uint32_t *)vm_lookup(mm->page_dir, uaddr)) != NULL)
+            break;
+        sleeplock_release(&mm->lock);
+        if (tries ||
+            do_pagefault((char *)uaddr, mm->page_dir, false, false) != 0)
+            return -3;
+    }
+    spinlock_acquire(&b->lock);
+    sleeplock_release(&mm->lock);
+    if (READ_ONCE(*pa) != val) {
+        spinlock_release(&b->lock);
+        return -1;
+    }
+    struct futex_waiter w = {.mm = mm, .uaddr = uaddr, .woken = false};
+    wait_queue_init(&w.wq);
+    list_add_tail(&w.list, &b->waiters);
+    bool timed_out = false;
+    while (!w.woken && !timed_out)
+        timed_out = !sleep_on_timeout(&w.wq, &b->lock, expires);
+    if (!w.woken)
+        list_del(&w.list);
+    // the waker is done with w once it releases b->lock
+    spinlock_release(&b->lock);
+    return w.woken ? 0 : -2;
+}
+
+// Return the number of waiters woken.
+static int futex_wake(proc_t *proc, uint32_t *uaddr, int n) {
+    struct futex_bucket *b     = &futex_table[FUTEX_HASH(proc->mm, uaddr)];
+    int                  count = 0;
+    // 不能无锁地看链表是否为空：等待者读值和挂入链表都在b->lock下，
+    // 只有拿到锁才能保证它要么已经挂上，要么会读到新值
+    spinlock_acquire(&b->lock);
+    list_head_t *node = b->waiters.next;
+    while (node != &b->waiters && count < n) {
+        list_head_t         *next = node->next;
+        struct futex_waiter *w = container_of(node, struct futex_waiter, list);
+        if (w->mm == proc->mm && w->uaddr == uaddr) {
+            list_del(node);
+            w->woken = true;
+            wake_up(&w->wq);
+            count++;
+        }
+        node = next;
+    }
+    spinlock_release(&b->lock);
+    return count;
+}
+
+// expires is in os_env.ticks, 0 for no timeout.
+int do_futex(proc_t *proc, uint32_t *uaddr, int op, uint32_t val,
+             uint64_t expires) {
+    if (((uintptr_t)uaddr & (sizeof(uint32_t) - 1)) ||
+        !user_access_ok(uaddr, sizeof(uint32_t)))
+        return -3;
+    switch (op) {
+    case FUTEX_WAIT:
+        return futex_wait(proc, uaddr, val, expires);
+    case FUTEX_WAKE:
+        return futex_wake(proc, uaddr, (int)val);
+    default:
+        return -4;
+    }
+}
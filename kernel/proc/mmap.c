@@ -0,0 +1,266 @@
+#include <lib/rb_tree.h>
+#include <lib/stdlib.h>
+#include <lib/string.h>
+#include <memory.h>
+#include <mm.h>
+#include <proc.h>
+#include <riscv.h>
+#include <stddef.h>
+#include <vfs.h>
+
+/*
+ * 进程的内存映射区域(VMA)保存在以起始地址为key的红黑树中，区域互不重叠。
+ * mmap只记录范围，页面在缺页时才分配或从文件读入(见do_pagefault)。
+ * MAP_PRIVATE的页在fork时写时复制；MAP_SHARED的页在fork时直接共享，
+ * 可写的共享文件映射在解除映射时写回文件。
+ * 没有页缓存，不同进程各自mmap同一文件时并不共享页面。
+ * 同一mm的线程共享VMA，修改和缺页时都持有mm->lock。
+ */
+
+KMEM_CACHE_DEFINE(vma_cache, "vma", vma_t);
+
+#define VMA_OF(n) container_of(n, vma_t, node)
+
+static vma_t *vma_alloc(char *start, char *end, int prot, int flags,
+                        file_t *file, size_t offset) {
+    vma_t *vma = (vma_t *)kmem_cache_alloc(&vma_cache);
+    if (!vma)
+        return NULL;
+    memset(vma, 0, sizeof(vma_t));
+    vma->node.key = (uint64_t)start;
+    vma->start    = start;
+    vma->end      = end;
+    vma->prot     = prot;
+    vma->flags    = flags;
+    vma->file     = file ? vfs_fdup(file) : NULL;
+    vma->offset   = offset;
+    return vma;
+}
+
+static void vma_free(vma_t *vma) {
+    if (vma->file)
+        vfs_close(vma->file);
+    kmem_cache_free(&vma_cache, vma);
+}
+
+// Find the node with largest key not greater than key.
+static rb_node *rb_search_lower(rb_node *x, uint64_t key) {
+    rb_node *closest = NULL;
+    while (x != NULL) {
+        if (x->key == key)
+            return x;
+        if (x->key < key) {
+            closest = x;
+            x       = x->R;
+        } else
+            x = x->L;
+    }
+    return closest;
+}
+
+vma_t *vma_find(proc_t *proc, char *va) {
+    rb_node *n = rb_search_lower(proc->mm->vmas.root, (uint64_t)va);
+    if (!n || VMA_OF(n)->end <= va)
+        return NULL;
+    return VMA_OF(n);
+}
+
+// Return the lowest vma intersects with [start, end).
+vma_t *vma_intersect(proc_t *proc, char *start, char *end) {
+    rb_node *n = rb_search_lower(proc->mm->vmas.root, (uint64_t)start);
+    if (n && VMA_OF(n)->end > start)
+        return VMA_OF(n);
+    n = n ? rb_succ(n) : rb_first(proc->mm->vmas.root);
+    if (n && VMA_OF(n)->start < end)
+        return VMA_OF(n);
+    return NULL;
+}
+
+// mmap areas live between heap and stack
+static bool vma_range_valid(proc_t *proc, char *start, char *end) {
+    return start < end && start >= (char *)PG_ROUNDUP(proc->mm->prog_break) &&
+           end <= proc->mm->stack_top;
+}
+
+// Search a free area of len bytes top-down from PROC_MMAP_TOP.
+static char *vma_search_free(proc_t *proc, size_t len) {
+    char *end = (char *)PROC_MMAP_TOP;
+    for (rb_node *n = rb_last(proc->mm->vmas.root); n; n = rb_pred(n)) {
+        vma_t *vma = VMA_OF(n);
+        if (vma->start >= end)
+            continue;
+        if (vma->end + len <= end)
+            break;
+        end = vma->start;
+    }
+    if (end < (char *)PG_ROUNDUP(proc->mm->prog_break) + len)
+        return NULL;
+    return end - len;
+}
+
+int vma_fill_page(vma_t *vma, char *va, char *pa) {
+    file_t *file = vma->file;
+    size_t  off  = vma->offset + (va - vma->start);
+    if (!file->f_op || !file->f_op->read)
+        return -1;
+    if (!file->f_inode || off >= file->f_inode->i_size)
+        return 0; // beyond end of file, keep zero
+    size_t len = file->f_inode->i_size - off;
+    if (len > PG_SIZE)
+        len = PG_SIZE;
+    return file->f_op->read(file, pa, off, len) < 0 ? -1 : 0;
+}
+
+// Write back touched pages of a shared writable file mapping in [start, end).
+static void vma_writeback(proc_t *proc, vma_t *vma, char *start, char *end) {
+    file_t *file = vma->file;
+    if (!file || !(vma->flags & MAP_SHARED) || !(vma->prot & PROT_WRITE))
+        return;
+    if (!file->f_op || !file->f_op->write || !file->f_inode)
+        return;
+    for (char *a = start; a < end; a += PG_SIZE) {
+        char  *pa  = vm_lookup(proc->mm->page_dir, a);
+        size_t off = vma->offset + (a - vma->start);
+        if (off >= file->f_inode->i_size)
+            break;
+        if (!pa)
+            continue;
+        size_t len = file->f_inode->i_size - off;
+        if (len > PG_SIZE)
+            len = PG_SIZE;
+        file->f_op->write(file, pa, off, len);
+    }
+}
+
+static int munmap_locked(proc_t *proc, char *addr, size_t len);
+
+static uintptr_t mmap_locked(proc_t *proc, char *addr, size_t len, int prot,
+                             int flags, file_t *file, size_t offset) {
+    int share = flags & (MAP_SHARED | MAP_PRIVATE);
+    if (len == 0 || (offset & (PG_SIZE - 1)) ||
+        (share != MAP_SHARED && share != MAP_PRIVATE))
+        return -1;
+    if (flags & MAP_ANONYMOUS) {
+        file   = NULL;
+        offset = 0;
+    } else if (!file) {
+        return -1;
+    }
+    len         = PG_ROUNDUP(len);
+    char *start = (char *)PG_ROUNDDOWN(addr);
+    if (flags & MAP_FIXED) {
+        if (start != addr || !vma_range_valid(proc, start, start + len))
+            return -1;
+        if (munmap_locked(proc, start, len) != 0)
+            return -1;
+    } else if (!addr || !vma_range_valid(proc, start, start + len) ||
+               vma_intersect(proc, start, start + len)) {
+        // addr is only a hint
+        if ((start = vma_search_free(proc, len)) == NULL)
+            return -1;
+    }
+    vma_t *vma = vma_alloc(start, start + len, prot, flags, file, offset);
+    if (!vma)
+        return -1;
+    rb_insert(&proc->mm->vmas, &vma->node);
+    return (uintptr_t)start;
+}
+
+uintptr_t do_mmap(proc_t *proc, char *addr, size_t len, int prot, int flags,
+                  file_t *file, size_t offset) {
+    sleeplock_acquire(&proc->mm->lock);
+    uintptr_t r = mmap_locked(proc, addr, len, prot, flags, file, offset);
+    sleeplock_release(&proc->mm->lock);
+    return r;
+}
+
+static int munmap_locked(proc_t *proc, char *addr, size_t len) {
+    if (len == 0 || (uintptr_t)addr & (PG_SIZE - 1))
+        return -1;
+    char       *start = addr;
+    char       *end   = addr + PG_ROUNDUP(len);
+    vma_t      *vma;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, proc);
+    while ((vma = vma_intersect(proc, start, end)) != NULL) {
+        char  *s    = vma->start > start ? vma->start : start;
+        char  *e    = vma->end < end ? vma->end : end;
+        vma_t *tail = NULL;
+        if (s != vma->start && e != vma->end) {
+            // hole in the middle, split the tail out
+            tail = vma_alloc(e, vma->end, vma->prot, vma->flags, vma->file,
+                             vma->offset + (e - vma->start));
+            if (!tail) {
+                tlb_batch_flush(&batch);
+                return -1;
+            }
+        }
+        vma_writeback(proc, vma, s, e);
+        unmap_pages_batch(proc->mm->page_dir, s, (e - s) / PG_SIZE, &batch);
+        if (s == vma->start && e == vma->end) {
+            rb_remove(&proc->mm->vmas, &vma->node);
+            vma_free(vma);
+        } else if (s == vma->start) {
+            // key changed, insert again
+            rb_remove(&proc->mm->vmas, &vma->node);
+            vma->offset += e - vma->start;
+            vma->start    = e;
+            vma->node.key = (uint64_t)e;
+            rb_insert(&proc->mm->vmas, &vma->node);
+        } else {
+            vma->end = s;
+            if (tail)
+                rb_insert(&proc->mm->vmas, &tail->node);
+        }
+    }
+    tlb_batch_flush(&batch);
+    return 0;
+}
+
+int do_munmap(proc_t *proc, char *addr, size_t len) {
+    sleeplock_acquire(&proc->mm->lock);
+    int r = munmap_locked(proc, addr, len);
+    sleeplock_release(&proc->mm->lock);
+    return r;
+}
+
+int vma_fork(proc_t *child, proc_t *parent) {
+    for (rb_node *n = rb_first(parent->mm->vmas.root); n; n = rb_succ(n)) {
+        vma_t *vma = VMA_OF(n);
+        vma_t *c   = vma_alloc(vma->start, vma->end, vma->prot, vma->flags,
+                               vma->file, vma->offset);
+        if (!c)
+            return -1;
+        rb_insert(&child->mm->vmas, &c->node);
+        if (vma->flags & MAP_SHARED) {
+            if (vma_populate(vma, parent->mm->page_dir) != 0)
+                return -1;
+            vm_share(child->mm->page_dir, parent->mm->page_dir, vma->start,
+                     vma->end);
+        } else {
+            vm_copy(child->mm->page_dir, parent->mm->page_dir, vma->start,
+                    vma->end);
+        }
+    }
+    return 0;
+}
+
+void vma_free_all(proc_t *proc) {
+    rb_node *n;
+    while ((n = rb_first(proc->mm->vmas.root)) != NULL) {
+        vma_t *vma = VMA_OF(n);
+        vma_writeback(proc, vma, vma->start, vma->end);
+        unmap_pages(proc->mm->page_dir, vma->start,
+                    (vma->end - vma->start) / PG_SIZE, true);
+        rb_remove(&proc->mm->vmas, n);
+        vma_free(vma);
+    }
+}
+
+size_t vma_resident_pages(proc_t *proc) {
+    size_t count = 0;
+    for (rb_node *n = rb_first(proc->mm->vmas.root); n; n = rb_succ(n))
+        count += vm_resident_pages(proc->mm->page_dir, VMA_OF(n)->start,
+                                   VMA_OF(n)->end);
+    return count;
+}
@@ -0,0 +1,145 @@
+#include <configs.h>
+#include <driver/console.h>
+#include <environment.h>
+#include <lib/bitset.h>
+#include <lib/stdlib.h>
+#include <memory.h>
+#include <proc.h>
+#include <smp_barrier.h>
+
+/*
+ * PID分配：
+ * 空闲PID记录在三级的64叉位图中，上一级的位表示下一级对应的字已满，
+ * 分配最小的空闲PID只需要三次ctz64，O(1)。
+ * PID到进程的映射是两级的基数树，叶子为一页指针，用到时才分配，查找O(1)。
+ * 回收的PID先进入FIFO，之后又回收了PID_REUSE_DELAY个PID时才重新可用，
+ * 避免wait4刚返回同一个PID就被新进程复用，用户还按旧PID操作时误伤新进程。
+ * PID用尽时提前放出FIFO中的PID。
+ * 以上由os_env.proc_lock保护，叶子页分配后不再释放。get_proc本身不加锁，
+ * 但proc_destroy先在proc_lock下释放PID再释放进程，要使用查到的进程，
+ * 需持有proc_lock直到拿到进程自己的锁。
+ */
+
+#define PID_L0_WORDS     (PID_MAX / 64)
+#define PID_L1_WORDS     ((PID_L0_WORDS + 63) / 64)
+#define PID_LEAF_ENTRIES (PG_SIZE / sizeof(proc_t *))
+#define PID_LEAVES       ((PID_MAX + PID_LEAF_ENTRIES - 1) / PID_LEAF_ENTRIES)
+
+_Static_assert(PID_MAX % 64 == 0 && PID_L1_WORDS <= 64,
+               "PID_MAX must be a multiple of 64 and not larger than 64^3.");
+_Static_assert(PID_MAX > MAX_PROC + PID_REUSE_DELAY && PID_REUSE_DELAY > 0,
+               "PID space too small for reuse delay.");
+
+static uint64_t pid_l0[PID_L0_WORDS]; // bit set if pid is used
+static uint64_t pid_l1[PID_L1_WORDS]; // bit set if l0 word is full
+static uint64_t pid_l2;               // bit set if l1 word is full
+static proc_t **pid_leaves[PID_LEAVES];
+static pid_t    pid_delayed[PID_REUSE_DELAY];
+static size_t   pid_delayed_head;
+static size_t   pid_delayed_count;
+// statistics
+static uint64_t pid_allocs;
+static uint64_t pid_drains;
+
+static void pid_mark(pid_t pid) {
+    size_t w0 = pid / 64;
+    pid_l0[w0] |= 1UL << (pid % 64);
+    if (pid_l0[w0] != ~0UL)
+        return;
+    pid_l1[w0 / 64] |= 1UL << (w0 % 64);
+    if (pid_l1[w0 / 64] == ~0UL)
+        pid_l2 |= 1UL << (w0 / 64);
+}
+
+static void pid_unmark(pid_t pid) {
+    size_t w0 = pid / 64;
+    pid_l0[w0] &= ~(1UL << (pid % 64));
+    pid_l1[w0 / 64] &= ~(1UL << (w0 % 64));
+    pid_l2 &= ~(1UL << (w0 / 64));
+}
+
+// Lowest free pid, 0 if none.
+static pid_t pid_find_free() {
+    if (pid_l2 == ~0UL)
+        return 0;
+    size_t w1 = ctz64(~pid_l2);
+    size_t w0 = w1 * 64 + ctz64(~pid_l1[w1]);
+    return (pid_t)(w0 * 64 + ctz64(~pid_l0[w0]));
+}
+
+static void pid_release_oldest() {
+    pid_unmark(pid_delayed[pid_delayed_head]);
+    pid_delayed_head = (pid_delayed_head + 1) % PID_REUSE_DELAY;
+    pid_delayed_count--;
+}
+
+void init_pid() {
+    // bits beyond PID_MAX are always full
+    for (size_t i = PID_L0_WORDS; i < PID_L1_WORDS * 64; i++)
+        pid_l1[i / 64] |= 1UL << (i % 64);
+    for (size_t i = PID_L1_WORDS; i < 64; i++)
+        pid_l2 |= 1UL << i;
+    // leave pid 0 alone
+    pid_mark(0);
+}
+
+// os_env.proc_lock must be held. Return 0 if no pid left.
+pid_t pid_alloc(proc_t *proc) {
+    pid_t pid = pid_find_free();
+    if (pid == 0 && pid_delayed_count) {
+        // running out, reuse delayed ones now
+        while (pid_delayed_count)
+            pid_release_oldest();
+        pid_drains++;
+        pid = pid_find_free();
+    }
+    if (pid == 0)
+        return 0;
+    proc_t **leaf = pid_leaves[pid / PID_LEAF_ENTRIES];
+    if (!leaf) {
+        leaf = (proc_t **)page_alloc(1, PAGE_TYPE_INUSE | PAGE_TYPE_SYSTEM |
+                                            PAGE_ALLOC_ZERO);
+        if (!leaf)
+            return 0;
+        // zeroed leaf visible before get_proc can see it
+        __sync_synchronize();
+        WRITE_ONCE(pid_leaves[pid / PID_LEAF_ENTRIES], leaf);
+    }
+    pid_mark(pid);
+    leaf[pid % PID_LEAF_ENTRIES] = proc;
+    pid_allocs++;
+    return pid;
+}
+
+// os_env.proc_lock must be held.
+void pid_free(pid_t pid) {
+    set_proc(pid, NULL);
+    if (pid_delayed_count == PID_REUSE_DELAY)
+        pid_release_oldest();
+    pid_delayed[(pid_delayed_head + pid_delayed_count) % PID_REUSE_DELAY] =
+        pid;
+    pid_delayed_count++;
+}
+
+proc_t *get_proc(pid_t pid) {
+    if (pid >= PID_MAX)
+        return NULL;
+    proc_t **leaf = READ_ONCE(pid_leaves[pid / PID_LEAF_ENTRIES]);
+    return leaf ? READ_ONCE(leaf[pid % PID_LEAF_ENTRIES]) : NULL;
+}
+
+void set_proc(pid_t pid, proc_t *proc) {
+    assert(pid < PID_MAX && pid_leaves[pid / PID_LEAF_ENTRIES],
+           "Set proc for unallocated pid.");
+    WRITE_ONCE(pid_leaves[pid / PID_LEAF_ENTRIES][pid % PID_LEAF_ENTRIES],
+               proc);
+}
+
+void print_pid_info() {
+    size_t leaves = 0;
+    for (size_t i = 0; i < PID_LEAVES; i++)
+        leaves += pid_leaves[i] != NULL;
+    kprintf("[PROC] PIDs allocated: %ld, delayed: %ld, drains: %ld, "
+            "leaf pages: %ld.\n",
+            pid_allocs, pid_delayed_count, pid_drains, leaves);
+}
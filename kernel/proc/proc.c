@@ -3,6 +3,7 @@
 #include <lib/elf.h>
 #include <lib/stdlib.h>
 #include <lib/string.h>
+#include <mm.h>
 #include <proc.h>
 #include <stddef.h>
 #include <trap.h>
@@ -10,7 +11,9 @@
 _Static_assert(sizeof(struct trap_context) == sizeof(uint64_t) * 31,
                "Trap context wrong.");
 
-static proc_t *proc_table[MAX_PROC] = {[0 ... MAX_PROC - 1] = NULL};
+KMEM_CACHE_DEFINE(proc_cache, "proc", proc_t);
+KMEM_CACHE_DEFINE(mm_cache, "mm", mm_t);
+KMEM_CACHE_DEFINE(fdtable_cache, "fdtable", fdtable_t);
 
 // for elf loader.
 static size_t memory_reader(void *data, uint64_t offset, char *target,
@@ -35,16 +38,17 @@ void setup_init_process() {
     if (!process_stack)
         kpanic("Cannot alloc %d page(s) to init process stack.", stack_pages);
     char *process_stack_top = (char *)(PROC_STACK_BASE - stack_pages * PG_SIZE);
-    map_pages(proc->page_dir, (void *)(process_stack_top), process_stack,
+    map_pages(proc->mm->page_dir, (void *)(process_stack_top), process_stack,
               PROC_STACK_SIZE, PTE_TYPE_RW, true, false);
     flush_tlb_all();
 
-    proc->trapframe.sp = (uintptr_t)PROC_STACK_BASE;
-    proc->stack_bottom = (char *)PROC_STACK_BASE;
-    proc->stack_top    = process_stack_top;
+    proc->trapframe.sp     = (uintptr_t)PROC_STACK_BASE;
+    proc->mm->stack_bottom = (char *)PROC_STACK_BASE;
+    proc->mm->stack_top    = process_stack_top;
     strcpy(proc->name, "init");
 
     proc->status |= PROC_STATUS_READY;
+    sched_enqueue(proc);
 
     spinlock_release(&proc->lock);
 }
@@ -56,91 +60,169 @@ void init_proc() {
         spinlock_init(&os_env.proc[i].lock);
     } */
     // leave proc 0 alone
-    set_bit(os_env.proc_bitmap, 0);
+    init_pid();
     os_env.proc_count++;
     spinlock_release(&os_env.proc_lock);
     // Setup init process as PID 1
     setup_init_process();
 }
 
+static mm_t *mm_alloc() {
+    mm_t *mm = (mm_t *)kmem_cache_alloc(&mm_cache);
+    if (!mm)
+        return NULL;
+    memset(mm, 0, sizeof(mm_t));
+    mm->page_dir = alloc_page_dir();
+    if (!mm->page_dir) {
+        kmem_cache_free(&mm_cache, mm);
+        return NULL;
+    }
+    mm->users = 1;
+    sleeplock_init(&mm->lock);
+    return mm;
+}
+
+// Drop proc's address space, free it if proc is the last user.
+static void mm_release(proc_t *proc) {
+    mm_t *mm = proc->mm;
+    if (__sync_sub_and_fetch(&mm->users, 1) != 0)
+        return;
+    // unmap all userspace
+    pde_t pagedir = mm->page_dir;
+    vma_free_all(proc);
+    unmap_pages(pagedir, mm->prog_image_start,
+                PG_ROUNDUP(mm->prog_size) / PG_SIZE, true);
+    unmap_pages(pagedir, mm->stack_top,
+                PG_ROUNDUP(mm->stack_bottom - (uintptr_t)mm->stack_top) /
+                    PG_SIZE,
+                true);
+    // destory pagedir
+    dealloc_page_dir(pagedir);
+    kmem_cache_free(&mm_cache, mm);
+}
+
+static fdtable_t *fdtable_alloc() {
+    fdtable_t *fdt = (fdtable_t *)kmem_cache_alloc(&fdtable_cache);
+    if (!fdt)
+        return NULL;
+    memset(fdt, 0, sizeof(fdtable_t));
+    fdt->ref = 1;
+    spinlock_init(&fdt->lock);
+    // open 0,1,2 all to /dev/tty
+    dentry_t *dentry      = vfs_get_dentry("/dev/tty", NULL);
+    file_t   *file_output = vfs_open(dentry, O_WRONLY);
+    file_t   *file_input  = vfs_open(dentry, O_RDONLY);
+    fdt->fd[0]            = file_input;
+    fdt->fd[1]            = file_output;
+    fdt->fd[2]            = vfs_fdup(file_output);
+    return fdt;
+}
+
+static void fdtable_release(fdtable_t *fdt) {
+    if (__sync_sub_and_fetch(&fdt->ref, 1) != 0)
+        return;
+    for (int i = 0; i < MAX_FILE_OPEN; i++) {
+        if (fdt->fd[i])
+            vfs_close(fdt->fd[i]);
+    }
+    kmem_cache_free(&fdtable_cache, fdt);
+}
+
+// Undo a proc_alloc_shared that failed after taking a pid, proc->lock is held.
+static void proc_alloc_abort(proc_t *proc) {
+    // proc_lock nests outside proc->lock
+    spinlock_release(&proc->lock);
+    if (proc->fdtable)
+        fdtable_release(proc->fdtable);
+    if (proc->mm)
+        mm_release(proc);
+    proc_destroy(proc);
+}
+
 // return process with locked
-proc_t *proc_alloc() {
+proc_t *proc_alloc() { return proc_alloc_shared(NULL, NULL); }
+
+// Same as proc_alloc, but share mm and fdtable if they are not NULL.
+proc_t *proc_alloc_shared(mm_t *mm, fdtable_t *fdtable) {
     // proc_t *proc = (proc_t *)kmalloc(sizeof(proc_t));
     // memset(proc, 0, sizeof(proc_t));
     proc_t *proc = NULL;
     spinlock_acquire(&os_env.proc_lock);
-    uint64_t pid = (uint64_t)set_first_unset_bit(
-        os_env.proc_bitmap,
-        (MAX_PROC / BITS_PER_BITSET) + (MAX_PROC % BITS_PER_BITSET ? 1 : 0));
-    if (unlikely(pid == 0xFFFFFFFFFFFFFFFF)) {
+    if (unlikely(os_env.proc_count >= MAX_PROC)) {
         spinlock_release(&os_env.proc_lock);
-        // kfree(proc);
         return NULL;
     }
     // proc = &os_env.proc[pid];
-    proc = (proc_t *)kmalloc(sizeof(proc_t));
+    proc = (proc_t *)kmem_cache_alloc(&proc_cache);
+    if (unlikely(!proc)) {
+        spinlock_release(&os_env.proc_lock);
+        return NULL;
+    }
     memset(proc, 0, sizeof(proc_t));
+    pid_t pid = pid_alloc(proc);
+    if (unlikely(pid == 0)) {
+        kmem_cache_free(&proc_cache, proc);
+        spinlock_release(&os_env.proc_lock);
+        return NULL;
+    }
     spinlock_init(&proc->lock);
     os_env.proc_count++;
     list_add(&proc->proc_list, &os_env.procs);
     spinlock_acquire(&proc->lock);
     spinlock_release(&os_env.proc_lock);
     proc->pid        = pid;
-    proc_table[pid]  = proc;
     proc->children   = (list_head_t)LIST_HEAD_INIT(proc->children);
+    wait_queue_init(&proc->child_wait);
     proc->start_tick = 0;
+    proc->sched_cpu  = (int)cpuid();
 
-    proc->kernel_stack =
-        page_alloc(PG_ROUNDUP(PROG_KSTACK_SIZE) / PG_SIZE, PAGE_TYPE_SYSTEM);
-    memset(proc->kernel_stack, 0, PG_SIZE);
+    // recycled stack with guard page below, freed by do_wait
+    proc->kernel_stack = kstack_alloc();
+    if (!proc->kernel_stack) {
+        proc_alloc_abort(proc);
+        return NULL;
+    }
     proc->kernel_stack_top = proc->kernel_stack + PG_ROUNDUP(PROG_KSTACK_SIZE);
     proc->kernel_sp        = proc->kernel_stack_top;
 
-    proc->page_dir = alloc_page_dir();
-    if (!proc->page_dir) {
-        spinlock_release(&proc->lock);
-        return NULL; // TODO: clean up
+    if (mm) {
+        __sync_fetch_and_add(&mm->users, 1);
+        proc->mm = mm;
+    } else if ((proc->mm = mm_alloc()) == NULL) {
+        proc_alloc_abort(proc);
+        return NULL;
     }
-    // open 0,1,2 all to /dev/tty
-    dentry_t *dentry      = vfs_get_dentry("/dev/tty", NULL);
-    file_t   *file_output = vfs_open(dentry, O_WRONLY);
-    file_t   *file_input  = vfs_open(dentry, O_RDONLY);
-    proc->files[0]        = file_input;
-    proc->files[1]        = file_output;
-    proc->files[2]        = vfs_fdup(file_output);
-    proc->status          = PROC_STATUS_NORMAL;
-    proc->cwd             = vfs_get_root();
+    if (fdtable) {
+        __sync_fetch_and_add(&fdtable->ref, 1);
+        proc->fdtable = fdtable;
+    } else if ((proc->fdtable = fdtable_alloc()) == NULL) {
+        proc_alloc_abort(proc);
+        return NULL;
+    }
+    proc->files  = proc->fdtable->fd;
+    proc->status = PROC_STATUS_NORMAL;
+    proc->cwd    = vfs_get_root();
 
     proc->kernel_task_context.sp = (uintptr_t)proc->kernel_sp;
     proc->kernel_task_context.ra = (uintptr_t)user_trap_return;
 
     // setup satp
-    uint64_t satp = ((uint64_t)proc->page_dir / PG_SIZE) |
+    uint64_t satp = ((uint64_t)proc->mm->page_dir / PG_SIZE) |
                     ((uint64_t)PAGING_MODE_SV39 << 60);
     proc->page_csr = satp;
 
     return proc;
 }
 
+// Drop proc's files and address space. Must be called without proc->lock,
+// the last user of mm writes back shared mappings and that sleeps.
 void proc_free(proc_t *proc) {
-    // must hold lock
-    assert(proc->lock.lock, "Proc free with unlocked.");
-    // TODO: free resource. walk pde and decreate reference count
     // free file
-    for (int i = 0; i < MAX_FILE_OPEN; i++) {
-        if (proc->files[i])
-            vfs_close(proc->files[i]);
-    }
-    // unmap all userspace
-    pde_t pagedir = proc->page_dir;
-    unmap_pages(pagedir, proc->prog_image_start,
-                PG_ROUNDUP(proc->prog_size) / PG_SIZE, true);
-    unmap_pages(pagedir, proc->stack_top,
-                PG_ROUNDUP(proc->stack_bottom - (uintptr_t)proc->stack_top) /
-                    PG_SIZE,
-                true);
-    // destory pagedir
-    dealloc_page_dir(pagedir);
+    fdtable_release(proc->fdtable);
+    proc->fdtable = NULL;
+    proc->files   = NULL;
+    mm_release(proc);
+    proc->mm = NULL;
 }
 
 // Return current CPU process.
@@ -150,8 +232,3 @@ proc_t *myproc() {
     trap_pop_off();
     return p;
 }
-
-// TODO: use rb tree to hold processes
-proc_t *get_proc(pid_t pid) { return proc_table[pid]; }
-
-void set_proc(pid_t pid, proc_t *proc) { proc_table[pid] = proc; }
\ No newline at end of file
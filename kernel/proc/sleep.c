@@ -3,40 +3,157 @@
 //
 
 #include <environment.h>
+#include <lib/sys/waitqueue.h>
 #include <proc.h>
+#include <scheduler.h>
+#include <smp_barrier.h>
+#include <timer.h>
 #include <trap.h>
 
-// lock is held when we call sleep
-void sleep(void *chan, spinlock_t *lock) {
-    proc_t *proc = myproc();
-    if (lock != &proc->lock) {
+/*
+ * 睡眠的进程挂在等待队列上，唤醒时只处理队列上的进程，不再扫描整个进程表。
+ * 管道、控制台、sleeplock、virtio和wait等有明确对象的地方使用各自的等待队列；
+ * 其余的sleep(chan)/wakeup(chan)按chan散列到固定数量的队列上，
+ * 唤醒时只检查同一个桶中的进程。
+ *
+ * 锁顺序：调用者的lock -> proc->lock -> wq->lock。进程在放开lock之前挂到队列上，
+ * 所以在lock保护下改变条件后再唤醒不会丢失唤醒。唤醒者先在wq->lock下把进程
+ * 从队列摘下，放开wq->lock之后再逐个加proc->lock改状态。只有摘下进程的
+ * 唤醒者会把它改为可运行，因此被摘下的进程在此之前不会运行，也不会再次挂入
+ * 队列。
+ * 带超时的睡眠在时间轮上挂一个定时器，到期时wake_proc只唤醒这一个进程，
+ * 如果进程已经被别的唤醒者摘下则什么都不做。
+ */
+
+#define WAIT_HASH_BITS 6
+#define WAIT_HASH_SIZE (1 << WAIT_HASH_BITS)
+#define WAIT_HASH(chan)                                                        \
+    ((((uintptr_t)(chan)) * 0x9E3779B97F4A7C15UL) >> (64 - WAIT_HASH_BITS))
+
+static wait_queue_t wait_table[WAIT_HASH_SIZE];
+
+void wait_queue_init(wait_queue_t *wq) {
+    spinlock_init(&wq->lock);
+    wq->sleepers = (list_head_t)LIST_HEAD_INIT(wq->sleepers);
+}
+
+void init_wait_table() {
+    for (int i = 0; i < WAIT_HASH_SIZE; i++)
+        wait_queue_init(&wait_table[i]);
+}
+
+static void sleep_timeout(ktimer_t *timer) {
+    wake_proc((proc_t *)timer->data);
+}
+
+// lock is held when we call sleep, expires is 0 for no timeout.
+// Return false if timed out.
+static bool sleep_chan(wait_queue_t *wq, void *chan, spinlock_t *lock,
+                       uint64_t expires) {
+    proc_t  *proc = myproc();
+    ktimer_t timer;
+    if (lock != &proc->lock)
         spinlock_acquire(&proc->lock);
-        spinlock_release(lock);
-    }
     proc->waiting_chan = chan;
     proc->status &= ~(PROC_STATUS_RUNNING | PROC_STATUS_READY);
     proc->status |= PROC_STATUS_WAITING;
+    spinlock_acquire(&wq->lock);
+    list_add_tail(&proc->wait_list, &wq->sleepers);
+    proc->wait_queue = wq;
+    spinlock_release(&wq->lock);
+    if (expires) {
+        // fn takes proc->lock, so it can't fire before we are asleep
+        timer_init(&timer, sleep_timeout, proc);
+        timer_add(&timer, expires);
+    }
+    if (lock != &proc->lock)
+        spinlock_release(lock);
     spinlock_release(&proc->lock);
     yield();
+    bool timed_out = expires && !timer_cancel(&timer);
     spinlock_acquire(&proc->lock);
+    // normally unlinked by the waker already
+    spinlock_acquire(&wq->lock);
+    if (proc->wait_queue == wq) {
+        list_del(&proc->wait_list);
+        proc->wait_queue = NULL;
+    }
+    spinlock_release(&wq->lock);
     proc->waiting_chan = NULL;
     if (lock != &proc->lock) {
         spinlock_release(&proc->lock);
         spinlock_acquire(lock);
     }
+    return !timed_out;
 }
 
-void wakeup(void *chan) {
-    spinlock_acquire(&os_env.proc_lock);
-    list_foreach_entry(&os_env.procs, proc_t, proc_list, proc) {
-        assert(proc, "Process must be valid.");
+static void wake_chan(wait_queue_t *wq, void *chan) {
+    // sleepers link themselves before releasing the lock of the condition,
+    // so an empty queue seen here has nobody to wake.
+    if (READ_ONCE(wq->sleepers.next) == &wq->sleepers)
+        return;
+    LIST_HEAD(woken);
+    spinlock_acquire(&wq->lock);
+    list_head_t *node = wq->sleepers.next;
+    while (node != &wq->sleepers) {
+        list_head_t *next = node->next;
+        proc_t      *proc = container_of(node, proc_t, wait_list);
+        if (proc->waiting_chan == chan) {
+            list_del(node);
+            list_add_tail(node, &woken);
+            proc->wait_queue = NULL;
+        }
+        node = next;
+    }
+    spinlock_release(&wq->lock);
+    while (woken.next != &woken) {
+        proc_t *proc = container_of(woken.next, proc_t, wait_list);
+        list_del(woken.next);
         spinlock_acquire(&proc->lock);
-        if (proc->status & PROC_STATUS_WAITING && proc->waiting_chan == chan) {
+        if (proc->status & PROC_STATUS_WAITING) {
             proc->status &= ~(PROC_STATUS_WAITING);
             proc->status |= (PROC_STATUS_READY | PROC_STATUS_NORMAL);
-            // TODO: schedule the waiting process first.
+            sched_enqueue(proc);
         }
         spinlock_release(&proc->lock);
     }
-    spinlock_release(&os_env.proc_lock);
 }
+
+// Wake proc from whatever it sleeps on.
+void wake_proc(proc_t *proc) {
+    spinlock_acquire(&proc->lock);
+    wait_queue_t *wq     = proc->wait_queue;
+    bool          linked = false;
+    if (wq) {
+        spinlock_acquire(&wq->lock);
+        if (proc->wait_queue == wq) {
+            list_del(&proc->wait_list);
+            proc->wait_queue = NULL;
+            linked           = true;
+        }
+        spinlock_release(&wq->lock);
+    }
+    // if a waker has unlinked it, leave it to the waker
+    if (linked && (proc->status & PROC_STATUS_WAITING)) {
+        proc->status &= ~(PROC_STATUS_WAITING);
+        proc->status |= (PROC_STATUS_READY | PROC_STATUS_NORMAL);
+        sched_enqueue(proc);
+    }
+    spinlock_release(&proc->lock);
+}
+
+void sleep_on(wait_queue_t *wq, spinlock_t *lock) {
+    sleep_chan(wq, wq, lock, 0);
+}
+
+bool sleep_on_timeout(wait_queue_t *wq, spinlock_t *lock, uint64_t expires) {
+    return sleep_chan(wq, wq, lock, expires);
+}
+
+void wake_up(wait_queue_t *wq) { wake_chan(wq, wq); }
+
+void sleep(void *chan, spinlock_t *lock) {
+    sleep_chan(&wait_table[WAIT_HASH(chan)], chan, lock, 0);
+}
+
+void wakeup(void *chan) { wake_chan(&wait_table[WAIT_HASH(chan)], chan); }
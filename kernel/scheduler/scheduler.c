@@ -2,54 +2,269 @@
 // Created by shiroko on 22-5-1.
 //
 
+#include <driver/console.h>
 #include <environment.h>
 #include <lib/sys/spinlock.h>
 #include <proc.h>
 #include <riscv.h>
 #include <scheduler.h>
+#include <smp_barrier.h>
+
+/*
+ * 每个CPU一个运行队列，队列中只有可运行且不在CPU上的进程。
+ * 参考Linux CFS，进程按vruntime(按nice加权的运行时间)排序，放在以vruntime为
+ * key的红黑树中，并缓存最左节点，每次选vruntime最小的进程运行。nice越小权重
+ * 越大，同样的运行时间vruntime增长越慢，分到的CPU时间越多。
+ * 时钟中断时，当前进程运行超过SCHED_MIN_GRANULARITY且队列中有vruntime更小的
+ * 进程就让出CPU；睡眠的进程唤醒时vruntime至少为min_vruntime减去
+ * SCHED_SLEEPER_CREDIT，比当前进程小得多时立即抢占，所以交互和IO进程不会被
+ * 计算密集的进程饿死，睡眠也不能无限积攒vruntime。
+ *
+ * 进程变为可运行时(唤醒、fork)入队到它上次运行的CPU，被选中时出队；
+ * 在CPU上运行的进程不在队列中，切换回调度器后如果仍可运行再放回队列。
+ * 自己的队列为空时从其他CPU的队列偷取vruntime最大的进程，vruntime按两个
+ * 队列的min_vruntime换算；自己空闲而别的CPU排队时，时钟中断也会让当前进程
+ * 让出CPU去偷取，避免负载长期不均。
+ *
+ * proc->sched_state从IDLE到QUEUED、从ONCPU到IDLE都持有proc->lock，
+ * 从QUEUED到ONCPU持有运行队列的锁。唤醒时进程可能还没切换出去(ONCPU)，
+ * 这时不入队，由调度器在它切换出去后放回队列，避免同一进程在两个CPU上运行。
+ * 进程在CPU上时vruntime、exec_start等只由该CPU修改。
+ * 锁顺序：proc->lock先于rq->lock，任何时候最多持有一个rq->lock。
+ */
 
-// 简易的轮换调度实现
-// TODO: More flexable scheduler
-proc_t *scheduler(scheduler_data_t *data) {
-    proc_t *ret_proc = NULL;
 #define PROC_RUNNABLE (PROC_STATUS_READY | PROC_STATUS_NORMAL)
-    // 锁定进程表
-    spinlock_acquire(&os_env.proc_lock);
-    // 锁定调度器数据
-    spinlock_acquire(&data->lock);
-
-    if (data->last_scheduled_proc) {
-        list_foreach_entry(&data->last_scheduled_proc->proc_list, proc_t,
-                           proc_list, proc) {
-            if (&proc->proc_list == &os_env.procs)
-                break;
-            spinlock_acquire(&proc->lock);
-            if (((proc->status & PROC_RUNNABLE) == PROC_RUNNABLE) &&
-                (proc->status & PROC_STATUS_RUNNING) == 0) {
-                // Normal ready but not running, Could be scheduled
-                ret_proc                  = proc; // with lock
-                data->last_scheduled_proc = proc;
-                goto ret;
-            }
-            spinlock_release(&proc->lock);
+#define IS_RUNNABLE(proc)                                                      \
+    (((proc)->status & PROC_RUNNABLE) == PROC_RUNNABLE &&                      \
+     ((proc)->status & PROC_STATUS_RUNNING) == 0)
+#define RUN_OF(n) container_of(n, proc_t, run_node)
+
+// Same as Linux, every nice level is about 10% of cpu time.
+static const uint32_t nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548,  7620,  6100,  4904,  3906,
+    /*  -5 */ 3121,  2501,  1991,  1586,  1277,
+    /*   0 */ 1024,  820,   655,   526,   423,
+    /*   5 */ 335,   272,   215,   172,   137,
+    /*  10 */ 110,   87,    70,    56,    45,
+    /*  15 */ 36,    29,    23,    18,    15,
+};
+
+void init_scheduler(scheduler_data_t *data) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        struct run_queue *rq = &data->rq[i];
+        spinlock_init(&rq->lock);
+        rq->tasks.root   = NULL;
+        rq->leftmost     = NULL;
+        rq->count        = 0;
+        rq->min_vruntime = 0;
+        rq->need_resched = false;
+        rq->pull         = false;
+    }
+}
+
+static inline struct run_queue *this_rq() {
+    return &os_env.scheduler_data.rq[cpuid()];
+}
+
+// Charge the time since last accounting to proc, proc must be on this cpu.
+static void update_curr(proc_t *proc) {
+    uint64_t now     = cpu_cycle();
+    uint64_t delta   = now - proc->exec_start;
+    proc->exec_start = now;
+    proc->sum_exec += delta;
+    uint32_t weight = nice_to_weight[proc->nice - NICE_MIN];
+    if (weight != NICE_0_WEIGHT)
+        delta = delta * NICE_0_WEIGHT / weight;
+    proc->vruntime += delta;
+}
+
+// rq->lock must be held.
+static void rq_insert(struct run_queue *rq, proc_t *proc) {
+    // equal vruntime is rare, just make it a little larger
+    proc->run_node.key = proc->vruntime;
+    while (rb_insert(&rq->tasks, &proc->run_node) != NULL)
+        proc->run_node.key = ++proc->vruntime;
+    if (!rq->leftmost || proc->run_node.key < rq->leftmost->key)
+        rq->leftmost = &proc->run_node;
+    rq->count++;
+    proc->sched_state = SCHED_QUEUED;
+}
+
+// rq->lock must be held.
+static void rq_remove(struct run_queue *rq, proc_t *proc) {
+    if (rq->leftmost == &proc->run_node)
+        rq->leftmost = rb_succ(rq->leftmost);
+    rb_remove(&rq->tasks, &proc->run_node);
+    rq->count--;
+    proc->sched_state = SCHED_ONCPU;
+}
+
+// rq->lock must be held. curr is vruntime of the proc on cpu.
+static void update_min_vruntime(struct run_queue *rq, uint64_t curr) {
+    if (rq->leftmost && rq->leftmost->key < curr)
+        curr = rq->leftmost->key;
+    if (curr > rq->min_vruntime)
+        rq->min_vruntime = curr;
+}
+
+// rq->lock must be held. Lowest vruntime a woken proc may start from.
+static uint64_t sleeper_floor(struct run_queue *rq) {
+    return rq->min_vruntime > SCHED_SLEEPER_CREDIT
+               ? rq->min_vruntime - SCHED_SLEEPER_CREDIT
+               : 0;
+}
+
+static void enqueue(proc_t *proc, bool wakeup) {
+    assert(proc->lock.lock, "Enqueue with proc unlocked.");
+    if (proc->sched_state != SCHED_IDLE || !IS_RUNNABLE(proc))
+        return;
+    struct run_queue *rq = &os_env.scheduler_data.rq[proc->sched_cpu];
+    spinlock_acquire(&rq->lock);
+    if (wakeup) {
+        // don't let sleepers bank vruntime
+        uint64_t floor = sleeper_floor(rq);
+        if (proc->vruntime < floor)
+            proc->vruntime = floor;
+    }
+    rq_insert(rq, proc);
+    spinlock_release(&rq->lock);
+
+    if (wakeup && rq == this_rq()) {
+        proc_t *curr = mycpu()->proc;
+        if (curr && curr != proc && (curr->status & PROC_STATUS_RUNNING) &&
+            proc->vruntime + SCHED_WAKEUP_GRANULARITY < curr->vruntime)
+            rq->need_resched = true;
+    }
+}
+
+void sched_enqueue(proc_t *proc) { enqueue(proc, true); }
+
+void sched_switched_out(proc_t *proc) {
+    assert(proc->lock.lock, "Switched out with proc unlocked.");
+    assert(proc->sched_state == SCHED_ONCPU, "Proc is not on cpu.");
+    update_curr(proc);
+    proc->sched_state = SCHED_IDLE;
+    enqueue(proc, false);
+    // do_wait sleeps under our lock until an exited child is off the cpu.
+    // the parent can't go away before it gets our lock to reparent us.
+    if (proc->status == PROC_STATUS_STOP && !proc->thread)
+        wake_up(&proc->parent->child_wait);
+}
+
+// Return true if any other cpu has at least min_count queued.
+static bool others_busy(scheduler_data_t *data, int self, size_t min_count) {
+    for (int i = 1; i < MAX_CPUS; i++)
+        if (READ_ONCE(data->rq[(self + i) % MAX_CPUS].count) >= min_count)
+            return true;
+    return false;
+}
+
+bool sched_tick(proc_t *proc) {
+    scheduler_data_t *data = &os_env.scheduler_data;
+    int               self = (int)cpuid();
+    struct run_queue *rq   = &data->rq[self];
+    bool              ran  = false, preempt = false;
+
+    update_curr(proc);
+    ran = proc->sum_exec - proc->prev_sum_exec >= SCHED_MIN_GRANULARITY;
+    spinlock_acquire(&rq->lock);
+    update_min_vruntime(rq, proc->vruntime);
+    if (ran && rq->leftmost && rq->leftmost->key < proc->vruntime)
+        preempt = true;
+    spinlock_release(&rq->lock);
+    if (ran && !preempt && READ_ONCE(rq->count) == 0 &&
+        others_busy(data, self, 2)) {
+        // let scheduler steal one, current one waits in our queue
+        rq->pull = true;
+        preempt  = true;
+    }
+    if (preempt)
+        rq->preempts++;
+    return preempt || rq->need_resched;
+}
+
+bool sched_need_resched() { return this_rq()->need_resched; }
+
+// Steal the process with largest vruntime from the other cpu which has at
+// least min_count queued. vruntime is converted to our queue.
+static proc_t *steal(scheduler_data_t *data, int self, size_t min_count) {
+    for (int i = 1; i < MAX_CPUS; i++) {
+        struct run_queue *rq = &data->rq[(self + i) % MAX_CPUS];
+        // peek without lock, don't bother idle cpus
+        if (READ_ONCE(rq->count) < min_count)
+            continue;
+        proc_t  *proc = NULL;
+        uint64_t base = 0;
+        spinlock_acquire(&rq->lock);
+        if (rq->count >= min_count) {
+            proc = RUN_OF(rb_last(rq->tasks.root));
+            base = rq->min_vruntime;
+            rq_remove(rq, proc);
+        }
+        spinlock_release(&rq->lock);
+        if (proc) {
+            // picked proc is ONCPU, only we touch it. A woken one may sit
+            // below base, keep the offset signed and clamp it like enqueue,
+            // our min_vruntime can be smaller than the gap.
+            struct run_queue *own   = &data->rq[self];
+            long              delta = (long)(proc->vruntime - base);
+            spinlock_acquire(&own->lock);
+            uint64_t floor = sleeper_floor(own);
+            if (delta < 0 && (uint64_t)-delta > own->min_vruntime - floor)
+                proc->vruntime = floor;
+            else
+                proc->vruntime = own->min_vruntime + delta;
+            spinlock_release(&own->lock);
+            return proc;
         }
     }
+    return NULL;
+}
 
-    list_foreach_entry(&os_env.procs, proc_t, proc_list, proc) {
-        spinlock_acquire(&proc->lock);
-        if (((proc->status & PROC_RUNNABLE) == PROC_RUNNABLE) &&
-            (proc->status & PROC_STATUS_RUNNING) == 0) {
-            // Normal ready but not running, Could be scheduled
-            ret_proc                  = proc; // with lock
-            data->last_scheduled_proc = proc;
-            goto ret;
+proc_t *scheduler(scheduler_data_t *data) {
+    int               self = (int)cpuid();
+    struct run_queue *rq   = &data->rq[self];
+    proc_t           *proc = NULL;
+
+    rq->need_resched = false;
+    if (rq->pull) {
+        rq->pull = false;
+        if ((proc = steal(data, self, 2)) != NULL)
+            rq->steals++;
+    }
+    if (!proc && READ_ONCE(rq->count)) {
+        spinlock_acquire(&rq->lock);
+        if (rq->leftmost) {
+            proc = RUN_OF(rq->leftmost);
+            rq_remove(rq, proc);
+            update_min_vruntime(rq, proc->vruntime);
         }
-        spinlock_release(&proc->lock);
-        if (proc == data->last_scheduled_proc)
-            break;
-    }
-ret:
-    spinlock_release(&data->lock);
-    spinlock_release(&os_env.proc_lock);
-    return ret_proc;
+        spinlock_release(&rq->lock);
+    }
+    if (!proc) {
+        if ((proc = steal(data, self, 1)) == NULL)
+            return NULL;
+        rq->steals++;
+    }
+    // picked proc is ONCPU now, nobody else would touch its scheduling state
+    spinlock_acquire(&proc->lock);
+    proc->sched_cpu     = self;
+    proc->exec_start    = cpu_cycle();
+    proc->prev_sum_exec = proc->sum_exec;
+    rq->picks++;
+    return proc;
+}
+
+void print_scheduler_info() {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        struct run_queue *rq = &os_env.scheduler_data.rq[i];
+        if (rq->picks == 0 && rq->count == 0)
+            continue;
+        kprintf("[SCHED] CPU %d: %ld queued, %ld picks, %ld steals, %ld "
+                "preempts, min_vruntime %ld.\n",
+                i, rq->count, rq->picks, rq->steals, rq->preempts,
+                rq->min_vruntime);
+    }
 }
@@ -4,6 +4,7 @@
 
 #include <environment.h>
 #include <lib/string.h>
+#include <timer.h>
 
 env_t os_env;
 
@@ -17,8 +18,12 @@ void init_env() {
         (list_head_t)LIST_HEAD_INIT(os_env.driver_list_head);
     os_env.mem_sysmaps = (list_head_t)LIST_HEAD_INIT(os_env.mem_sysmaps);
     os_env.procs       = (list_head_t)LIST_HEAD_INIT(os_env.procs);
-    /* Boot stack:
-     * boot_stack |  hart 1    | hart 0    | boot_sp
+    init_scheduler(&os_env.scheduler_data);
+    init_wait_table();
+    init_futex();
+    init_timer_wheels();
+    /* Boot stack, 64KB for each hart:
+     * boot_stack | hart 0 | hart 1 | ... | hart MAX_CPUS - 1 | boot_sp
      */
     extern char boot_stack;
     extern char boot_sp;
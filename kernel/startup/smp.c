@@ -0,0 +1,102 @@
+#include <configs.h>
+#include <driver/console.h>
+#include <environment.h>
+#include <lib/stdlib.h>
+#include <lib/string.h>
+#include <lib/sys/SBI.h>
+#include <lib/sys/fdt.h>
+#include <riscv.h>
+#include <smp_barrier.h>
+
+/*
+ * 多核启动：FDT的cpus节点中每个状态可用的cpu@N记录在os_env.hart_mask中，
+ * 引导核初始化完成后通过SBI HSM扩展逐个启动其他hart，它们同样从_start进入
+ * kernel_main，切换到内核页表、初始化各自的trap和时钟后进入调度循环。
+ * SBI不支持HSM(或一次放出了所有hart)时，其他hart已经在kernel_main中等待。
+ * hartid不小于MAX_CPUS的hart在_start中停住。
+ */
+
+extern char _start[];
+
+static int cpus_fdt_prober(uint32_t version, const char *node_name,
+                           const char *begin, uint32_t addr_cells,
+                           uint32_t size_cells, const char *strings) {
+    const char *p = begin;
+    uint32_t    tag;
+    int         depth     = 0; // depth below cpus node
+    uint32_t    cpu_cells = 1; // #address-cells of cpus node
+    bool        is_cpu    = false;
+    bool        okay      = true;
+    uint64_t    hartid    = 0xFFFFFFFF;
+    while ((tag = FDT_OFFSET_32(p, 0)) != FDT_END_NODE || depth != 0) {
+        p += 4;
+        switch (tag) {
+        case FDT_BEGIN_NODE: {
+            const char *str = p;
+            p               = PALIGN(p + strlen(str) + 1, 4);
+            if (++depth == 1) {
+                is_cpu = memcmp(str, "cpu@", 4) == 0;
+                okay   = true;
+                hartid = 0xFFFFFFFF;
+            }
+            break;
+        }
+        case FDT_END_NODE:
+            if (depth-- == 1 && is_cpu && okay && hartid < MAX_CPUS) {
+                kprintf("[FDT] Detected CPU with hart id %ld.\n", hartid);
+                os_env.hart_mask |= 1UL << hartid;
+            }
+            break;
+        case FDT_NOP:
+            break;
+        case FDT_PROP: {
+            uint32_t size = FDT_OFFSET_32(p, 0);
+            p += 4;
+            const char *str = strings + FDT_OFFSET_32(p, 0);
+            p += 4;
+            if (version < 16 && size >= 8)
+                p = PALIGN(p, 8);
+            const char *p_value = p;
+
+            p = PALIGN(p + size, 4);
+            if (depth == 0 && strcmp(str, "#address-cells") == 0)
+                cpu_cells = FDT_OFFSET_32(p_value, 0);
+            else if (depth == 1 && is_cpu && strcmp(str, "reg") == 0)
+                hartid = FDT_OFFSET_32(p_value, 4 * (cpu_cells - 1));
+            else if (depth == 1 && is_cpu && strcmp(str, "status") == 0)
+                okay = strcmp(p_value, "okay") == 0 ||
+                       strcmp(p_value, "ok") == 0;
+            break;
+        }
+        default:
+            kpanic("Unknown FDT Tag Note: 0x%08x.\n", tag);
+            break;
+        }
+    }
+    return (int)(p - begin);
+}
+
+static fdt_prober prober = {.name = "cpus", .prober = cpus_fdt_prober};
+
+ADD_FDT_PROBER(prober);
+
+// Called after init_fdt.
+void init_smp() {
+    if (os_env.hart_mask == 0) {
+        kprintf("[SMP] No CPU in FDT, assume %d harts.\n", HART_COUNT);
+        os_env.hart_mask = (1UL << HART_COUNT) - 1;
+    }
+    os_env.hart_mask |= 1UL << cpuid();
+}
+
+// Called by boot hart (os_env.boot_hart) after initialization.
+void start_harts() {
+    for (uint64_t hart = 0; hart < MAX_CPUS; hart++) {
+        if (hart == cpuid() || !(os_env.hart_mask & (1UL << hart)))
+            continue;
+        long ret = SBI_hart_start(hart, (uintptr_t)_start, 0);
+        if (ret != 0 && ret != SBI_ERR_ALREADY_AVAILABLE &&
+            ret != SBI_ERR_NOT_SUPPORTED)
+            kprintf("[SMP] Failed to start hart %ld: %ld.\n", hart, ret);
+    }
+}
@@ -17,14 +17,17 @@ _Static_assert(sizeof(void *) == sizeof(uint64_t), "Target must be 64bit.");
 
 volatile static int started = 0;
 
-_Noreturn void kernel_main(uint64_t hartid, struct fdt_header *fdt_addr) {
+// boot is true on the hart that won the race in _start, not always hart 0.
+_Noreturn void kernel_main(uint64_t hartid, struct fdt_header *fdt_addr,
+                           bool boot) {
     set_cpuid(hartid);
-    if (cpuid() == 0) {
+    if (boot) {
         kprintf("-*-*-*-*-*-*-*-*-*-*- My First Touch To RISC-V Starts "
                 "Here... -*-*-*-*-*-*-*-*-*-*-\n");
         kprintf("Kernel code from %lp to %lp.\n", KERN_CODE_START,
                 KERN_CODE_END);
         init_env();
+        os_env.boot_hart = hartid;
         init_trap();
 
         // 从Device Tree中保存一些我们需要的信息，
@@ -35,6 +38,7 @@ _Noreturn void kernel_main(uint64_t hartid, struct fdt_header *fdt_addr) {
         // init_fdt会遍历DTB中所有的子节点并从已经添加的FDT Prober中选择相应的
         // prober函数来进行调用。
         init_fdt(fdt_addr);
+        init_smp();
 
         init_memory();
         init_plic();
@@ -51,19 +55,22 @@ _Noreturn void kernel_main(uint64_t hartid, struct fdt_header *fdt_addr) {
             uint64_t mask = 1 << i;
             SBI_send_ipi(&mask);
         }
-        __sync_synchronize();
 #endif
+        __sync_synchronize();
         started = 1;
+        start_harts();
     } else {
-        // Salve cores
-#if 1
-        while (1)
-            ;
-#endif
+        // Salve cores, started by start_harts(), or released by SBI together
+        // with boot core and wait here.
         while (!started)
             ;
+        __sync_synchronize();
+        CSR_Write(satp, os_env.kernel_satp);
+        flush_tlb_all();
         init_trap();
     }
+    __sync_fetch_and_or(&os_env.online_mask, 1UL << cpuid());
+    kprintf("[SMP] Hart %d online.\n", cpuid());
 
     // kprintf("[%d] Initialization complete, start running.\n", cpuid());
     assert(mycpu()->trap_off_depth == 0, "CPU enter scheduler with trap off.");
@@ -89,16 +96,20 @@ _Noreturn void kernel_main(uint64_t hartid, struct fdt_header *fdt_addr) {
             spinlock_release(&proc->lock);
             return_to_cpu_process();
             // After process invoke yield, they returned here
-            // without lock
+            // without lock, put it back to run queue if still runnable
+            spinlock_acquire(&proc->lock);
+            sched_switched_out(proc);
+            spinlock_release(&proc->lock);
             mycpu()->proc = NULL;
         } else {
             mycpu()->proc = NULL;
             // switch to kernel paging table
+            // kernel mappings are global, ASID tagged user ones stay valid
             CSR_Write(satp, os_env.kernel_satp);
-            flush_tlb_all();
             enable_trap();
-            asm volatile("wfi");
-            ;
+            // nothing to run, prepare zeroed pages before sleeping
+            if (page_zero_idle() == 0)
+                asm volatile("wfi");
         }
     }
 }
\ No newline at end of file
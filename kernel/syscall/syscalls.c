@@ -7,9 +7,12 @@
 #include <lib/stdlib.h>
 #include <lib/string.h>
 #include <lib/sys/spinlock.h>
+#include <mm.h>
+#include <smp_barrier.h>
 #include <stddef.h>
 #include <sys_structs.h>
 #include <syscall.h>
+#include <timer.h>
 #include <trap.h>
 #include <vfs.h>
 
@@ -27,19 +30,7 @@ sysret_t sys_ticks(struct trap_context *trapframe) {
 }
 
 sysret_t sys_sleep(struct trap_context *trapframe) {
-    uint64_t t     = (uint64_t)trapframe->a0;
-    uint64_t ticks = 0;
-    spinlock_acquire(&os_env.ticks_lock);
-    ticks = os_env.ticks;
-    while (os_env.ticks - ticks < t) {
-        if (myproc()->status & PROC_STATUS_STOP) {
-            spinlock_release(&os_env.ticks_lock);
-            return -1;
-        }
-        sleep(&os_env.ticks, &os_env.ticks_lock);
-    }
-    spinlock_release(&os_env.ticks_lock);
-    return 0;
+    return sleep_ticks((uint64_t)trapframe->a0);
 }
 
 sysret_t sys_open(struct trap_context *trapframe) {
@@ -69,24 +60,29 @@ sysret_t sys_open(struct trap_context *trapframe) {
     file_t *file = vfs_open(dentry, mode);
     if (!file)
         return -1;
-    file_t **ftable = myproc()->files;
+    fdtable_t *fdt = myproc()->fdtable;
+    spinlock_acquire(&fdt->lock);
     for (int i = 3; i < MAX_FILE_OPEN; i++) {
-        if (ftable[i] == NULL) {
-            ftable[i] = file;
+        if (fdt->fd[i] == NULL) {
+            fdt->fd[i] = file;
+            spinlock_release(&fdt->lock);
             return i;
         }
     }
+    spinlock_release(&fdt->lock);
     vfs_close(file);
     return -1;
 }
 
 sysret_t sys_close(struct trap_context *trapframe) {
-    int     fd   = (int)(trapframe->a0 & 0xFFFFFFFF);
-    proc_t *proc = myproc();
-    file_t *file = proc->files[fd];
+    int        fd  = (int)(trapframe->a0 & 0xFFFFFFFF);
+    fdtable_t *fdt = myproc()->fdtable;
+    spinlock_acquire(&fdt->lock);
+    file_t *file = fdt->fd[fd];
+    fdt->fd[fd]  = NULL;
+    spinlock_release(&fdt->lock);
     if (file) {
         vfs_close(file);
-        proc->files[fd] = NULL;
         return 0;
     } else {
         return -1;
@@ -94,26 +90,60 @@ sysret_t sys_close(struct trap_context *trapframe) {
     return 0;
 }
 
+// Take a reference to fd's file, another thread may close it meanwhile.
+static file_t *fd_get(int fd) {
+    if (fd < 0 || fd >= MAX_FILE_OPEN)
+        return NULL;
+    fdtable_t *fdt = myproc()->fdtable;
+    spinlock_acquire(&fdt->lock);
+    file_t *file = fdt->fd[fd];
+    if (file)
+        vfs_fdup(file);
+    spinlock_release(&fdt->lock);
+    return file;
+}
+
+static int do_read(file_t *file, char *buf, size_t bytes) {
+    // copy straight from fs cache to user buffer
+    if (file->f_op && file->f_op->user_buffer)
+        return vfs_read(file, buf, 0, bytes);
+    // large buffers are backed by whole pages inside kmalloc
+    char *kbuf = (char *)kmalloc(bytes);
+    if (!kbuf)
+        return -1;
+    int r = vfs_read(file, kbuf, 0, bytes);
+    if (r > 0 && copy_to_user(buf, kbuf, r) != 0)
+        r = -1;
+    kfree(kbuf);
+    return r;
+}
+
+static int do_write(file_t *file, const char *buf, size_t bytes) {
+    if (file->f_op && file->f_op->user_buffer)
+        return vfs_write(file, buf, 0, bytes);
+    char *kbuf = (char *)kmalloc(bytes);
+    if (!kbuf)
+        return -1;
+    if (copy_from_user(kbuf, buf, bytes) != 0) {
+        kfree(kbuf);
+        return -1;
+    }
+    int r = vfs_write(file, kbuf, 0, bytes);
+    kfree(kbuf);
+    return r;
+}
+
 sysret_t sys_read(struct trap_context *trapframe) {
     int     fd    = (int)(trapframe->a0 & 0xFFFFFFFF);
     char   *buf   = (char *)(trapframe->a1);
     size_t  bytes = (size_t)(trapframe->a2);
-    file_t *file  = myproc()->files[fd];
-    if (!file)
+    if (!user_access_ok(buf, bytes))
         return -1;
-    char *kbuf = NULL;
-    if (bytes < PG_SIZE)
-        kbuf = (char *)kmalloc(bytes);
-    else
-        kbuf = (char *)page_alloc(PG_ROUNDUP(bytes), PAGE_TYPE_SYSTEM);
-    if (!kbuf)
+    file_t *file = fd_get(fd);
+    if (!file)
         return -1;
-    int r = vfs_read(file, kbuf, 0, bytes);
-    umemcpy(buf, kbuf, bytes);
-    if (bytes < PG_SIZE)
-        kfree(kbuf);
-    else
-        page_free(kbuf, PG_ROUNDUP(bytes));
+    int r = do_read(file, buf, bytes);
+    vfs_close(file);
     return r;
 }
 
@@ -121,22 +151,13 @@ sysret_t sys_write(struct trap_context *trapframe) {
     int         fd    = (int)(trapframe->a0 & 0xFFFFFFFF);
     const char *buf   = (const char *)(trapframe->a1);
     size_t      bytes = (size_t)(trapframe->a2);
-    file_t     *file  = myproc()->files[fd];
-    if (!file)
+    if (!user_access_ok(buf, bytes))
         return -1;
-    char *kbuf = NULL;
-    if (bytes < PG_SIZE)
-        kbuf = (char *)kmalloc(bytes);
-    else
-        kbuf = (char *)page_alloc(PG_ROUNDUP(bytes), PAGE_TYPE_SYSTEM);
-    if (!kbuf)
+    file_t *file = fd_get(fd);
+    if (!file)
         return -1;
-    umemcpy(kbuf, buf, bytes);
-    int r = vfs_write(file, kbuf, 0, bytes);
-    if (bytes < PG_SIZE)
-        kfree(kbuf);
-    else
-        page_free(kbuf, PG_ROUNDUP(bytes));
+    int r = do_write(file, buf, bytes);
+    vfs_close(file);
     return r;
 }
 
@@ -155,18 +176,28 @@ sysret_t sys_lseek(struct trap_context *trapframe) {
 }
 
 sysret_t sys_clone(struct trap_context *trapframe) {
-    int   flags = (int)trapframe->a0;
-    char *stack = (char *)trapframe->a1;
-    int   ptid  = (int)trapframe->a2;
-    int   tls   = (int)trapframe->a3;
-    int   ctid  = (int)trapframe->a4;
-    if (flags == SIGCHLD) {
-        proc_t *parent = myproc();
-        return do_fork(parent, stack);
-    } else {
-        // TODO: impl this
+    int       flags = (int)trapframe->a0;
+    char     *stack = (char *)trapframe->a1;
+    int      *ptid  = (int *)trapframe->a2;
+    uintptr_t tls   = (uintptr_t)trapframe->a3;
+    int      *ctid  = (int *)trapframe->a4;
+    return do_clone(myproc(), flags, stack, ptid, tls, ctid);
+}
+
+sysret_t sys_futex(struct trap_context *trapframe) {
+    uint32_t        *uaddr   = (uint32_t *)trapframe->a0;
+    int              op      = (int)trapframe->a1 & ~FUTEX_PRIVATE_FLAG;
+    uint32_t         val     = (uint32_t)trapframe->a2;
+    struct timespec *uts     = (struct timespec *)trapframe->a3;
+    uint64_t         expires = 0;
+    if (op == FUTEX_WAIT && uts) {
+        struct timespec kts;
+        if (copy_from_user(&kts, uts, sizeof(struct timespec)) != 0)
+            return -1;
+        // tv_sec is taken as ticks, same as nanosleep
+        expires = READ_ONCE(os_env.ticks) + kts.tv_sec;
     }
-    trapframe->a0 = -1;
+    return do_futex(myproc(), uaddr, op, val, expires);
 }
 
 sysret_t sys_getppid(struct trap_context *trapframe) {
@@ -289,44 +320,45 @@ static int count_strs(const char **strs) {
     return r;
 }
 
-sysret_t sys_execve(struct trap_context *trapframe) {
-    const char  *path = ustrcpy_out((char *)trapframe->a0);
-    char *const *argv = (char *const *)trapframe->a1;
-    char *const *envp = (char *const *)trapframe->a2;
-
-    int argc = 0;
-    int envc = 0;
+// Copy a NULL terminated user string array in, count is set to its length.
+static char **ustrs_copy_in(char *const *ustrs, int *count) {
+    int n = 0;
     BEGIN_UMEM_ACCESS();
-    if (argv)
-        argc = count_strs((const char **)argv);
-    if (envp)
-        envc = count_strs((const char **)envp);
-    char **kargv = (char **)kmalloc(sizeof(char *) * (argc + 1));
-    char **kenvp = (char **)kmalloc(sizeof(char *) * (envc + 1));
-    assert(kargv, "out of memory.");
-    assert(kenvp, "out of memory.");
-
-    kargv[argc] = kenvp[envc] = NULL;
-    for (int i = 0; i < argc; i++) {
-        kargv[i] = ustrcpy_out(argv[i]);
-    }
-    for (int i = 0; i < envc; i++) {
-        kenvp[i] = ustrcpy_out(envp[i]);
+    if (ustrs)
+        n = count_strs((const char **)ustrs);
+    char **kstrs = (char **)kmalloc(sizeof(char *) * (n + 1));
+    assert(kstrs, "out of memory.");
+
+    kstrs[n] = NULL;
+    for (int i = 0; i < n; i++) {
+        kstrs[i] = ustrcpy_out(ustrs[i]);
     }
     STOP_UMEM_ACCESS();
+    *count = n;
+    return kstrs;
+}
+
+static void kstrs_free(char **kstrs, int count) {
+    for (int i = 0; i < count; i++) {
+        kfree(kstrs[i]);
+    }
+    kfree(kstrs);
+}
+
+sysret_t sys_execve(struct trap_context *trapframe) {
+    const char *path = ustrcpy_out((char *)trapframe->a0);
+
+    int    argc  = 0;
+    int    envc  = 0;
+    char **kargv = ustrs_copy_in((char *const *)trapframe->a1, &argc);
+    char **kenvp = ustrs_copy_in((char *const *)trapframe->a2, &envc);
 
     // do execve
     int r = do_execve(myproc(), myproc()->cwd, path, (const char **)kargv,
                       (const char **)kenvp);
     // free resource
-    for (int i = 0; i < envc; i++) {
-        kfree(kenvp[i]);
-    }
-    for (int i = 0; i < argc; i++) {
-        kfree(kargv[i]);
-    }
-    kfree(kenvp);
-    kfree(kargv);
+    kstrs_free(kenvp, envc);
+    kstrs_free(kargv, argc);
     kfree((char *)path);
     // return argc
     if (r < 0)
@@ -335,11 +367,68 @@ sysret_t sys_execve(struct trap_context *trapframe) {
     return r;
 }
 
+sysret_t sys_spawn(struct trap_context *trapframe) {
+    const char   *path  = ustrcpy_out((char *)trapframe->a0);
+    spawn_attr_t *uattr = (spawn_attr_t *)trapframe->a3;
+    spawn_attr_t  kattr;
+    char         *cwd = NULL;
+    if (!path)
+        return -1;
+    if (uattr) {
+        if (copy_from_user(&kattr, uattr, sizeof(spawn_attr_t)) != 0 ||
+            kattr.nactions < 0 || kattr.nactions > SPAWN_MAX_ACTIONS) {
+            kfree((char *)path);
+            return -1;
+        }
+        if (kattr.cwd && (cwd = ustrcpy_out((char *)kattr.cwd)) == NULL) {
+            kfree((char *)path);
+            return -1;
+        }
+        kattr.cwd = cwd;
+    }
+
+    int    argc  = 0;
+    int    envc  = 0;
+    char **kargv = ustrs_copy_in((char *const *)trapframe->a1, &argc);
+    char **kenvp = ustrs_copy_in((char *const *)trapframe->a2, &envc);
+
+    int r = do_spawn(myproc(), path, (const char **)kargv,
+                     (const char **)kenvp, uattr ? &kattr : NULL);
+    kstrs_free(kenvp, envc);
+    kstrs_free(kargv, argc);
+    if (cwd)
+        kfree(cwd);
+    kfree((char *)path);
+    return r;
+}
+
 sysret_t sys_brk(struct trap_context *trapframe) {
     uintptr_t brk_va = (uintptr_t)(trapframe->a0);
     return do_brk(myproc(), brk_va);
 }
 
+sysret_t sys_mmap(struct trap_context *trapframe) {
+    char   *addr   = (char *)trapframe->a0;
+    size_t  len    = (size_t)trapframe->a1;
+    int     prot   = (int)trapframe->a2;
+    int     flags  = (int)trapframe->a3;
+    int     fd     = (int)trapframe->a4;
+    size_t  offset = (size_t)trapframe->a5;
+    proc_t *proc   = myproc();
+    file_t *file   = NULL;
+    if (!(flags & MAP_ANONYMOUS)) {
+        if (fd < 0 || fd >= MAX_FILE_OPEN || !(file = proc->files[fd]))
+            return -1;
+    }
+    return do_mmap(proc, addr, len, prot, flags, file, offset);
+}
+
+sysret_t sys_munmap(struct trap_context *trapframe) {
+    char  *addr = (char *)trapframe->a0;
+    size_t len  = (size_t)trapframe->a1;
+    return do_munmap(myproc(), addr, len);
+}
+
 sysret_t sys_getpid(struct trap_context *trapframe) { return myproc()->pid; }
 
 sysret_t sys_exit(struct trap_context *trapframe) {
@@ -366,6 +455,51 @@ sysret_t sys_sched_yield(struct trap_context *trapframe) {
     return 0;
 }
 
+// Only PRIO_PROCESS is supported, who is pid or 0 for self. Return the target
+// with its lock held, os_env.proc_lock keeps it from being destroyed between
+// the lookup and taking its lock.
+static proc_t *prio_target_lock(int which, pid_t who) {
+    if (which != PRIO_PROCESS || who >= PID_MAX)
+        return NULL;
+    proc_t *proc;
+    if (who == 0) {
+        proc = myproc();
+        spinlock_acquire(&proc->lock);
+        return proc;
+    }
+    spinlock_acquire(&os_env.proc_lock);
+    proc = get_proc(who);
+    if (proc)
+        spinlock_acquire(&proc->lock);
+    spinlock_release(&os_env.proc_lock);
+    return proc;
+}
+
+sysret_t sys_setpriority(struct trap_context *trapframe) {
+    int nice = (int)trapframe->a2;
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    if (nice > NICE_MAX)
+        nice = NICE_MAX;
+    proc_t *proc = prio_target_lock((int)trapframe->a0, (pid_t)trapframe->a1);
+    if (!proc)
+        return -1;
+    // only affects vruntime charged later, no need to requeue
+    proc->nice = nice;
+    spinlock_release(&proc->lock);
+    return 0;
+}
+
+// Same as Linux, return 20 - nice so that it is never negative.
+sysret_t sys_getpriority(struct trap_context *trapframe) {
+    proc_t *proc = prio_target_lock((int)trapframe->a0, (pid_t)trapframe->a1);
+    if (!proc)
+        return -1;
+    int nice = proc->nice;
+    spinlock_release(&proc->lock);
+    return 20 - nice;
+}
+
 static struct utsname build_uts_name = {.sysname  = "MFTT-RISCV",
                                         .nodename = "",
                                         .release  = "0.1.0",
@@ -394,7 +528,7 @@ sysret_t sys_getcwd(struct trap_context *trapframe) {
             ret = ubuf;
         } else {
             // alloc by our
-            char *old_brk = (char *)ROUNDUP_WITH(8, proc->prog_break);
+            char *old_brk = (char *)ROUNDUP_WITH(8, proc->mm->prog_break);
             do_brk(proc, ROUNDUP_WITH(8, old_brk + len));
             umemcpy(old_brk, kbuf, len);
             ret = old_brk;
@@ -426,15 +560,15 @@ sysret_t sys_pipe2(struct trap_context *trapframe) {
     int     kfds[2]   = {0, 0};
     file_t *kfiles[2] = {NULL, NULL};
 
-    file_t **ftable = myproc()->files;
-    int      co     = 0;
+    fdtable_t *fdt    = myproc()->fdtable;
+    file_t   **ftable = fdt->fd;
+    int        co     = 0;
+    spinlock_acquire(&fdt->lock);
     for (int i = 3; i < MAX_FILE_OPEN; i++) {
         if (ftable[i] == NULL) {
-            file_t *file = (file_t *)kmalloc(sizeof(file_t));
-            if (!file) {
-                goto failed;
-            }
-            memset(file, 0, sizeof(file_t));
+            file_t *file = vfs_alloc_file();
+            if (!file)
+                break;
             ftable[i]  = file;
             kfiles[co] = file;
             kfds[co++] = i;
@@ -442,6 +576,7 @@ sysret_t sys_pipe2(struct trap_context *trapframe) {
                 break;
         }
     }
+    spinlock_release(&fdt->lock);
     if (kfds[1] == 0)
         goto failed;
 
@@ -454,11 +589,13 @@ sysret_t sys_pipe2(struct trap_context *trapframe) {
 failed:
     for (int i = 0; i < 2; i++)
         if (kfds[i]) {
-            file_t *file = ftable[kfds[i]];
+            file_t *file = kfiles[i];
             if (file->f_fs_data && file->f_op)
                 file->f_op->close(file);
+            spinlock_acquire(&fdt->lock);
             ftable[kfds[i]] = NULL;
-            kfree(file);
+            spinlock_release(&fdt->lock);
+            vfs_free_file(file);
         }
     return -1;
 }
@@ -467,18 +604,20 @@ sysret_t sys_dup2(struct trap_context *trapframe) {
     int old_fd = (int)trapframe->a0;
     int new_fd = -1;
 
-    file_t **ftable = myproc()->files;
-    if (ftable[old_fd] == NULL)
-        return -1;
-    for (int i = 3; i < MAX_FILE_OPEN; i++) {
-        if (ftable[i] == NULL) {
-            new_fd = i;
-            break;
+    fdtable_t *fdt    = myproc()->fdtable;
+    file_t   **ftable = fdt->fd;
+    spinlock_acquire(&fdt->lock);
+    if (ftable[old_fd] != NULL) {
+        for (int i = 3; i < MAX_FILE_OPEN; i++) {
+            if (ftable[i] == NULL) {
+                new_fd = i;
+                break;
+            }
         }
+        if (new_fd != -1)
+            ftable[new_fd] = vfs_fdup(ftable[old_fd]);
     }
-    if (new_fd == -1)
-        return -1;
-    ftable[new_fd] = vfs_fdup(ftable[old_fd]);
+    spinlock_release(&fdt->lock);
 
     return new_fd;
 }
@@ -487,12 +626,18 @@ sysret_t sys_dup3(struct trap_context *trapframe) {
     int old_fd = (int)trapframe->a0;
     int new_fd = (int)trapframe->a1;
 
-    file_t **ftable = myproc()->files;
-    if (ftable[old_fd] == NULL)
+    fdtable_t *fdt    = myproc()->fdtable;
+    file_t   **ftable = fdt->fd;
+    spinlock_acquire(&fdt->lock);
+    if (ftable[old_fd] == NULL) {
+        spinlock_release(&fdt->lock);
         return -1;
-    if (ftable[new_fd] != NULL)
-        vfs_close(ftable[new_fd]);
+    }
+    file_t *old    = ftable[new_fd];
     ftable[new_fd] = vfs_fdup(ftable[old_fd]);
+    spinlock_release(&fdt->lock);
+    if (old != NULL)
+        vfs_close(old);
 
     return new_fd;
 }
@@ -550,26 +695,37 @@ sysret_t sys_times(struct trap_context *trapframe) {
     return ticks;
 }
 
+// Only RSS and faults are filled for now, ru_maxrss is the current resident
+// size.
+sysret_t sys_getrusage(struct trap_context *trapframe) {
+    int            who    = (int)trapframe->a0;
+    struct rusage *uusage = (struct rusage *)trapframe->a1;
+    if (who != RUSAGE_SELF || !uusage)
+        return -1;
+    proc_t *proc     = myproc();
+    size_t  resident = 0;
+    resident += vm_resident_pages(proc->mm->page_dir,
+                                  proc->mm->prog_image_start,
+                                  proc->mm->prog_break);
+    resident += vm_resident_pages(proc->mm->page_dir, proc->mm->stack_top,
+                                  proc->mm->stack_bottom);
+    resident += vma_resident_pages(proc);
+    struct rusage kusage;
+    memset(&kusage, 0, sizeof(struct rusage));
+    kusage.ru_maxrss = (long)(resident * PG_SIZE / 1024);
+    kusage.ru_minflt = (long)proc->page_faults;
+    umemcpy(uusage, &kusage, sizeof(struct rusage));
+    return 0;
+}
+
 sysret_t sys_nanosleep(struct trap_context *trapframe) {
     struct timespec *uts = (struct timespec *)trapframe->a0;
     if (!uts)
         return -1;
     struct timespec kts;
     umemcpy(&kts, uts, sizeof(struct timespec));
-    uint64_t ticks_to_sleep = kts.tv_sec;
-
-    uint64_t ticks = 0;
-    spinlock_acquire(&os_env.ticks_lock);
-    ticks = os_env.ticks;
-    while (os_env.ticks - ticks < ticks_to_sleep) {
-        if (myproc()->status & PROC_STATUS_STOP) {
-            spinlock_release(&os_env.ticks_lock);
-            return -1;
-        }
-        sleep(&os_env.ticks, &os_env.ticks_lock);
-    }
-    spinlock_release(&os_env.ticks_lock);
-    return 0;
+    // tv_sec is taken as ticks
+    return sleep_ticks(kts.tv_sec);
 }
 
 sysret_t sys_linkat(struct trap_context *trapframe) {
@@ -636,6 +792,7 @@ static sysret_t (*syscall_table[])(struct trap_context *) = {
     [SYS_ticks] = sys_ticks,
     [SYS_print] = NULL,
     [SYS_sleep] = sys_sleep,
+    [SYS_spawn] = sys_spawn,
     [SYS_test] = sys_test, // inside test.c, remove when stable
 
     [SYS_openat] = sys_open,
@@ -662,13 +819,17 @@ static sysret_t (*syscall_table[])(struct trap_context *) = {
     [SYS_getppid]= sys_getppid,
     [SYS_getpid]= sys_getpid,
     [SYS_brk]= sys_brk,
-    [SYS_munmap]= NULL,
-    [SYS_mmap]= NULL,
+    [SYS_munmap]= sys_munmap,
+    [SYS_mmap]= sys_mmap,
     [SYS_times]= sys_times,
+    [SYS_getrusage]= sys_getrusage,
     [SYS_uname]= sys_uname,
     [SYS_sched_yield]= sys_sched_yield,
+    [SYS_setpriority]= sys_setpriority,
+    [SYS_getpriority]= sys_getpriority,
     [SYS_gettimeofday]= sys_gettimeofday,
     [SYS_nanosleep]= sys_nanosleep,
+    [SYS_futex]= sys_futex,
 };
 
 
@@ -676,6 +837,7 @@ static const char* syscall_names[] = {
     [SYS_ticks] = "SYS_ticks",
     [SYS_print] = "SYS_print",
     [SYS_sleep] = "SYS_sleep",
+    [SYS_spawn] = "SYS_spawn",
     [SYS_test] = "SYS_test", // inside test.c, remove when stable
 
     [SYS_openat] = "SYS_openat",
@@ -705,10 +867,14 @@ static const char* syscall_names[] = {
     [SYS_munmap] = "SYS_munmap",
     [SYS_mmap] = "SYS_mmap",
     [SYS_times] = "SYS_times",
+    [SYS_getrusage] = "SYS_getrusage",
     [SYS_uname] = "SYS_uname",
     [SYS_sched_yield] = "SYS_sched_yield",
+    [SYS_setpriority] = "SYS_setpriority",
+    [SYS_getpriority] = "SYS_getpriority",
     [SYS_gettimeofday] = "SYS_gettimeofday",
     [SYS_nanosleep] = "SYS_nanosleep",
+    [SYS_futex] = "SYS_futex",
 };
 // clang-format on
 
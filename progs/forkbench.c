@@ -0,0 +1,34 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+
+// fork/exit/wait loop, measures process creation and teardown cost.
+
+#define ROUNDS 2000
+
+static inline uint64_t rdtime() {
+    uint64_t x;
+    asm volatile("rdtime %0" : "=r"(x));
+    return x;
+}
+
+int main() {
+    int      status = 0;
+    uint64_t start  = rdtime();
+    for (int i = 0; i < ROUNDS; i++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("forkbench: fork failed at round %d.\n", i);
+            exit(-1);
+        }
+        if (pid == 0)
+            exit(0);
+        wait4(pid, &status, 0);
+    }
+    uint64_t elapsed = rdtime() - start;
+    printf("forkbench: %d fork/exit/wait in %ld time ticks, %ld per round.\n",
+           ROUNDS, elapsed, elapsed / ROUNDS);
+    exit(0);
+    return 0;
+}
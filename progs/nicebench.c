@@ -0,0 +1,76 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+
+// CPU-bound hogs with different nice values spin for the same wall time while
+// a pipe ping-pong pair measures round trips. With a fair scheduler the hogs
+// share cpu by weight (nice 0 : nice 5 is about 3 : 1 on one cpu) and the
+// ping-pong pair is not starved.
+
+#define HOGS     2
+#define DURATION 50000000 // in time ticks
+#define ROUNDS   100
+
+static const int hog_nice[HOGS] = {0, 5};
+
+static inline uint64_t rdtime() {
+    uint64_t x;
+    asm volatile("rdtime %0" : "=r"(x));
+    return x;
+}
+
+static void hog(int nice, int fd) {
+    setpriority(PRIO_PROCESS, 0, nice);
+    uint64_t loops = 0;
+    uint64_t end   = rdtime() + DURATION;
+    while (rdtime() < end)
+        loops++;
+    long msg[2] = {nice, (long)loops};
+    write(fd, (char *)msg, sizeof(msg));
+    exit(0);
+}
+
+int main() {
+    int  result[2], ping[2], pong[2];
+    int  pids[HOGS + 1];
+    char byte = 'x';
+    if (pipe2(result) != 0 || pipe2(ping) != 0 || pipe2(pong) != 0) {
+        printf("nicebench: pipe2 failed.\n");
+        exit(-1);
+    }
+    for (int i = 0; i < HOGS; i++) {
+        if ((pids[i] = fork()) < 0) {
+            printf("nicebench: fork failed.\n");
+            exit(-1);
+        }
+        if (pids[i] == 0)
+            hog(hog_nice[i], result[1]);
+    }
+    if ((pids[HOGS] = fork()) == 0) {
+        for (int i = 0; i < ROUNDS; i++) {
+            read(ping[0], &byte, 1);
+            write(pong[1], &byte, 1);
+        }
+        exit(0);
+    }
+    uint64_t start = rdtime();
+    for (int i = 0; i < ROUNDS; i++) {
+        write(ping[1], &byte, 1);
+        read(pong[0], &byte, 1);
+    }
+    uint64_t elapsed = rdtime() - start;
+    printf("nicebench: %d round trips under load, %ld time ticks per trip.\n",
+           ROUNDS, elapsed / ROUNDS);
+    int status = 0;
+    for (int i = 0; i <= HOGS; i++)
+        wait4(pids[i], &status, 0);
+    for (int i = 0; i < HOGS; i++) {
+        long msg[2] = {0, 0};
+        read(result[0], (char *)msg, sizeof(msg));
+        printf("nicebench: hog with nice %ld finished %ld loops.\n", msg[0],
+               msg[1]);
+    }
+    exit(0);
+    return 0;
+}
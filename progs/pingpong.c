@@ -0,0 +1,48 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+
+// Pipe ping-pong between parent and child, every round trip is two context
+// switches. Build the kernel with ENABLE_ASID=0 and 1 to compare.
+
+#define ROUNDS 10000
+
+static inline uint64_t rdtime() {
+    uint64_t x;
+    asm volatile("rdtime %0" : "=r"(x));
+    return x;
+}
+
+int main() {
+    int  ping[2], pong[2];
+    char byte = 'x';
+    if (pipe2(ping) != 0 || pipe2(pong) != 0) {
+        printf("pingpong: pipe2 failed.\n");
+        exit(-1);
+    }
+    int pid = fork();
+    if (pid < 0) {
+        printf("pingpong: fork failed.\n");
+        exit(-1);
+    }
+    if (pid == 0) {
+        for (int i = 0; i < ROUNDS; i++) {
+            read(ping[0], &byte, 1);
+            write(pong[1], &byte, 1);
+        }
+        exit(0);
+    }
+    uint64_t start = rdtime();
+    for (int i = 0; i < ROUNDS; i++) {
+        write(ping[1], &byte, 1);
+        read(pong[0], &byte, 1);
+    }
+    uint64_t elapsed = rdtime() - start;
+    int      status  = 0;
+    wait4(pid, &status, 0);
+    printf("pingpong: %d round trips in %ld time ticks, %ld per trip.\n",
+           ROUNDS, elapsed, elapsed / ROUNDS);
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+
+// Run 1, 2, 4 ... MAX_WORKERS CPU-bound workers, each doing the same fixed
+// amount of work, and report the total throughput. Under qemu -smp N the
+// throughput should grow with workers until it reaches N.
+
+#define MAX_WORKERS 8
+#define WORK        20000000 // loop iterations per worker
+
+static inline uint64_t rdtime() {
+    uint64_t x;
+    asm volatile("rdtime %0" : "=r"(x));
+    return x;
+}
+
+static void worker() {
+    volatile uint64_t acc = 0;
+    for (uint64_t i = 0; i < WORK; i++)
+        acc += i ^ (acc >> 3);
+    exit(0);
+}
+
+int main() {
+    int      pids[MAX_WORKERS];
+    uint64_t base = 0;
+    for (int n = 1; n <= MAX_WORKERS; n *= 2) {
+        uint64_t start = rdtime();
+        for (int i = 0; i < n; i++) {
+            pids[i] = fork();
+            if (pids[i] < 0) {
+                printf("smpbench: fork failed.\n");
+                exit(-1);
+            }
+            if (pids[i] == 0)
+                worker();
+        }
+        int status = 0;
+        for (int i = 0; i < n; i++)
+            wait4(pids[i], &status, 0);
+        uint64_t elapsed = rdtime() - start;
+        // loops per million time ticks
+        uint64_t rate = (uint64_t)n * WORK / (elapsed / 1000000 + 1);
+        if (n == 1)
+            base = rate;
+        printf("smpbench: %d workers in %ld time ticks, %ld loops/Mtick, "
+               "speedup %ld.%02ld.\n",
+               n, elapsed, rate, rate / base, rate * 100 / base % 100);
+    }
+    exit(0);
+    return 0;
+}
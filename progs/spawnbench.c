@@ -0,0 +1,86 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+
+// Start a short-lived program with fork+execve and with spawn, then check
+// spawn file actions by reading the child's stdout through a pipe. The
+// program runs itself as the child.
+
+#define ROUNDS 500
+
+static inline uint64_t rdtime() {
+    uint64_t x;
+    asm volatile("rdtime %0" : "=r"(x));
+    return x;
+}
+
+// make the parent's image bigger, so fork has something to copy
+static char ballast[256 * 1024] = {1};
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "exit") == 0)
+        exit(0);
+    if (argc > 1 && strcmp(argv[1], "echo") == 0) {
+        write(1, "spawned", 7);
+        exit(0);
+    }
+    char       *self      = argc > 0 ? argv[0] : "spawnbench";
+    char *const exit_av[] = {self, "exit", NULL};
+    char *const echo_av[] = {self, "echo", NULL};
+    char *const env[]     = {NULL};
+    int         status    = 0;
+    for (size_t i = 0; i < sizeof(ballast); i += 4096)
+        ballast[i] = (char)i;
+
+    uint64_t start = rdtime();
+    for (int i = 0; i < ROUNDS; i++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("spawnbench: fork failed at round %d.\n", i);
+            exit(-1);
+        }
+        if (pid == 0) {
+            execve(self, exit_av, env);
+            exit(-1);
+        }
+        wait4(pid, &status, 0);
+    }
+    uint64_t fork_time = rdtime() - start;
+
+    start = rdtime();
+    for (int i = 0; i < ROUNDS; i++) {
+        int pid = spawn(self, exit_av, env, NULL);
+        if (pid < 0) {
+            printf("spawnbench: spawn failed at round %d: %d.\n", i, pid);
+            exit(-1);
+        }
+        wait4(pid, &status, 0);
+    }
+    uint64_t spawn_time = rdtime() - start;
+    printf("spawnbench: fork+execve %ld, spawn %ld time ticks per round.\n",
+           fork_time / ROUNDS, spawn_time / ROUNDS);
+
+    // stdout of the child goes to the pipe
+    int          fds[2];
+    char         buf[16];
+    spawn_attr_t attr;
+    if (pipe2(fds) != 0) {
+        printf("spawnbench: pipe2 failed.\n");
+        exit(-1);
+    }
+    spawn_attr_init(&attr);
+    spawn_attr_adddup2(&attr, fds[1], 1);
+    spawn_attr_addclose(&attr, fds[0]);
+    spawn_attr_addclose(&attr, fds[1]);
+    int pid = spawn(self, echo_av, env, &attr);
+    close(fds[1]);
+    int n = pid > 0 ? read(fds[0], buf, 7) : -1;
+    if (pid > 0)
+        wait4(pid, &status, 0);
+    printf("spawnbench: file actions %s.\n",
+           n == 7 && memcmp(buf, "spawned", 7) == 0 ? "ok" : "FAILED");
+    exit(0);
+    return 0;
+}
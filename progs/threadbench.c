@@ -0,0 +1,138 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+
+// Thread creation cost against fork, scaling of CPU-bound threads and a futex
+// based mutex under contention.
+
+#define ROUNDS      2000
+#define MAX_THREADS 8
+#define WORK        20000000 // loop iterations per thread
+#define LOCK_ROUNDS 100000   // lock/unlock per thread
+#define STACK_SIZE  (16 * 4096)
+
+static inline uint64_t rdtime() {
+    uint64_t x;
+    asm volatile("rdtime %0" : "=r"(x));
+    return x;
+}
+
+static char *stacks[MAX_THREADS];
+static int   tids[MAX_THREADS];
+
+static int nop(void *arg) { return 0; }
+
+static int worker(void *arg) {
+    volatile uint64_t acc = 0;
+    for (uint64_t i = 0; i < WORK; i++)
+        acc += i ^ (acc >> 3);
+    return 0;
+}
+
+// 0 unlocked, 1 locked, 2 locked with waiters. Only contended lock and
+// unlock enter the kernel.
+static int      mutex    = 0;
+static uint64_t counter  = 0;
+static uint64_t contends = 0;
+
+static void mutex_lock(int *m) {
+    int c = 0;
+    if (__atomic_compare_exchange_n(m, &c, 1, false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED))
+        return;
+    __atomic_fetch_add(&contends, 1, __ATOMIC_RELAXED);
+    if (c != 2)
+        c = __atomic_exchange_n(m, 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+        futex(m, FUTEX_WAIT, 2, NULL);
+        c = __atomic_exchange_n(m, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void mutex_unlock(int *m) {
+    if (__atomic_exchange_n(m, 0, __ATOMIC_RELEASE) == 2)
+        futex(m, FUTEX_WAKE, 1, NULL);
+}
+
+static int locker(void *arg) {
+    for (int i = 0; i < LOCK_ROUNDS; i++) {
+        mutex_lock(&mutex);
+        counter++;
+        mutex_unlock(&mutex);
+    }
+    return 0;
+}
+
+static void run_threads(int n, int (*fn)(void *)) {
+    for (int i = 0; i < n; i++) {
+        if (thread_create(fn, NULL, stacks[i] + STACK_SIZE, &tids[i]) < 0) {
+            printf("threadbench: thread_create failed.\n");
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < n; i++)
+        thread_join(&tids[i]);
+}
+
+int main() {
+    for (int i = 0; i < MAX_THREADS; i++) {
+        stacks[i] = (char *)mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (stacks[i] == MAP_FAILED) {
+            printf("threadbench: mmap failed.\n");
+            exit(-1);
+        }
+    }
+
+    // creation cost
+    int      status = 0;
+    uint64_t start  = rdtime();
+    for (int i = 0; i < ROUNDS; i++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("threadbench: fork failed at round %d.\n", i);
+            exit(-1);
+        }
+        if (pid == 0)
+            exit(0);
+        wait4(pid, &status, 0);
+    }
+    uint64_t fork_time = rdtime() - start;
+    start              = rdtime();
+    for (int i = 0; i < ROUNDS; i++)
+        run_threads(1, nop);
+    uint64_t thread_time = rdtime() - start;
+    printf("threadbench: fork/wait %ld, thread create/join %ld time ticks "
+           "per round.\n",
+           fork_time / ROUNDS, thread_time / ROUNDS);
+
+    // scaling
+    uint64_t base = 0;
+    for (int n = 1; n <= MAX_THREADS; n *= 2) {
+        start = rdtime();
+        run_threads(n, worker);
+        uint64_t elapsed = rdtime() - start;
+        uint64_t rate    = (uint64_t)n * WORK / (elapsed / 1000000 + 1);
+        if (n == 1)
+            base = rate;
+        printf("threadbench: %d threads in %ld time ticks, %ld loops/Mtick, "
+               "speedup %ld.%02ld.\n",
+               n, elapsed, rate, rate / base, rate * 100 / base % 100);
+    }
+
+    // contention
+    for (int n = 1; n <= MAX_THREADS; n *= 2) {
+        counter  = 0;
+        contends = 0;
+        start    = rdtime();
+        run_threads(n, locker);
+        uint64_t elapsed = rdtime() - start;
+        printf("threadbench: %d threads, %ld locks in %ld time ticks, "
+               "%ld contended%s.\n",
+               n, counter, elapsed, contends,
+               counter == (uint64_t)n * LOCK_ROUNDS ? "" : ", COUNT WRONG");
+    }
+    exit(0);
+    return 0;
+}
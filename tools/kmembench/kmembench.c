@@ -0,0 +1,186 @@
+/*
+ * Host side stress test for kernel/memory/kmem.c at every KMEM_DEBUG_LEVEL.
+ * kmem.c is built once per level with its functions renamed (kmalloc_l0,
+ * kmalloc_l1, ...) and linked with kstubs.c, see run.sh:
+ *
+ *   tools/kmembench/run.sh [ops] [seed]
+ *
+ * Every level runs the same random alloc/free sequence. Blocks must be
+ * aligned, zeroed and keep their contents until freed, and after everything
+ * is freed kmem_shrink must give every grown pool back. The outcome of each
+ * step is hashed, the levels must end with the same hash: debug checks may
+ * only cost time, never change what the allocator does.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SLOTS       512
+#define STATIC_POOL (64 * 1024) // small, so pools grow and shrink
+#define FLUSH_EVERY 20000       // free everything and shrink this often
+
+struct kmem_ops {
+    const char *name;
+    char *(*kmalloc)(size_t size);
+    void (*kfree)(void *p);
+    void (*attach)(char *mem, size_t sz);
+    size_t (*shrink)();
+};
+
+#define DECLARE_LEVEL(l)                                                       \
+    char  *kmalloc_l##l(size_t size);                                          \
+    void   kfree_l##l(void *p);                                                \
+    void   attach_to_memory_pool_l##l(char *mem, size_t sz);                   \
+    size_t kmem_shrink_l##l();
+#define LEVEL(l)                                                               \
+    {                                                                          \
+        "KMEM_DEBUG_LEVEL=" #l, kmalloc_l##l, kfree_l##l,                      \
+            attach_to_memory_pool_l##l, kmem_shrink_l##l                       \
+    }
+
+DECLARE_LEVEL(0)
+DECLARE_LEVEL(1)
+DECLARE_LEVEL(2)
+
+static struct kmem_ops levels[] = {LEVEL(0), LEVEL(1), LEVEL(2)};
+
+// kstubs.c
+void          stub_init();
+extern size_t stub_pages_used;
+
+static const char *current_level;
+static uint64_t    current_step;
+
+_Noreturn void host_panic(const char *file, int line, const char *msg) {
+    printf("FAIL: %s step %lu: kernel panic at %s:%d: %s\n", current_level,
+           current_step, file, line, msg);
+    exit(1);
+}
+
+void *host_memset(void *dst, int ch, size_t size) {
+    return memset(dst, ch, size);
+}
+
+#define CHECK(cond, ...)                                                       \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("FAIL: %s step %lu: ", current_level, current_step);        \
+            printf(__VA_ARGS__);                                               \
+            exit(1);                                                           \
+        }                                                                      \
+    } while (0)
+
+static uint64_t rng;
+
+static uint64_t next_rand() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// mostly small objects, some medium, a few large ones bypassing the pools
+static size_t random_size() {
+    uint64_t r = next_rand() % 100;
+    if (r < 70)
+        return 1 + next_rand() % 256;
+    if (r < 95)
+        return 257 + next_rand() % 1792;
+    return 2049 + next_rand() % (16 * 1024);
+}
+
+struct slot {
+    unsigned char *p;
+    size_t         size;
+    unsigned char  tag;
+};
+
+static struct slot slots[SLOTS];
+static char __attribute__((aligned(16))) static_pool[3][STATIC_POOL];
+
+static uint64_t hash_mix(uint64_t h, uint64_t v) {
+    return (h ^ v) * 0x100000001B3UL;
+}
+
+static uint64_t release(struct kmem_ops *ops, struct slot *s) {
+    for (size_t i = 0; i < s->size; i++)
+        CHECK(s->p[i] == s->tag, "block of %zu bytes corrupted at %zu\n",
+              s->size, i);
+    ops->kfree(s->p);
+    s->p = NULL;
+    return s->size;
+}
+
+static uint64_t run(struct kmem_ops *ops, int index, uint64_t ops_count,
+                    uint64_t seed, double *elapsed) {
+    uint64_t h = 0xCBF29CE484222325UL;
+    rng        = seed;
+    memset(slots, 0, sizeof(slots));
+    current_level = ops->name;
+    stub_init();
+    ops->attach(static_pool[index], STATIC_POOL);
+
+    clock_t start = clock();
+    for (current_step = 0; current_step < ops_count; current_step++) {
+        struct slot *s = &slots[next_rand() % SLOTS];
+        if (s->p) {
+            h = hash_mix(h, release(ops, s));
+        } else {
+            s->size = random_size();
+            s->tag  = (unsigned char)(current_step | 1);
+            s->p    = (unsigned char *)ops->kmalloc(s->size);
+            CHECK(s->p, "kmalloc(%zu) failed\n", s->size);
+            CHECK(((uintptr_t)s->p & 7) == 0, "kmalloc(%zu) misaligned %p\n",
+                  s->size, s->p);
+            for (size_t i = 0; i < s->size; i++)
+                CHECK(s->p[i] == 0, "kmalloc(%zu) not zeroed at %zu\n",
+                      s->size, i);
+            memset(s->p, s->tag, s->size);
+            h = hash_mix(h, s->size);
+        }
+        if ((current_step + 1) % FLUSH_EVERY == 0) {
+            for (int i = 0; i < SLOTS; i++)
+                if (slots[i].p)
+                    h = hash_mix(h, release(ops, &slots[i]));
+            ops->shrink();
+            // every grown pool coalesced back into one free block
+            CHECK(stub_pages_used == 0, "%zu pages still used after shrink\n",
+                  stub_pages_used);
+            h = hash_mix(h, current_step);
+        }
+    }
+    for (int i = 0; i < SLOTS; i++)
+        if (slots[i].p)
+            release(ops, &slots[i]);
+    ops->shrink();
+    CHECK(stub_pages_used == 0, "%zu pages still used at end\n",
+          stub_pages_used);
+    *elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    return h;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t ops_count = argc > 1 ? strtoull(argv[1], NULL, 0) : 200000;
+    uint64_t seed      = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x9E3779B9;
+    uint64_t expected  = 0;
+    if (seed == 0)
+        seed = 1; // xorshift sticks at 0
+    for (int i = 0; i < 3; i++) {
+        double   elapsed;
+        uint64_t h = run(&levels[i], i, ops_count, seed, &elapsed);
+        printf("%s: %lu ops in %.3f s (%.0f ns/op), hash %016lx\n",
+               levels[i].name, ops_count, elapsed, elapsed * 1e9 / ops_count,
+               h);
+        if (i == 0)
+            expected = h;
+        else if (h != expected) {
+            printf("FAIL: %s differs from %s\n", levels[i].name,
+                   levels[0].name);
+            return 1;
+        }
+    }
+    printf("check ok\n");
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Kernel side stubs for kmembench, built with kernel headers like kmem.c.
+ * Pages come from a static arena described by memory_info, so kfree can tell
+ * large kmalloc blocks by their page type. Everything runs on one thread, the
+ * locks only check that they are balanced.
+ */
+#include <driver/console.h>
+#include <lib/stdlib.h>
+#include <lib/sys/spinlock.h>
+#include <memory.h>
+
+#define ARENA_PAGES 8192 // 32MB
+
+extern _Noreturn void host_panic(const char *file, int line, const char *msg);
+extern void          *host_memset(void *dst, int ch, size_t size);
+
+struct memory_info_t memory_info;
+
+static char __attribute__((aligned(PG_SIZE))) arena[ARENA_PAGES * PG_SIZE];
+static struct page_info pages_info[ARENA_PAGES];
+
+size_t stub_pages_used;
+
+void stub_init() {
+    memory_info.memory_start        = arena;
+    memory_info.memory_end          = arena + sizeof(arena);
+    memory_info.usable_memory_start = arena;
+    memory_info.usable_memory_end   = arena + sizeof(arena);
+    memory_info.page_count          = ARENA_PAGES;
+    memory_info.pages_info          = pages_info;
+    host_memset(pages_info, 0, sizeof(pages_info));
+    stub_pages_used = 0;
+}
+
+// first fit, good enough for a few hundred blocks
+char *page_alloc(size_t pages, int attr) {
+    for (size_t i = 0; i + pages <= ARENA_PAGES; i++) {
+        size_t n = 0;
+        while (n < pages && pages_info[i + n].type == 0)
+            n++;
+        if (n < pages) {
+            i += n;
+            continue;
+        }
+        for (n = 0; n < pages; n++)
+            pages_info[i + n].type = (attr & ~PAGE_ALLOC_ZERO) | PAGE_TYPE_INUSE;
+        stub_pages_used += pages;
+        char *p = arena + i * PG_SIZE;
+        // stale data would hide missing initialization in kmem
+        host_memset(p, (attr & PAGE_ALLOC_ZERO) ? 0 : 0x5A, pages * PG_SIZE);
+        return p;
+    }
+    return NULL;
+}
+
+int page_free(char *p, size_t pages) {
+    size_t id = (p - arena) / PG_SIZE;
+    if (p < arena || id + pages > ARENA_PAGES || (p - arena) % PG_SIZE)
+        host_panic(__FILE__, __LINE__, "page_free: bad address");
+    for (size_t i = 0; i < pages; i++) {
+        if (pages_info[id + i].type == 0)
+            host_panic(__FILE__, __LINE__, "page_free: double free");
+        pages_info[id + i].type = 0;
+    }
+    stub_pages_used -= pages;
+    return 0;
+}
+
+kmem_cache_t *kmem_cache_of(void *obj) { return NULL; }
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    host_panic(__FILE__, __LINE__, "kmem_cache_free: no slab here");
+}
+
+void spinlock_init(spinlock_t *pLock) { pLock->lock = false; }
+
+void spinlock_acquire(spinlock_t *pLock) {
+    if (pLock->lock)
+        host_panic(__FILE__, __LINE__, "spinlock: acquired twice");
+    pLock->lock = true;
+}
+
+void spinlock_release(spinlock_t *pLock) {
+    if (!pLock->lock)
+        host_panic(__FILE__, __LINE__, "spinlock: not acquired");
+    pLock->lock = false;
+}
+
+void kprintf(const char *fmt, ...) {}
+
+_Noreturn void kpanic_proto(const char *s_fn, const char *b_fn, const int line,
+                            const char *fmt, ...) {
+    host_panic(s_fn, line, fmt);
+}
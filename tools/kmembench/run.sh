@@ -0,0 +1,22 @@
+#!/bin/sh
+# Build kernel/memory/kmem.c at every KMEM_DEBUG_LEVEL for the host and run
+# kmembench on them. Run from the repository root, arguments go to kmembench.
+set -e
+OUT=${OUT:-/tmp/kmembench}
+mkdir -p "$OUT"
+KFLAGS="-O2 -ffreestanding -fno-builtin -fno-strict-aliasing -nostdinc \
+    -isystem kernel/header -isystem header \
+    -isystem $(gcc -print-file-name=include)"
+for l in 0 1 2; do
+    gcc $KFLAGS -DKMEM_DEBUG_LEVEL=$l \
+        -Dkmalloc=kmalloc_l$l -Dkfree=kfree_l$l \
+        -Dattach_to_memory_pool=attach_to_memory_pool_l$l \
+        -Dkmem_shrink=kmem_shrink_l$l \
+        -Dprint_kmem_pool_info=print_kmem_pool_info_l$l \
+        -c kernel/memory/kmem.c -o "$OUT/kmem_l$l.o"
+done
+gcc $KFLAGS -c kernel/lib/rb_tree.c -o "$OUT/rb_tree.o"
+gcc $KFLAGS -c tools/kmembench/kstubs.c -o "$OUT/kstubs.o"
+gcc -O2 tools/kmembench/kmembench.c "$OUT"/kmem_l*.o "$OUT/rb_tree.o" \
+    "$OUT/kstubs.o" -o "$OUT/kmembench"
+"$OUT/kmembench" "$@"
@@ -0,0 +1,201 @@
+/*
+ * Host side check and microbenchmark for kernel/lib/string.c.
+ * The kernel functions are renamed with k_ prefix so they can live with libc:
+ *
+ *   gcc -O2 -ffreestanding -fno-builtin -fno-strict-aliasing -nostdinc \
+ *       -isystem kernel/header -isystem header \
+ *       -isystem $(gcc -print-file-name=include) \
+ *       -Dmemcpy=k_memcpy -Dmemset=k_memset -Dstrlen=k_strlen \
+ *       -Dstrcmp=k_strcmp -Dstrcpy=k_strcpy -Dmemcmp=k_memcmp \
+ *       -c kernel/lib/string.c -o /tmp/kstring.o
+ *   gcc -O2 tools/strbench/strbench.c /tmp/kstring.o -o /tmp/strbench
+ *   /tmp/strbench
+ *
+ * The byte-at-a-time versions are kept below as baseline.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void  *k_memcpy(void *dst, const void *src, size_t size);
+void  *k_memset(void *dst, char ch, size_t size);
+size_t k_strlen(const char *s);
+int    k_strcmp(const char *cs, const char *ct);
+
+static void *b_memcpy(void *dst, const void *src, size_t size) {
+    const volatile char *s = src;
+    volatile char       *d = dst;
+    if (s < d && s + size > d) {
+        s += size;
+        d += size;
+        while (size-- > 0)
+            *--d = *--s;
+    } else
+        while (size-- > 0)
+            *d++ = *s++;
+    return dst;
+}
+
+static void *b_memset(void *dst, char ch, size_t size) {
+    volatile char *s = dst;
+    while (size--)
+        *(s++) = ch;
+    return dst;
+}
+
+static size_t b_strlen(const char *s) {
+    const volatile char *eos = s;
+    while (*eos++)
+        ;
+    return (eos - s - 1);
+}
+
+static int b_strcmp(const char *cs, const char *ct) {
+    const volatile unsigned char *c1 = (const unsigned char *)cs;
+    const volatile unsigned char *c2 = (const unsigned char *)ct;
+    while (1) {
+        if (*c1 != *c2)
+            return *c1 < *c2 ? -1 : 1;
+        if (!*c1)
+            break;
+        c1++;
+        c2++;
+    }
+    return 0;
+}
+
+static int sign(int x) { return (x > 0) - (x < 0); }
+
+#define CHECK(cond, ...)                                                       \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("FAIL: " __VA_ARGS__);                                      \
+            exit(1);                                                           \
+        }                                                                      \
+    } while (0)
+
+static void check() {
+    static unsigned char a[512], b[512], ref[512];
+    for (size_t len = 0; len < 200; len++)
+        for (int so = 0; so < 8; so++)
+            for (int dof = -40; dof < 40; dof++) {
+                for (int i = 0; i < 512; i++)
+                    a[i] = ref[i] = (unsigned char)(i * 7 + 3);
+                unsigned char *src = a + 100 + so;
+                memmove(ref + 100 + so + dof, ref + 100 + so, len);
+                k_memcpy(src + dof, src, len);
+                CHECK(memcmp(a, ref, 512) == 0, "memcpy len %zu so %d dof %d\n",
+                      len, so, dof);
+            }
+    for (size_t len = 0; len < 200; len++)
+        for (int off = 0; off < 8; off++) {
+            memset(a, 1, 512);
+            memset(ref, 1, 512);
+            memset(ref + off, 0xAB, len);
+            k_memset(a + off, (char)0xAB, len);
+            CHECK(memcmp(a, ref, 512) == 0, "memset len %zu off %d\n", len,
+                  off);
+        }
+    for (size_t len = 0; len < 100; len++)
+        for (int off = 0; off < 8; off++) {
+            memset(a, 0x80 | 'x', 512);
+            a[off + len] = 0;
+            CHECK(k_strlen((char *)a + off) == len, "strlen %zu %d\n", len,
+                  off);
+            for (int boff = 0; boff < 8; boff++)
+                for (size_t diff = 0; diff <= len; diff++) {
+                    memcpy(b + boff, a + off, len + 1);
+                    if (diff < len)
+                        b[boff + diff] ^= (diff & 1) ? 0x01 : 0xFF;
+                    const char *x = (char *)a + off, *y = (char *)b + boff;
+                    CHECK(sign(k_strcmp(x, y)) == sign(strcmp(x, y)) &&
+                              sign(k_strcmp(y, x)) == sign(strcmp(y, x)),
+                          "strcmp %zu %d %d %zu\n", len, off, boff, diff);
+                }
+        }
+    printf("check ok\n");
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define TOTAL (256UL << 20) // bytes processed per measurement
+
+static char buf_src[8192 + 64], buf_dst[8192 + 64];
+
+static void bench_one(const char *name, size_t size, int misalign) {
+    size_t rounds = TOTAL / size;
+    char  *s = buf_src + misalign, *d = buf_dst;
+    double t0, tb, tk;
+
+    t0 = now();
+    if (!strcmp(name, "memcpy"))
+        for (size_t i = 0; i < rounds; i++)
+            b_memcpy(d, s, size);
+    else if (!strcmp(name, "memset"))
+        for (size_t i = 0; i < rounds; i++)
+            b_memset(s, (char)i, size);
+    tb = now() - t0;
+
+    t0 = now();
+    if (!strcmp(name, "memcpy"))
+        for (size_t i = 0; i < rounds; i++)
+            k_memcpy(d, s, size);
+    else if (!strcmp(name, "memset"))
+        for (size_t i = 0; i < rounds; i++)
+            k_memset(s, (char)i, size);
+    tk = now() - t0;
+    printf("%-7s %5zu  +%d  %8.1f MB/s  %8.1f MB/s  x%.1f\n", name, size,
+           misalign, TOTAL / tb / 1e6, TOTAL / tk / 1e6, tb / tk);
+}
+
+static void bench_str(size_t len, int misalign) {
+    size_t rounds = TOTAL / len;
+    char  *s = buf_src + misalign, *d = buf_dst + misalign;
+    memset(s, 'a', len);
+    s[len] = 0;
+    memcpy(d, s, len + 1);
+    volatile size_t sink = 0;
+    double          t0, tb, tk;
+
+    t0 = now();
+    for (size_t i = 0; i < rounds; i++)
+        sink += b_strlen(s);
+    tb = now() - t0;
+    t0 = now();
+    for (size_t i = 0; i < rounds; i++)
+        sink += k_strlen(s);
+    tk = now() - t0;
+    printf("%-7s %5zu  +%d  %8.1f MB/s  %8.1f MB/s  x%.1f\n", "strlen", len,
+           misalign, TOTAL / tb / 1e6, TOTAL / tk / 1e6, tb / tk);
+
+    t0 = now();
+    for (size_t i = 0; i < rounds; i++)
+        sink += b_strcmp(s, d);
+    tb = now() - t0;
+    t0 = now();
+    for (size_t i = 0; i < rounds; i++)
+        sink += k_strcmp(s, d);
+    tk = now() - t0;
+    printf("%-7s %5zu  +%d  %8.1f MB/s  %8.1f MB/s  x%.1f\n", "strcmp", len,
+           misalign, TOTAL / tb / 1e6, TOTAL / tk / 1e6, tb / tk);
+}
+
+int main() {
+    check();
+    printf("func     size  off  byte-wise        word-wise\n");
+    size_t sizes[] = {16, 64, 256, 4096, 8192};
+    for (int i = 0; i < 5; i++)
+        for (int m = 0; m < 8; m += 3) {
+            bench_one("memcpy", sizes[i], m);
+            bench_one("memset", sizes[i], m);
+        }
+    for (int i = 0; i < 4; i++)
+        for (int m = 0; m < 8; m += 3)
+            bench_str(sizes[i], m);
+    return 0;
+}
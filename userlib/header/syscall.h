@@ -35,21 +35,39 @@ int umount2(const char *path, int flags);
 int mount(const char *dev, const char *dir, const char *fstype, uint64_t flags,
           const void *data);
 int fstat(int fd, kstat_t *kst);
-int clone(int flags, char *stack, int ptid, int tls, int ctid);
+int clone(int flags, char *stack, int *ptid, void *tls, int *ctid);
 int fork();
 int execve(const char *path, char *const argv[], char *const envp[]);
+// Start path in a new child process without copying our address space, attr
+// may be NULL. Return the child pid.
+int spawn(const char *path, char *const argv[], char *const envp[],
+          const spawn_attr_t *attr);
+void spawn_attr_init(spawn_attr_t *attr);
+int  spawn_attr_adddup2(spawn_attr_t *attr, int fd, int newfd);
+int  spawn_attr_addclose(spawn_attr_t *attr, int fd);
 int wait4(int pid, int *status, int options);
 void      exit(int ec);
 int       getppid();
 int       getpid();
 uintptr_t brk(uintptr_t brk);
 int       munmap(void *start, size_t len);
-uintptr_t mmap(void *start, size_t len, int prot, int fd, size_t offset);
+uintptr_t mmap(void *start, size_t len, int prot, int flags, int fd,
+               size_t offset);
 uint64_t  times(struct tms *tms);
+int       getrusage(int who, struct rusage *usage);
 int       uname(struct utsname *uts);
 int       sched_yield();
+int       setpriority(int which, int who, int prio);
+int       getpriority(int which, int who);
 int       gettimeofday(struct timespec *ts);
 int       nanosleep(struct timespec *req, struct timespec *rem);
+int       futex(int *uaddr, int op, int val, struct timespec *timeout);
+
+// Threads sharing the address space, *tid is set to the thread id and
+// cleared when the thread exits. fn runs on stack, and its return value is
+// the exit code.
+int  thread_create(int (*fn)(void *), void *arg, char *stack, int *tid);
+void thread_join(int *tid);
 
 // For development test
 int syscall_test(uint64_t a1, uint64_t a2);
@@ -4,6 +4,85 @@
 
 #include <string.h>
 
+/*
+ * 按64位字处理：先逐字节把dst对齐到8字节，src也对齐时每次拷贝4个字(32字节)，
+ * 否则每次读取src所在的两个对齐字，移位拼接出一个字，避免非对齐访问
+ * (在RISC-V上可能陷入M态模拟，非常慢)。
+ * 所有字读取都是对齐的，且至少包含一个有效字节，因此不会越过页边界。
+ * strlen/strcmp一次检查一个字中是否有0字节。
+ */
+#define WORD_SIZE      sizeof(uint64_t)
+#define WORD_MASK      (WORD_SIZE - 1)
+#define ALIGNED(p)     (((uintptr_t)(p)&WORD_MASK) == 0)
+#define REPEAT_BYTE(c) ((uint64_t)(uint8_t)(c)*0x0101010101010101ULL)
+#define SAME_ALIGN(a, b)                                                       \
+    ((((uintptr_t)(a) ^ (uintptr_t)(b)) & WORD_MASK) == 0)
+// 每个为0的字节对应位置为0x80，其余为0，不受进位影响
+#define ZERO_BYTES(x)                                                          \
+    (~((((x)&0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | (x) |          \
+       0x7F7F7F7F7F7F7F7FULL))
+
+// dst对齐，从前向后拷贝size / WORD_SIZE个字，返回拷贝的字节数
+static size_t copy_words_fwd(char *d, const char *s, size_t size) {
+    uint64_t *wd    = (uint64_t *)d;
+    size_t    words = size / WORD_SIZE;
+    if (ALIGNED(s)) {
+        const uint64_t *ws = (const uint64_t *)s;
+        size_t          i  = 0;
+        for (; i + 4 <= words; i += 4) {
+            uint64_t w0 = ws[i], w1 = ws[i + 1];
+            uint64_t w2 = ws[i + 2], w3 = ws[i + 3];
+            wd[i]       = w0;
+            wd[i + 1]   = w1;
+            wd[i + 2]   = w2;
+            wd[i + 3]   = w3;
+        }
+        for (; i < words; i++)
+            wd[i] = ws[i];
+    } else {
+        // 小端序，低地址字节在低位
+        size_t          shift = ((uintptr_t)s & WORD_MASK) * 8;
+        const uint64_t *ws    = (const uint64_t *)((uintptr_t)s & ~WORD_MASK);
+        uint64_t        lo    = ws[0];
+        for (size_t i = 0; i < words; i++) {
+            uint64_t hi = ws[i + 1];
+            wd[i]       = (lo >> shift) | (hi << (64 - shift));
+            lo          = hi;
+        }
+    }
+    return words * WORD_SIZE;
+}
+
+// dst末尾对齐，从后向前拷贝size / WORD_SIZE个字，d和s指向末尾
+static size_t copy_words_bwd(char *d, const char *s, size_t size) {
+    uint64_t *wd    = (uint64_t *)d;
+    size_t    words = size / WORD_SIZE;
+    if (ALIGNED(s)) {
+        const uint64_t *ws = (const uint64_t *)s;
+        size_t          i  = 1;
+        for (; i + 3 <= words; i += 4) {
+            uint64_t w0   = *(ws - i), w1 = *(ws - i - 1);
+            uint64_t w2   = *(ws - i - 2), w3 = *(ws - i - 3);
+            *(wd - i)     = w0;
+            *(wd - i - 1) = w1;
+            *(wd - i - 2) = w2;
+            *(wd - i - 3) = w3;
+        }
+        for (; i <= words; i++)
+            *(wd - i) = *(ws - i);
+    } else {
+        size_t          shift = ((uintptr_t)s & WORD_MASK) * 8;
+        const uint64_t *ws    = (const uint64_t *)((uintptr_t)s & ~WORD_MASK);
+        uint64_t        hi    = ws[0];
+        for (size_t i = 1; i <= words; i++) {
+            uint64_t lo = *(ws - i);
+            *(wd - i)   = (lo >> shift) | (hi << (64 - shift));
+            hi          = lo;
+        }
+    }
+    return words * WORD_SIZE;
+}
+
 void *memcpy(void *dst, const void *src, size_t size) {
     const char *s;
     char       *d;
@@ -13,11 +92,32 @@ void *memcpy(void *dst, const void *src, size_t size) {
         s + size > d) { // 当src和dst有重叠时从后向前拷贝，避免覆盖产生的错误
         s += size;
         d += size;
+        if (size >= 2 * WORD_SIZE) {
+            while (!ALIGNED(d)) {
+                *--d = *--s;
+                size--;
+            }
+            size_t n = copy_words_bwd(d, s, size);
+            d -= n;
+            s -= n;
+            size -= n;
+        }
         while (size-- > 0)
             *--d = *--s;
-    } else
+    } else {
+        if (size >= 2 * WORD_SIZE) {
+            while (!ALIGNED(d)) {
+                *d++ = *s++;
+                size--;
+            }
+            size_t n = copy_words_fwd(d, s, size);
+            d += n;
+            s += n;
+            size -= n;
+        }
         while (size-- > 0)
             *d++ = *s++;
+    }
     return dst;
 }
 
@@ -32,22 +132,66 @@ char *strcpy(char *dst, char *src) {
 }
 
 size_t strlen(const char *s) {
-    const char *eos = s;
-    while (*eos++)
-        ;
-    return (eos - s - 1);
+    const char *p = s;
+    while (!ALIGNED(p)) {
+        if (!*p)
+            return p - s;
+        p++;
+    }
+    const uint64_t *w = (const uint64_t *)p;
+    while (!ZERO_BYTES(*w))
+        w++;
+    p = (const char *)w;
+    while (*p)
+        p++;
+    return p - s;
 }
 
 void *memset(void *dst, char ch, size_t size) {
-    char *cdst = (char *)dst;
-    for (size_t i = 0; i < size; i++)
-        cdst[i] = ch;
+    char *s = (char *)dst;
+    while (size > 0 && !ALIGNED(s)) {
+        *(s++) = ch;
+        size--;
+    }
+    uint64_t  pattern = REPEAT_BYTE(ch);
+    uint64_t *w       = (uint64_t *)s;
+    for (; size >= 4 * WORD_SIZE; size -= 4 * WORD_SIZE) {
+        w[0] = pattern;
+        w[1] = pattern;
+        w[2] = pattern;
+        w[3] = pattern;
+        w += 4;
+    }
+    for (; size >= WORD_SIZE; size -= WORD_SIZE)
+        *(w++) = pattern;
+    s = (char *)w;
+    while (size--)
+        *(s++) = ch;
     return dst;
 }
 
 int strcmp(const char *cs, const char *ct) {
     unsigned char *c1 = (unsigned char *)cs;
     unsigned char *c2 = (unsigned char *)ct;
+    if (SAME_ALIGN(c1, c2)) {
+        while (!ALIGNED(c1)) {
+            if (*c1 != *c2)
+                return *c1 < *c2 ? -1 : 1;
+            if (!*c1)
+                return 0;
+            c1++;
+            c2++;
+        }
+        const uint64_t *w1 = (const uint64_t *)c1;
+        const uint64_t *w2 = (const uint64_t *)c2;
+        // 找到第一个不同或含0的字，再逐字节比较
+        while (*w1 == *w2 && !ZERO_BYTES(*w1)) {
+            w1++;
+            w2++;
+        }
+        c1 = (unsigned char *)w1;
+        c2 = (unsigned char *)w2;
+    }
     while (1) {
         if (*c1 != *c2)
             return *c1 < *c2 ? -1 : 1;
@@ -100,12 +100,35 @@ int mount(const char *dev, const char *dir, const char *fstype, uint64_t flags,
 }
 int fstat(int fd, kstat_t *kst) { return SYSCALL(SYS_fstat, fd, kst); }
 int fork() { return SYSCALL(SYS_clone, SIGCHLD, 0); }
-int clone(int flags, char *stack, int ptid, int tls, int ctid) {
+int clone(int flags, char *stack, int *ptid, void *tls, int *ctid) {
     return SYSCALL(SYS_clone, flags, stack, ptid, tls, ctid);
 }
 int execve(const char *path, char *const argv[], char *const envp[]) {
     return SYSCALL(SYS_execve, path, argv, envp);
 }
+int spawn(const char *path, char *const argv[], char *const envp[],
+          const spawn_attr_t *attr) {
+    return SYSCALL(SYS_spawn, path, argv, envp, attr);
+}
+void spawn_attr_init(spawn_attr_t *attr) {
+    attr->cwd      = NULL;
+    attr->nactions = 0;
+}
+static int spawn_attr_add(spawn_attr_t *attr, int action, int fd, int newfd) {
+    if (attr->nactions == SPAWN_MAX_ACTIONS)
+        return -1;
+    struct spawn_file_action *fa = &attr->actions[attr->nactions++];
+    fa->action                   = action;
+    fa->fd                       = fd;
+    fa->newfd                    = newfd;
+    return 0;
+}
+int spawn_attr_adddup2(spawn_attr_t *attr, int fd, int newfd) {
+    return spawn_attr_add(attr, SPAWN_FA_DUP2, fd, newfd);
+}
+int spawn_attr_addclose(spawn_attr_t *attr, int fd) {
+    return spawn_attr_add(attr, SPAWN_FA_CLOSE, fd, -1);
+}
 int wait4(int pid, int *status, int options) {
     return SYSCALL(SYS_wait4, pid, status, options);
 }
@@ -114,16 +137,68 @@ int       getppid() { return SYSCALL(SYS_getppid); }
 int       getpid() { return SYSCALL(SYS_getpid); }
 uintptr_t brk(uintptr_t _brk) { return SYSCALL(SYS_brk, _brk); }
 int munmap(void *start, size_t len) { return SYSCALL(SYS_munmap, start, len); }
-uintptr_t mmap(void *start, size_t len, int prot, int fd, size_t offset) {
-    return SYSCALL(SYS_mmap, start, len, prot, fd, offset);
+uintptr_t mmap(void *start, size_t len, int prot, int flags, int fd,
+               size_t offset) {
+    return SYSCALL(SYS_mmap, start, len, prot, flags, fd, offset);
 }
 uint64_t times(struct tms *tms) { return SYSCALL(SYS_times, tms); }
+int getrusage(int who, struct rusage *usage) {
+    return SYSCALL(SYS_getrusage, who, usage);
+}
 int      uname(struct utsname *uts) { return SYSCALL(SYS_uname, uts); }
 int      sched_yield() { return SYSCALL(SYS_sched_yield); }
+int setpriority(int which, int who, int prio) {
+    return SYSCALL(SYS_setpriority, which, who, prio);
+}
+int getpriority(int which, int who) {
+    int r = SYSCALL(SYS_getpriority, which, who);
+    return r < 0 ? r : 20 - r;
+}
 int gettimeofday(struct timespec *ts) { return SYSCALL(SYS_gettimeofday, ts); }
 int nanosleep(struct timespec *req, struct timespec *rem) {
     return SYSCALL(SYS_nanosleep, req, rem);
 }
+int futex(int *uaddr, int op, int val, struct timespec *timeout) {
+    return SYSCALL(SYS_futex, uaddr, op | FUTEX_PRIVATE_FLAG, val, timeout);
+}
+
+#define THREAD_FLAGS                                                           \
+    (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD |        \
+     CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID)
+
+// The child can't return from here, its stack has no frame of ours. fn and
+// arg are left on the new stack, the child calls fn and exits with its
+// return value.
+int thread_create(int (*fn)(void *), void *arg, char *stack, int *tid) {
+    uint64_t *sp = (uint64_t *)((uintptr_t)stack & ~15UL) - 2;
+    sp[0]        = (uint64_t)fn;
+    sp[1]        = (uint64_t)arg;
+    register uint64_t a0 asm("a0") = THREAD_FLAGS;
+    register uint64_t a1 asm("a1") = (uint64_t)sp;
+    register uint64_t a2 asm("a2") = (uint64_t)tid;
+    register uint64_t a3 asm("a3") = 0;
+    register uint64_t a4 asm("a4") = (uint64_t)tid;
+    register long     a7 asm("a7") = SYS_clone;
+    asm volatile("ecall\n"
+                 "bnez a0, 1f\n"
+                 "ld a1, 0(sp)\n"
+                 "ld a0, 8(sp)\n"
+                 "jalr a1\n"
+                 "li a7, %[sys_exit]\n"
+                 "ecall\n"
+                 "1:\n"
+                 : "+r"(a0)
+                 : "r"(a1), "r"(a2), "r"(a3), "r"(a4), "r"(a7),
+                   [sys_exit] "i"(SYS_exit)
+                 : "memory");
+    return (int)a0;
+}
+
+void thread_join(int *tid) {
+    int t;
+    while ((t = *(volatile int *)tid) != 0)
+        futex(tid, FUTEX_WAIT, t, NULL);
+}
 
 // For developments tests.
 int syscall_test(uint64_t a1, uint64_t a2) { return SYSCALL(SYS_test, a1, a2); }